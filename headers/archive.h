@@ -0,0 +1,148 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Archive of every encoded frame in memory-mapped segment files on local
+// flash, each with an index of fixed-size records.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#ifndef ARCHIVE_H
+	#define ARCHIVE_H
+
+	#include <stdlib.h>
+	#include <stdio.h>
+	#include <stdint.h>
+	#include <stdbool.h>
+	#include <stdatomic.h>
+	#include <string.h>
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <pthread.h>
+	#include <semaphore.h>
+	#include <dirent.h>
+	#include <sys/mman.h>
+	#include "../headers/util.h"
+	#include "../headers/frmring.h"
+
+	#define ARCHIVE_MAGIC			"HCAR"
+	#define ARCHIVE_VERSION			1
+	#define ARCHIVE_SEGMENT_BYTES	(64 << 20)	// default segment file size
+	#define ARCHIVE_MIN_SEGMENT		(1 << 20)
+	#define ARCHIVE_BYTES_PER_ENTRY	4096		// bytes per index record
+	#define ARCHIVE_QUEUE_BYTES		(4 << 20)	// frames waiting for the writer
+	#define ARCHIVE_SYNC_BYTES		(1 << 20)	// write back once this is dirty
+	#define ARCHIVE_SYNC_MS			2000		// or this long after a frame
+	#define ARCHIVE_TABLES_BYTES	2048		// largest tables stream kept
+	#define ARCHIVE_PAGE			4096
+	#define ARCHIVE_MAX_SEGMENTS	100000		// segNNNNN.hca
+
+	// Start of each segment file. Numbers are in the byte order of the
+	// camera, little-endian on the boards it flies on.
+	struct archiveHeader
+	{
+		char magic[4];			// ARCHIVE_MAGIC
+		uint16_t version;
+		uint16_t entrySize;		// sizeof(struct archiveEntry)
+		uint32_t entries;		// index records the segment has room for
+		uint32_t count;			// index records written back so far
+		uint64_t dataOffset;	// where the images start, after the index
+		uint64_t bytes;			// size of the segment file when it was made
+	};
+
+	// One image in a segment, straight after the header. Records past count
+	// are zero, or were written after the last write back; a reader can
+	// take any whose CRC checks.
+	struct archiveEntry
+	{
+		uint32_t sequence;		// capture sequence number
+		uint32_t length;		// bytes of image
+		uint64_t captureUs;		// CLOCK_MONOTONIC capture time
+		uint64_t offset;		// of the image from the start of the file
+		uint32_t crc;			// CRC-32 (IEEE 802.3, as zlib) of the image
+		uint8_t kind;			// RECORD_FRAME or RECORD_TABLES
+		uint8_t tablesId;		// tables a frame needs or a tables record holds
+		uint16_t reserved;
+	};
+
+	// Writes every encoded frame to flash from a thread of its own. The
+	// encode pool copies frames into a queue, a frame ring with the archive
+	// writer as its consumer, and never waits on storage: when the writer
+	// has fallen so far behind that the queue is full the frame is left out
+	// of the archive and counted. The writer appends each image to a segment
+	// file preallocated and mapped in full, with an index record, and writes
+	// back in batches of ARCHIVE_SYNC_BYTES, or ARCHIVE_SYNC_MS after the
+	// first frame not written back, so flash sees few rewrites of part
+	// filled pages. A full segment is cut to its length and the next made.
+	struct frameArchive
+	{
+		const char* dir;
+		size_t segmentBytes;
+		uint32_t entries;			// index records in each segment
+		uint64_t dataOffset;
+		struct frameRing queue;		// frames on their way to the writer
+		sem_t ready;				// posted as frames are queued
+		pthread_t thread;
+		_Atomic bool stopping;
+		// Producer only
+		unsigned int tablesId;		// last tables queued, 0 = none yet
+		unsigned long dropped;		// frames left out with the queue full
+		// Writer only, read once it has stopped
+		int fd;						// -1 between segments
+		byte* map;
+		unsigned int nextSegment;	// number to try for the next file
+		uint64_t used;				// end of the images written
+		uint64_t synced;			// end of the images written back
+		uint32_t count;				// index records written
+		uint64_t dirtyUs;			// when the first not written back went
+		byte tables[ARCHIVE_TABLES_BYTES];	// repeated at each segment start
+		struct frameRecord tablesRec;
+		bool failed;				// storage gave out, frames are let go
+		unsigned long frames;
+		unsigned long bytes;
+		unsigned long segments;
+		unsigned long syncs;
+	};
+
+	void startArchive(struct frameArchive* a, const char* dir,
+			size_t segmentBytes);
+	struct frameRecord* archiveAppend(struct frameArchive* a, uint32_t size,
+			enum recordKind kind);
+	void archivePublish(struct frameArchive* a);
+	void stopArchive(struct frameArchive* a);
+
+#endif
@@ -0,0 +1,97 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Preallocated storage for frame and packet buffers.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+
+#ifndef ARENA_H
+	#define ARENA_H
+
+	#include <stdlib.h>
+	#include <stdio.h>
+	#include <stdbool.h>
+	#include <stdatomic.h>
+	#include <string.h>
+	#include <assert.h>
+	#include <pthread.h>
+	#include <sys/mman.h>
+	#include "../headers/util.h"
+
+	#define ARENA_ALIGN				64			// cache line
+	#define HUGE_PAGE_BYTES			(2 << 20)
+	#define ARENA_WARMUP_FRAMES		32			// frames before the check
+
+	// One mapping made at start-up that frame and packet buffers are carved
+	// from as they are first used, so a long run does not go back to the
+	// allocator for them once every buffer has its storage. Frame buffers
+	// take a whole block each; a buffer that outgrows its block, or finds the
+	// arena used up, carries on in the heap and is counted.
+	struct frameArena
+	{
+		byte* base;				// NULL when there is no arena
+		size_t size;			// bytes mapped
+		size_t used;
+		size_t blockBytes;		// storage each frame buffer starts with
+		unsigned int blocks;	// frame blocks the arena was sized for
+		unsigned int taken;		// frame blocks handed out
+		bool locked;			// mlock() succeeded
+		bool hugePages;			// mapped with MAP_HUGETLB
+		pthread_mutex_t lock;	// taken only while buffers get storage
+		_Atomic unsigned long heapAllocs;	// frame storage from the heap
+	};
+
+	extern struct frameArena frameArena;
+
+	void createFrameArena(unsigned int blocks, size_t blockBytes,
+			size_t extraBytes, bool lock, bool hugePages);
+	byte* arenaAlloc(size_t bytes);
+	void reserveImage(byte** buf, size_t* capacity, size_t len);
+	void releaseImage(byte* buf);
+	void destroyFrameArena();
+
+	#ifdef ARENA_DEBUG
+		unsigned long heapAllocations();
+		void assertSteadyState();
+	#else
+		// Without ARENA_DEBUG the allocator is not wrapped and there is
+		// nothing to check
+		static inline void assertSteadyState() {}
+	#endif
+
+#endif
@@ -1,7 +1,7 @@
 // hyper-cam - Interfaces camera sensor with serial communications for
 // autonomous image capture of scientific experiments on embedded Linux
 //
-// Looped singly-linked list implementation.
+// Encoder benchmarks.
 //
 // Copyright (C) 2012 Jacob Appleton
 //
@@ -38,23 +38,27 @@
 //
 // You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
 
-#include "../headers/lnklst.h"
 
-struct lstnode* allocate(size_t size)
-{
-	unsigned int 		i;
-	// Set the root node
-	struct lstnode* root = (struct lstnode*)malloc(sizeof(struct lstnode));
-	struct lstnode* currentNode = root;
-	currentNode->size = 0;
-	// For the amount requested
-	for(i = 0; i < size; i++)
-	{
-		struct lstnode* node = (struct lstnode*)malloc(sizeof(struct lstnode));
-		node->size = 0;
-		currentNode->next = node;
-		currentNode = node;
-	}
-	currentNode->next = root;
-	return root;
-}
+#ifndef BENCH_H
+	#define BENCH_H
+
+	#include <stdio.h>
+	#include <stdlib.h>
+	#include <time.h>
+	#include "../headers/util.h"
+	#include "../headers/imgproc.h"
+	#include "../headers/fdct.h"
+	#include "../headers/frmsrc.h"
+	#include "../headers/stripe.h"
+	#include "../headers/encpool.h"
+
+	#define CALIBRATION_FRAMES	10		// timed per profile, after one more
+
+	void benchmarkEncoder(const struct srcConfig* cfg,
+			const struct encodeSettings* enc, unsigned int frames);
+	bool profileFits(const struct encodeProfile* profile,
+			const struct encodeSettings* enc);
+	void calibrateProfile(const struct srcConfig* cfg,
+			const struct encodeSettings* enc, double deadlineMs);
+
+#endif
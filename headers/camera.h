@@ -59,14 +59,106 @@
 	#include <stdio.h>
 	#include "libv4l2.h"
 	#include "../headers/util.h"
-	#include "../headers/lnklst.h"
+	#include "../headers/frmring.h"
 	#include "../headers/imgproc.h"
+	#include "../headers/fdct.h"
 	#include "../headers/sercom.h"
+	#include "../headers/frmsrc.h"
+	#include "../headers/bench.h"
+	#include "../headers/encpool.h"
+	#include "../headers/archive.h"
+
+	// Serial port name that runs without starting the downlink thread
+	#define NO_SERIAL "none"
+
+	struct camOptions
+	{
+		struct srcConfig src;
+		const char* serialPort;
+		struct encodeSettings enc;
+		int bufferSize;
+		unsigned int downlinkQuality;	// requantise frames to send, 0 = no
+		unsigned int workers;		// encode threads
+		unsigned int frameCount;	// stop after this many frames, 0 = never
+		unsigned int benchFrames;	// run the encoder benchmark instead
+		const struct encodeProfile* profile;	// -E, or NULL for the default
+		double calibrateMs;			// -C deadline to pick a profile by, 0 = no
+		size_t frameBytes;			// arena block per frame buffer, 0 = bound
+		bool lockArena;				// mlock() the arena
+		bool hugePages;				// map the arena with huge pages
+		size_t ringBytes;			// ring budget, 0 = bufferSize frames
+		const char* archiveDir;		// keep every frame here, NULL = no
+		size_t segmentBytes;		// size of each archive segment file
+	};
+
+	// Encode totals for a run
+	struct runStats
+	{
+		double encodeMs;
+		unsigned long bytes;
+		unsigned long qualitySum;	// for the mean quality under rate control
+		unsigned long passes;
+		unsigned long overBudget;	// frames larger than the target
+		unsigned long tables;		// tables streams published
+		unsigned long keyFrames;	// conditional replenishment frames
+		unsigned long deltaFrames;
+		unsigned long blocksSent;	// MCUs sent, of blocksTotal
+		unsigned long blocksTotal;
+		unsigned long ringDropped;	// frames turned away by a full ring
+		uint64_t encodeLatencyUs;	// capture to encoded, summed over frames
+	};
+
+	// Bytes handed to the serial port by the downlink thread, and how long
+	// frames took to get there, read by the capture thread for the summary
+	// without a lock
+	struct linkStats
+	{
+		_Atomic unsigned long bytes;
+		_Atomic unsigned long requests;
+		_Atomic unsigned long frames;		// frames sent whole
+		_Atomic uint64_t latencyUs;			// capture to downlinked, summed
+		_Atomic uint64_t maxLatencyUs;
+	};
+
+	// Where the encode pool publishes frames: the producer side of the ring
+	struct ringWriter
+	{
+		struct frameRing* ring;
+		struct runStats* run;
+		size_t targetBytes;
+		bool abbreviated;
+		struct jpegEncoder tables;	// writes the tables abbreviated frames use
+		unsigned int tablesId;		// last tables published, 0 = none yet
+		byte* tablesImg;			// tables stream before it is copied in
+		size_t tablesCapacity;
+		size_t tablesSize;
+		unsigned int tablesQuality;	// what tablesImg was written for
+		struct frameArchive* archive;	// NULL when frames are not kept
+		struct imgDetails det;
+		enum encodeMode mode;
+	};
 
 	struct threadArgs
 	{
-		const char* imagePath;
-		struct lstnode* cNode;
-		pthread_mutex_t* mutex;
+		struct frameRing* ring;
+		byte* packet;				// TELEMETRY_MAX_BYTES for replies
+		const char* serialPort;
+		struct linkStats* link;
+		unsigned int downlinkQuality;
+		bool arithmetic;
+	};
+
+	// What the downlink thread is sending for the oldest record not sent
+	struct downlink
+	{
+		struct frameRecord* rec;	// NULL between frames
+		const byte* img;
+		size_t size;
+		uint32_t offset;			// bytes of img already sent
+		unsigned int quality;		// requantise to this, 0 = send as kept
+		bool arithmetic;
+		struct jpegTranscoder tc;
+		byte* buf;					// requantised copy of the record's frame
+		size_t capacity;
 	};
 #endif
@@ -0,0 +1,142 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Pool of frame encoding threads with ordered hand-off.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#ifndef ENCPOOL_H
+	#define ENCPOOL_H
+
+	#include <stdlib.h>
+	#include <stdio.h>
+	#include <stdbool.h>
+	#include <pthread.h>
+	#include "../headers/util.h"
+	#include "../headers/imgproc.h"
+	#include "../headers/frmsrc.h"
+	#include "../headers/stripe.h"
+	#include "../headers/rate.h"
+	#include "../headers/transcode.h"
+	#include "../headers/replen.h"
+
+	#define MAX_WORKERS 16
+
+	// How frames are encoded, shared by every worker
+	struct encodeSettings
+	{
+		unsigned int quality;		// fixed, or the first guess under -T
+		enum encodeMode mode;
+		unsigned int stripes;		// restart interval stripes per frame
+		size_t targetBytes;			// rate control budget, 0 = fixed quality
+		bool abbreviated;			// frames without tables
+		bool progressive;			// progressive frames, not with stripes
+		bool arithmetic;			// arithmetic coding, MJPEG transcoded too
+		unsigned int keyInterval;	// conditional replenishment, 0 = off
+		unsigned int threshold;		// mean row difference that counts
+	};
+
+	// A frame on its way through the pool. The worker encodes into its own
+	// buffer, which the publish callback copies from, as the ring's records
+	// are only laid out once frames are published in order. A frame passed
+	// through as the camera made it is published from the capture buffer
+	// itself, which the worker holds until then.
+	struct encodeJob
+	{
+		struct frame frm;
+		uint32_t order;			// position in capture order
+		byte* img;				// the worker's buffer
+		size_t capacity;
+		const byte* data;		// the frame to publish: img or frm.data
+		size_t size;
+		double encodeMs;
+		uint64_t encodedUs;		// CLOCK_MONOTONIC when the encode finished
+		unsigned int quality;	// quality the frame was encoded at
+		unsigned int passes;	// encodes it took to fit the budget
+		uint8_t flags;			// HCAM_KEY or HCAM_DELTA under replenishment
+		unsigned int blocks;	// MCUs sent, of frameBlocks
+		unsigned int frameBlocks;
+	};
+
+	// Called for each encoded frame, strictly in capture order, with no other
+	// publish in progress
+	typedef void (*publishFn)(void* ctx, struct encodeJob* job);
+
+	// What a worker encodes with. The frame, and the picture encoded for
+	// it, are set for each job.
+	struct encodeWorkerState
+	{
+		struct encodePool* pool;
+		struct jpegEncoder enc;
+		struct stripeEncoder striped;
+		struct rateControl rate;
+		struct jpegTranscoder transcoder;
+		struct replenisher replen;
+		const struct frame* frm;
+		struct replenFrame pic;
+	};
+
+	struct encodePool
+	{
+		unsigned int nworkers;
+		pthread_t threads[MAX_WORKERS];
+		struct frameSource* src;
+		struct encodeSettings cfg;
+		publishFn publish;
+		void* ctx;
+		pthread_mutex_t lock;
+		pthread_cond_t jobReady;	// a job was queued or the pool is stopping
+		pthread_cond_t slotFree;	// a job was taken off the queue
+		pthread_cond_t turn;		// a job was published
+		struct frame* queue;		// frames waiting for a worker
+		unsigned int queueSize;
+		unsigned int queueHead;
+		unsigned int queued;
+		uint32_t nextOrder;			// order given to the next submitted frame
+		uint32_t nextPublish;		// order allowed to publish next
+		bool stopping;
+	};
+
+	struct encodePool* createEncodePool(unsigned int nworkers,
+			struct frameSource* src, const struct encodeSettings* cfg,
+			publishFn publish, void* ctx);
+	void submitFrame(struct encodePool* pool, const struct frame* frm);
+	void drainEncodePool(struct encodePool* pool);
+	void destroyEncodePool(struct encodePool* pool);
+	unsigned int defaultWorkers();
+
+#endif
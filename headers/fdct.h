@@ -0,0 +1,89 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Forward DCT and quantisation kernels for the direct YUYV encoder.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+
+#ifndef FDCT_H
+	#define FDCT_H
+
+	#include <stdio.h>
+	#include <stdlib.h>
+	#include <string.h>
+	#include <stdbool.h>
+	#include <stdint.h>
+	#include "../headers/util.h"
+
+	// Blocks in one 16x8 YUYV MCU at 4:2:2: two luma, then Cb and Cr
+	#define MCU_BLOCKS	4
+	#define MCU_BYTES	32		// one MCU row of YUYV
+	#define MCU_ROWS	8
+
+	// Level shift and forward DCT of the four blocks of one MCU, straight
+	// from YUYV rows stride bytes apart. The coefficients of each block are
+	// in natural order, scaled by the AAN factors (see aanScale()) that the
+	// quantiser divides out. Rows are transformed first, then columns, in
+	// 16 bit fixed point with libjpeg's ifast constants.
+	typedef void (*mcuTransform)(const byte* yuyv, size_t stride,
+			int16_t* coefs);
+
+	// Quantise one block of coefficients from an mcuTransform by multiplying
+	// by the reciprocals of their steps and rounding to the nearest even,
+	// all in natural order. Returns a mask with bit n set for each nonzero
+	// quantised coefficient n.
+	typedef uint64_t (*blockQuantiser)(const int16_t* coefs,
+			const float* recip, int16_t* q);
+
+	struct dctKernel
+	{
+		const char* name;
+		mcuTransform fdct;
+		blockQuantiser quantise;
+	};
+
+	// The kernel picked by selectDctKernel(), scalar until then
+	extern struct dctKernel dctKernel;
+
+	void selectDctKernel();
+	void fdctMcuScalar(const byte* yuyv, size_t stride, int16_t* coefs);
+	uint64_t quantiseScalar(const int16_t* coefs, const float* recip,
+			int16_t* q);
+	double aanScale(unsigned int k);
+
+#endif
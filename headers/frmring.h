@@ -0,0 +1,118 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Single-producer, single-consumer byte log of encoded frames for downlink.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+#ifndef FRMRING_H
+	#define FRMRING_H
+
+	#include <string.h>
+	#include <stdio.h>
+	#include <stdlib.h>
+	#include <stdint.h>
+	#include <stdbool.h>
+	#include <stdatomic.h>
+	#include <assert.h>
+	#include <time.h>
+	#include "../headers/util.h"
+	#include "../headers/arena.h"
+
+	#define RECORD_ALIGN	8
+	#define CACHE_LINE		64
+
+	// What a record of the log holds
+	enum recordKind
+	{
+		RECORD_FRAME,		// a JPEG, complete or abbreviated
+		RECORD_TABLES,		// tables-only stream for abbreviated frames
+		RECORD_PAD			// the unused end of the log before it wraps
+	};
+
+	// Header of each record, with the image straight after it. Times are
+	// CLOCK_MONOTONIC microseconds, the clock V4L2 stamps buffers with, so
+	// they can be subtracted to give the latency of each stage. A tables
+	// record carries those of the frame it goes ahead of.
+	struct frameRecord
+	{
+		uint32_t span;		// bytes to the next record, header included
+		uint32_t size;		// bytes of image
+		uint8_t kind;
+		uint8_t tablesId;	// tables a frame needs or a tables record holds
+		uint32_t sequence;	// capture sequence number from the source
+		uint64_t captureUs;	// v4l2_buffer.timestamp, or when generated
+		uint64_t encodedUs;	// when the encode finished
+		uint64_t downlinkedUs;	// when its last byte went, 0 until then
+		byte data[];
+	};
+
+	// Encoded frames packed back to back in one block of memory, so the
+	// frames held are set by their total size rather than a count. A record
+	// never wraps: one that does not fit before the end starts again at the
+	// beginning, after a pad record when there is room for one.
+	//
+	// The encode pool, which publishes one frame at a time, appends at head
+	// and the downlink thread sends from sent, without a lock. Each is
+	// stored by one side only, with release order, and loaded by the other
+	// with acquire order. Frames already sent stay in the log as history
+	// from oldest, which only the producer moves, until their room is
+	// needed. When every frame held is still waiting to go down the link a
+	// new frame is turned away instead, as the oldest may be part sent.
+	struct frameRing
+	{
+		byte* log;
+		uint32_t capacity;		// bytes in the log
+		bool downlinked;		// false: no consumer, evict unsent frames too
+		uint32_t oldest;		// first record held
+		uint32_t pending;		// end of records appended, published or not
+		uint32_t frames;		// frame records from oldest to pending
+		uint32_t bytes;			// bytes of records from oldest to pending
+		uint32_t newest;		// last record appended
+		_Alignas(CACHE_LINE) _Atomic uint32_t head;	// end of published records
+		_Alignas(CACHE_LINE) _Atomic uint32_t sent;	// first record not sent
+	};
+
+	void initFrameRing(struct frameRing* ring, size_t bytes, bool downlinked);
+	void freeFrameRing(struct frameRing* ring);
+	struct frameRecord* ringAppend(struct frameRing* ring, uint32_t size,
+			enum recordKind kind);
+	void ringPublish(struct frameRing* ring);
+	double ringHistorySeconds(struct frameRing* ring);
+	struct frameRecord* ringPeek(struct frameRing* ring);
+	void ringRelease(struct frameRing* ring, const struct frameRecord* rec);
+
+#endif
@@ -0,0 +1,159 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Frame source interface and backends.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#ifndef FRMSRC_H
+	#define FRMSRC_H
+
+	#include <stdlib.h>
+	#include <stdio.h>
+	#include <stdint.h>
+	#include <stdbool.h>
+	#include <errno.h>
+	#include <fcntl.h>
+	#include <poll.h>
+	#include <semaphore.h>
+	#include <time.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <sys/time.h>
+	#include <linux/videodev2.h>
+	#include "../headers/util.h"
+	#include "../headers/imgproc.h"
+
+	// ------------------------------------------------------------------------
+	// NUMBER OF BUFFERS IN THE CAPTURE RING, OVERRIDE WITH -n
+	#ifndef CAPTURE_BUFFERS
+		#define CAPTURE_BUFFERS 4
+	#endif
+	// ------------------------------------------------------------------------
+
+	#define MIN_CAPTURE_BUFFERS 2
+	#define MAX_CAPTURE_BUFFERS 8
+
+	// Time to wait for a source to produce a frame before reporting a stall
+	#ifndef CAPTURE_TIMEOUT_MS
+		#define CAPTURE_TIMEOUT_MS 2000
+	#endif
+
+	enum srcType
+	{
+		SRC_V4L2,		// camera device through the V4L2 mmap interface
+		SRC_REPLAY,		// mmap'd file of recorded raw frames
+		SRC_PATTERN		// generated test pattern
+	};
+
+	// Settings used to open a frame source
+	struct srcConfig
+	{
+		enum srcType type;
+		const char* location;	// camera device or replay file
+		unsigned int width;		// frame geometry for replay and pattern
+		unsigned int height;
+		unsigned int nbuffers;	// number of buffers in the capture ring
+		int fps;				// rate replay and pattern frames are paced at
+		bool maxSpeed;			// deliver replay/pattern frames unpaced
+		uint32_t pixelformat;	// format wanted, 0 prefers MJPEG if offered
+	};
+
+	// Capture ring statistics. queued is the number of buffers currently held
+	// by the source, dropped counts gaps in the source's frame sequence.
+	// Frames may be released from other threads, so queued is only changed
+	// atomically.
+	struct captureStats
+	{
+		unsigned int queued;
+		unsigned int dropped;
+		unsigned int frames;
+		uint32_t lastSequence;
+	};
+
+	// A frame handed out by a source. It stays valid until it is released.
+	struct frame
+	{
+		byte* data;
+		size_t bytesused;
+		unsigned int index;		// buffer index to hand back on release
+		uint32_t sequence;
+		struct timeval timestamp;
+	};
+
+	struct frameSource
+	{
+		enum srcType type;
+		struct imgDetails det;
+		uint32_t pixelformat;	// V4L2_PIX_FMT_YUYV or V4L2_PIX_FMT_MJPEG
+		struct captureStats stats;
+		int fd;					// camera or replay file descriptor
+		unsigned int nbuffers;
+		struct buffer* bufs;
+		size_t frameBytes;		// bytes in one raw frame
+		unsigned int nframes;	// frames available to replay or generate
+		struct buffer* frames;	// start and length of each replayed frame
+		uint32_t sequence;		// next sequence number for generated frames
+		struct timespec deadline; // when the next paced frame is due
+		long period;			// nanoseconds between paced frames
+		sem_t freeBuffers;		// replay and pattern buffers not handed out
+		// Wait for the next frame, FALSE if none arrived before the timeout
+		bool (*next)(struct frameSource* src, struct frame* frm);
+		// Return a frame's buffer to the source once it has been consumed. May
+		// be called from any thread.
+		void (*release)(struct frameSource* src, struct frame* frm);
+		// Stop capture and free everything the source holds
+		void (*close)(struct frameSource* src);
+	};
+
+	struct frameSource* openFrameSource(const struct srcConfig* cfg);
+	void closeFrameSource(struct frameSource* src);
+	void trackSequence(struct captureStats* stats, uint32_t sequence);
+	void initPacing(struct frameSource* src, const struct srcConfig* cfg);
+	void waitForDeadline(struct frameSource* src);
+	void initBuffers(struct frameSource* src, unsigned int nbuffers);
+	bool takeBuffer(struct frameSource* src);
+	void giveBuffer(struct frameSource* src);
+	void stampFrame(struct frame* frm);
+
+	// Backends
+	void openV4l2Source(struct frameSource* src, const struct srcConfig* cfg);
+	void openReplaySource(struct frameSource* src, const struct srcConfig* cfg);
+	void openPatternSource(struct frameSource* src,
+			const struct srcConfig* cfg);
+
+#endif
@@ -47,7 +47,10 @@
 #include <setjmp.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdint.h>
 #include "../headers/util.h"
+#include "../headers/yuvconv.h"
+#include "../headers/arena.h"
 #include <jmorecfg.h>
 #include <jpeglib.h>
 #include <jconfig.h>
@@ -59,8 +62,131 @@ struct imgDetails
 	unsigned int size;
 };
 
-void compressJpeg(FILE* outfile, byte* imgbuf, unsigned int cfactor,
-		int rlen, int imgheight, int inputComponents);
-byte* YUYVtoYUV(byte* yuyvValues, struct imgDetails det);
+// Width of a 4:2:2 MCU in luma samples
+#define RAW_MCU_WIDTH (2 * DCTSIZE)
+
+// APP11 segment identifying streams for the ground station: "HCAM", a
+// version, flags, the tables id and the frame sequence number
+#define HCAM_MARKER			(JPEG_APP0 + 11)
+#define HCAM_ID				"HCAM"
+#define HCAM_VERSION		1
+#define HCAM_TAG_LENGTH		11
+#define HCAM_TABLES			0x01	// tables-only stream, no image
+#define HCAM_ABBREVIATED	0x02	// image without tables, see tablesId
+#define HCAM_ARITHMETIC		0x04	// arithmetic rather than Huffman coded
+#define HCAM_KEY			0x08	// whole frame, starts a replenishment chain
+#define HCAM_DELTA			0x10	// changed MCUs only, see replen.h
+
+// The quantisation tables are a function of quality alone and the Huffman
+// tables are libjpeg's standard ones, so quality identifies a tables stream
+struct frameTag
+{
+	uint8_t flags;
+	uint8_t tablesId;
+	uint32_t sequence;
+};
+
+// How YUYV frames are handed to libjpeg
+enum encodeMode
+{
+	ENC_YUV444,		// expanded to 4:4:4 scanlines a strip at a time
+	ENC_RAW422,		// split into 4:2:2 planes, jpeg_write_raw_data()
+	ENC_DIRECT422,	// straight to baseline 4:2:2 by yuyvjpeg.c, no libjpeg
+	ENC_TURBO422	// 4:2:2 planes to TurboJPEG, see tjenc.h
+};
+
+struct directEncoder;
+
+// libjpeg settings past quality that trade encode time for frame size.
+// They apply to the libjpeg modes, ENC_YUV444 and ENC_RAW422.
+struct encodeProfile
+{
+	const char* name;
+	J_DCT_METHOD dctMethod;
+	bool optimize;			// Huffman tables fitted to each frame, a 2nd pass
+	int smoothing;			// smoothing_factor, only where libjpeg downsamples
+	int restartRows;		// a restart marker every this many MCU rows
+};
+
+#define ENCODE_PROFILES 4
+
+extern const struct encodeProfile encodeProfiles[ENCODE_PROFILES];
+
+// The profile every encoder is configured with, "balanced" (libjpeg's
+// defaults) until one is picked. Set it at start-up before any thread
+// encodes.
+extern const struct encodeProfile* encodeProfile;
+
+// One MCU row of Y, Cb and Cr planes for jpeg_write_raw_data()
+struct rawPlanes
+{
+	byte* data;
+	size_t capacity;			// bytes allocated for data
+	unsigned int lumaWidth;
+	unsigned int chromaWidth;
+	JSAMPROW y[DCTSIZE];
+	JSAMPROW cb[DCTSIZE];
+	JSAMPROW cr[DCTSIZE];
+	JSAMPARRAY rows[3];
+};
+
+// libjpeg destination writing into a caller's buffer, grown on demand
+struct bufferDest
+{
+	struct jpeg_destination_mgr pub;
+	byte** buf;
+	size_t* capacity;
+	size_t size;
+};
+
+// A libjpeg compression object kept across frames, along with the working
+// buffers of each mode it has encoded in, sized for the largest geometry. Each
+// thread that encodes needs its own.
+struct jpegEncoder
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	struct bufferDest dest;
+	struct imgDetails det;
+	unsigned int quality;
+	enum encodeMode mode;
+	const struct encodeProfile* profile;
+	uint8_t coding;				// codingOf() the encoder was configured with
+	bool configured;
+	unsigned int reconfigurations;
+	struct rawPlanes planes;	// ENC_RAW422 planes for one MCU row
+	byte* strip;				// ENC_YUV444 strip of one MCU band
+	size_t stripBytes;
+	unsigned int band;
+	JSAMPROW rowptr[MAX_SAMP_FACTOR * DCTSIZE];
+	bool abbreviated;			// leave the tables out, tag the frame instead
+	bool progressive;			// encode with progressiveScans
+	bool arithmetic;			// arithmetic entropy coding
+	uint32_t sequence;			// frame number for the tag
+	uint8_t flags;				// HCAM_KEY or HCAM_DELTA for the tag
+	const byte* map;			// HMAP segment of a delta frame, or NULL
+	size_t mapLength;
+	struct directEncoder* direct;	// ENC_DIRECT422 tables, libjpeg's own
+	void* turbo;				// ENC_TURBO422 tjhandle
+	byte* frame;				// ENC_TURBO422 Y, Cb and Cr of a whole frame
+	size_t frameBytes;
+	size_t turboSize;			// tjBufSize() of the geometry
+};
+
+const struct encodeProfile* findProfile(const char* name);
+void initEncoder(struct jpegEncoder* enc);
+void configureEncoder(struct jpegEncoder* enc, struct imgDetails det,
+		unsigned int cfactor, enum encodeMode mode);
+size_t encodeFrame(struct jpegEncoder* enc, const byte* yuyv, byte** buf,
+		size_t* capacity);
+void destroyEncoder(struct jpegEncoder* enc);
+size_t writeTables(struct jpegEncoder* enc, byte** buf, size_t* capacity);
+void packFrameTag(byte* tag, const struct frameTag* ft);
+void writeFrameTag(j_compress_ptr cinfo, const struct frameTag* ft);
+size_t compressJpegYUYV(const byte* yuyv, unsigned int cfactor,
+		struct imgDetails det, enum encodeMode mode, byte** buf,
+		size_t* capacity);
+void setBufferDest(j_compress_ptr cinfo, struct bufferDest* dest, byte** buf,
+		size_t* capacity);
 
 #endif
@@ -0,0 +1,91 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Rate control to fit each encoded frame in a byte budget.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#ifndef RATE_H
+	#define RATE_H
+
+	#include <stdlib.h>
+	#include <stdio.h>
+	#include <stdbool.h>
+	#include <string.h>
+	#include <math.h>
+	#include "../headers/util.h"
+	#include "../headers/arena.h"
+
+	#define RATE_MIN_QUALITY	5
+	#define RATE_MAX_QUALITY	95
+	#define RATE_MAX_PASSES		3		// encodes per frame at most
+	#define RATE_TOLERANCE		0.10	// accept frames this far under target
+	#define RATE_SLOPE			0.8		// -d ln(size) / d ln(scale) to start
+	#define RATE_MIN_SLOPE		0.1
+	#define RATE_MAX_SLOPE		4.0
+
+	// Encodes the current frame at a quality into *buf, grown as needed, and
+	// returns its length
+	typedef size_t (*encodeAtFn)(void* ctx, unsigned int quality, byte** buf,
+			size_t* capacity);
+
+	// Picks the quality for each frame so it fits a byte budget. Frame size
+	// is modelled as log-linear in libjpeg's quantisation scale around the
+	// operating point: the previous frame's quality and size predict the
+	// first encode, and the slope measured between encodes of the same frame
+	// refines the rest.
+	struct rateControl
+	{
+		size_t target;			// bytes per frame
+		unsigned int quality;	// where the last frame settled
+		size_t lastSize;
+		double slope;
+		bool primed;			// a frame has been measured
+		byte* scratch;			// encodes that are not the best so far
+		size_t scratchCapacity;
+		unsigned long frames;
+		unsigned long passes;
+		unsigned long overBudget;
+	};
+
+	void initRateControl(struct rateControl* rc, size_t target,
+			unsigned int quality);
+	size_t encodeToBudget(struct rateControl* rc, encodeAtFn encode,
+			void* ctx, byte** buf, size_t* capacity, unsigned int* quality);
+	void freeRateControl(struct rateControl* rc);
+
+#endif
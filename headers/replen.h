@@ -0,0 +1,112 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Conditional replenishment: only the blocks of a frame that changed.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+
+#ifndef REPLEN_H
+	#define REPLEN_H
+
+	#include <stdlib.h>
+	#include <stdio.h>
+	#include <stdbool.h>
+	#include <string.h>
+	#include <stdint.h>
+	#include "../headers/util.h"
+	#include "../headers/imgproc.h"
+	#include "../headers/yuvconv.h"
+
+	#define REPLEN_THRESHOLD	4	// mean difference per sample in a row
+
+	// APP11 segment carried by delta frames alongside the HCAM tag: "HMAP",
+	// the frame width and height, the sequence of the frame the delta
+	// applies to and the width of the mosaic in MCUs, all big endian, then
+	// the change map of the frame's MCUs in raster order as runs,
+	// alternately unchanged and changed, each an unsigned LEB128 varint
+	#define HMAP_ID				"HMAP"
+	#define HMAP_HEADER_LENGTH	14
+	#define HMAP_MAX_LENGTH		65533	// most a marker segment can carry
+
+	// What a worker encodes for a frame: the frame itself, or a mosaic of
+	// the MCUs that changed, with the HCAM flags and map that go with it
+	struct replenFrame
+	{
+		const byte* yuyv;
+		struct imgDetails det;
+		enum encodeMode mode;
+		uint8_t flags;			// HCAM_KEY or HCAM_DELTA, 0 if not in use
+		const byte* map;		// HMAP segment body of a delta frame
+		size_t mapLength;
+		unsigned int blocks;	// MCUs sent
+	};
+
+	// Compares each frame with what the ground station holds, MCU by MCU
+	// (16x8 pixels of YUYV: two 8x8 luma blocks and one of each chroma),
+	// and packs those that differ by more than the threshold into a mosaic
+	// encoded in their place. Every keyInterval frames the whole frame goes
+	// as a key frame instead.
+	struct replenisher
+	{
+		struct imgDetails det;
+		unsigned int cols;			// MCUs across the frame
+		unsigned int rows;			// MCUs down the frame
+		unsigned int keyInterval;
+		unsigned int threshold;
+		enum encodeMode keyMode;	// how key frames are encoded
+		byte* reference;			// YUYV frame as the ground station has it
+		bool* changed;				// per MCU, this frame
+		byte* mosaic;				// YUYV mosaic of the changed MCUs
+		byte* map;					// HMAP segment body
+		unsigned int sinceKey;		// frames since the last key frame
+		bool primed;				// reference holds a key frame
+		uint32_t lastSequence;		// frame the ground station last got
+		unsigned long keyFrames;
+		unsigned long deltaFrames;
+		unsigned long blocksSent;
+		unsigned long blocksTotal;
+	};
+
+	void initReplenisher(struct replenisher* rp, unsigned int keyInterval,
+			unsigned int threshold, enum encodeMode keyMode);
+	void replenish(struct replenisher* rp, const byte* yuyv,
+			struct imgDetails det, uint32_t sequence, struct replenFrame* out);
+	size_t readVarint(const byte* p, size_t len, uint32_t* value);
+	void freeReplenisher(struct replenisher* rp);
+
+#endif
@@ -66,7 +66,7 @@
 	#endif
 	// ------------------------------------------------------------------------
 	// ------------------------------------------------------------------------
-	// TO CHANGE SERIAL PORT, MODIFY THIS MACRO
+	// TO CHANGE SERIAL PORT, MODIFY THIS MACRO OR PASS -p
 	#ifndef MODEMDEVICE
 		#define MODEMDEVICE "/dev/ttyS0"
 	#endif
@@ -76,6 +76,12 @@
 		#define TELEMETRY_HEADER 0xAA
 	#endif
 
+	#define TELEMETRY_OVERHEAD	6		// header and checksum around the data
+	#define TELEMETRY_MAX_BYTES	(TELEMETRY_OVERHEAD + UINT16_MAX)
+
+	// A request from the ground, or a reply carrying image data. A reply is
+	// built in place in the caller's buffer of TELEMETRY_MAX_BYTES: data
+	// points just past the header, where the image bytes are copied.
 	struct telpkt
 	{
 		uint16_t bytesRequested;
@@ -87,13 +93,13 @@
 		size_t outputSize;
 	};
 
-	int openPort();
-	int openPortFd();
+	int openPort(const char* device);
+	int openPortFd(const char* device);
 	void encode(struct telpkt* t);
-	void cleanUp(struct telpkt* t);
-	struct telpkt* decode(byte inputStream[6], unsigned int inputSize);
-	struct telpkt* getTp(int16_t req, int16_t con);
-	struct telpkt* createOutputTelPkt(uint16_t bRequested, uint16_t bContained);
+	void decode(struct telpkt* t, byte inputStream[6], unsigned int inputSize);
+	size_t decodeReply(struct telpkt* t, byte* input, size_t size);
+	void initOutputTelPkt(struct telpkt* t, byte* output, uint16_t bRequested,
+			uint16_t bContained);
 	void writeToUart(struct telpkt* t, int fd);
 
 #endif
@@ -0,0 +1,100 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Intra-frame parallel JPEG encoding in restart interval stripes.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#ifndef STRIPE_H
+	#define STRIPE_H
+
+	#include <stdlib.h>
+	#include <stdio.h>
+	#include <stdbool.h>
+	#include <pthread.h>
+	#include "../headers/util.h"
+	#include "../headers/imgproc.h"
+
+	#define MAX_STRIPES 8
+
+	struct stripeEncoder;
+
+	// One horizontal stripe of a frame, encoded as a JPEG of its own
+	struct stripeTask
+	{
+		struct stripeEncoder* owner;
+		struct jpegEncoder enc;
+		struct imgDetails det;	// stripe geometry
+		unsigned int firstRow;
+		unsigned int restartInterval;
+		byte* out;
+		size_t capacity;
+		size_t size;
+	};
+
+	// Encodes each frame as stripes on helper threads, one stripe per core,
+	// and stitches them into one baseline JPEG with a restart marker between
+	// stripes
+	struct stripeEncoder
+	{
+		unsigned int nstripes;
+		pthread_t threads[MAX_STRIPES];
+		struct stripeTask tasks[MAX_STRIPES];
+		pthread_mutex_t lock;
+		pthread_cond_t start;		// a new frame is ready to encode
+		pthread_cond_t done;		// a stripe finished
+		unsigned int generation;	// frames handed to the helpers so far
+		unsigned int pending;		// stripes of this frame still encoding
+		bool stopping;
+		const byte* yuyv;
+		unsigned int quality;
+		enum encodeMode mode;
+		bool abbreviated;			// stitch frames without tables
+		bool arithmetic;			// arithmetic coded stripes
+		uint32_t sequence;			// frame number for the HCAM tag
+		uint8_t flags;				// replenishment flags for the tag
+		const byte* map;			// HMAP segment, written by stripe 0
+		size_t mapLength;
+	};
+
+	void initStripeEncoder(struct stripeEncoder* se, unsigned int nstripes);
+	size_t encodeStriped(struct stripeEncoder* se, const byte* yuyv,
+			struct imgDetails det, unsigned int cfactor, enum encodeMode mode,
+			byte** buf, size_t* capacity);
+	void destroyStripeEncoder(struct stripeEncoder* se);
+
+#endif
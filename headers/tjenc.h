@@ -1,7 +1,7 @@
 // hyper-cam - Interfaces camera sensor with serial communications for
 // autonomous image capture of scientific experiments on embedded Linux
 //
-// Looped singly-linked list implementation.
+// TurboJPEG encoder backend compressing from YUV planes.
 //
 // Copyright (C) 2012 Jacob Appleton
 //
@@ -38,24 +38,24 @@
 //
 // You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
 
-#ifndef LNKLST_H
-	#define LNKLST_H
 
-	#include <string.h>
-	#include <stdio.h>
+
+#ifndef TJENC_H
+	#define TJENC_H
+
 	#include <stdlib.h>
-	#include <sys/ioctl.h>
+	#include <stdio.h>
+	#include <stdbool.h>
+	#include <string.h>
 	#include <stdint.h>
 	#include "../headers/util.h"
+	#include "../headers/imgproc.h"
 
-	struct lstnode
-	{
-		byte* img;
-		uint16_t size;
-		struct lstnode* next;
-		time_t tstamp;
-	};
-
-	struct lstnode* allocate(size_t size);
+	// Built in with make TURBOJPEG=1, which defines HAVE_TURBOJPEG and links
+	// libturbojpeg. Without it these exit with an error.
+	void configureTurbo(struct jpegEncoder* enc, struct imgDetails det);
+	size_t encodeTurbo(struct jpegEncoder* enc, const byte* yuyv, byte** buf,
+			size_t* capacity);
+	void destroyTurbo(struct jpegEncoder* enc);
 
 #endif
@@ -0,0 +1,79 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Lossless re-encoding of JPEG frames through their DCT coefficients.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#ifndef TRANSCODE_H
+	#define TRANSCODE_H
+
+	#include <stdlib.h>
+	#include <stdio.h>
+	#include <stdbool.h>
+	#include <setjmp.h>
+	#include "../headers/util.h"
+	#include "../headers/imgproc.h"
+
+	// libjpeg error handler that returns to the transcoder instead of
+	// exiting, so a corrupt camera frame can be sent on as it came
+	struct transcodeError
+	{
+		struct jpeg_error_mgr pub;
+		jmp_buf escape;
+	};
+
+	// Decompression and compression objects kept across frames. The frame's
+	// quantised DCT coefficients are carried straight from one to the other,
+	// so no DCT is done: nothing is lost unless they are requantised to a
+	// lower quality on the way.
+	struct jpegTranscoder
+	{
+		struct jpeg_decompress_struct src;
+		struct jpeg_compress_struct dst;
+		struct transcodeError err;		// shared by both objects
+		struct bufferDest dest;
+		unsigned long failures;
+	};
+
+	void initTranscoder(struct jpegTranscoder* tc);
+	size_t transcodeJpeg(struct jpegTranscoder* tc, const byte* jpg,
+			size_t len, unsigned int quality, bool arithmetic,
+			uint32_t sequence, byte** buf, size_t* capacity);
+	void destroyTranscoder(struct jpegTranscoder* tc);
+
+#endif
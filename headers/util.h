@@ -48,6 +48,8 @@
 	#include <stdint.h>
 	#include <unistd.h>
 	#include <fcntl.h>
+	#include <time.h>
+	#include <sys/time.h>
 
 	// Macro to clear a pointer to memory
 	#ifndef CLEAR
@@ -83,5 +85,8 @@
 	void exitWithError(const char* message);
 	void xioctl(int fd, int request, void *arg);
 	uint16_t byteToInt(byte bytes[2]);
+	double elapsedMs(const struct timespec* start);
+	uint64_t monotonicUs();
+	uint64_t timevalUs(const struct timeval* tv);
 
 #endif
@@ -0,0 +1,92 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// YUYV to YUV 4:4:4 conversion kernels with runtime CPU dispatch.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#ifndef YUVCONV_H
+	#define YUVCONV_H
+
+	#include <stdio.h>
+	#include <stdlib.h>
+	#include <string.h>
+	#include <stdbool.h>
+	#include <stdint.h>
+	#include "../headers/util.h"
+
+	// Converts pairs of YUYV pixels (Y0 U Y1 V) to interleaved YUV 4:4:4
+	// (Y0 U V Y1 U V), duplicating the chroma of each pair
+	typedef void (*yuyvConverter)(const byte* yuyv, byte* yuv, size_t pairs);
+
+	// Splits pairs of YUYV pixels into separate Y, Cb and Cr planes at
+	// native 4:2:2, two luma samples for every chroma sample
+	typedef void (*yuyvSplitter)(const byte* yuyv, byte* y, byte* cb, byte* cr,
+			size_t pairs);
+
+	// Width in bytes and height in rows of one 16x8 4:2:2 MCU in a YUYV
+	// frame, the block compared by a yuyvBlockSad
+	#define SAD_BLOCK_BYTES	32
+	#define SAD_BLOCK_ROWS	8
+
+	// Largest sum of absolute differences over the rows of two YUYV blocks of
+	// one MCU, Y, Cb and Cr together, so a change confined to a few pixels
+	// stands out from noise spread over the block. stride is the row length
+	// of both frames in bytes.
+	typedef uint32_t (*yuyvBlockSad)(const byte* a, const byte* b,
+			size_t stride);
+
+	struct convertKernel
+	{
+		const char* name;
+		yuyvConverter convert;
+		yuyvSplitter split;
+		yuyvBlockSad sad;
+	};
+
+	// The kernel picked by selectConvertKernel(), scalar until then
+	extern struct convertKernel convertKernel;
+
+	void selectConvertKernel();
+	void convertYUYVScalar(const byte* yuyv, byte* yuv, size_t pairs);
+	void splitYUYVScalar(const byte* yuyv, byte* y, byte* cb, byte* cr,
+			size_t pairs);
+	uint32_t sadYUYVScalar(const byte* a, const byte* b, size_t stride);
+	uint32_t sadYUYVClipped(const byte* a, const byte* b, size_t stride,
+			unsigned int width, unsigned int rows);
+
+#endif
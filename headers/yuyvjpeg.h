@@ -0,0 +1,91 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Direct YUYV 4:2:2 to baseline JPEG encoder.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+
+#ifndef YUYVJPEG_H
+	#define YUYVJPEG_H
+
+	#include <stdlib.h>
+	#include <stdio.h>
+	#include <stdbool.h>
+	#include <string.h>
+	#include <stdint.h>
+	#include "../headers/util.h"
+	#include "../headers/imgproc.h"
+	#include "../headers/fdct.h"
+
+	// Huffman code and length of each symbol of one table
+	struct huffCodes
+	{
+		uint16_t code[256];
+		uint8_t size[256];
+	};
+
+	// Tables and working storage of the direct encoder, taken from the
+	// libjpeg object it stands in for so both write the same DQT and DHT
+	struct directEncoder
+	{
+		uint8_t quant[2][DCTSIZE2];		// luma and chroma steps, zigzag order
+		float recip[2][DCTSIZE2];		// 1 / AAN scaled step, natural order
+		JHUFF_TBL dcTables[2];
+		JHUFF_TBL acTables[2];
+		struct huffCodes dc[2];
+		struct huffCodes ac[2];
+		int16_t coefs[MCU_BLOCKS * DCTSIZE2] __attribute__((aligned(16)));
+		byte edge[MCU_BYTES * MCU_ROWS];	// padded copy of an edge MCU
+	};
+
+	// Entropy coded output collected 32 bits at a time into a buffer grown
+	// as needed
+	struct bitWriter
+	{
+		byte** buf;
+		size_t* capacity;
+		size_t size;
+		uint64_t acc;
+		unsigned int bits;			// bits in acc not yet written
+	};
+
+	void setDirectTables(struct directEncoder* de, j_compress_ptr cinfo);
+	size_t encodeDirect(struct jpegEncoder* enc, const byte* yuyv, byte** buf,
+			size_t* capacity);
+
+#endif
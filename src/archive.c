@@ -0,0 +1,333 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Archive of every encoded frame in memory-mapped segment files on local
+// flash, each with an index of fixed-size records.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#define _GNU_SOURCE
+#include "../headers/archive.h"
+
+static uint32_t crcTable[256];
+
+// Build the table for CRC-32 with the reflected IEEE 802.3 polynomial
+static void initCrc()
+{
+	uint32_t	c;
+	int			n, k;
+	for(n = 0; n < 256; n++)
+	{
+		c = n;
+		for(k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		crcTable[n] = c;
+	}
+}
+
+static uint32_t crc32(const byte* buf, size_t len)
+{
+	uint32_t c = 0xFFFFFFFF;
+	while(len-- > 0) c = crcTable[(c ^ *buf++) & 0xFF] ^ (c >> 8);
+	return c ^ 0xFFFFFFFF;
+}
+
+static struct archiveEntry* indexOf(struct frameArchive* a)
+{
+	return (struct archiveEntry*)(a->map + sizeof(struct archiveHeader));
+}
+
+// Write the images and index records added since the last call back to
+// flash: images first, then the index that points at them. Only dirty
+// pages are written, so whole ranges are given.
+static void syncSegment(struct frameArchive* a)
+{
+	struct archiveHeader* header = (struct archiveHeader*)a->map;
+	if(a->map == NULL || a->used == a->synced) return;
+	if(msync(a->map + a->dataOffset, a->used - a->dataOffset, MS_SYNC) != 0)
+	{
+		perror("Could not write back the archive");
+	}
+	header->count = a->count;
+	if(msync(a->map, a->dataOffset, MS_SYNC) != 0)
+	{
+		perror("Could not write back the archive index");
+	}
+	a->synced = a->used;
+	a->dirtyUs = 0;
+	a->syncs++;
+}
+
+// Bytes of a segment an image of size bytes takes
+static inline uint64_t imageSpan(uint32_t size)
+{
+	return (size + (uint64_t)RECORD_ALIGN - 1) & ~(uint64_t)(RECORD_ALIGN - 1);
+}
+
+// Add an image to the open segment, which has room for it
+static void appendEntry(struct frameArchive* a, const struct frameRecord* rec,
+		const byte* img)
+{
+	struct archiveEntry* e = indexOf(a) + a->count;
+	memcpy(a->map + a->used, img, rec->size);
+	e->sequence = rec->sequence;
+	e->length = rec->size;
+	e->captureUs = rec->captureUs;
+	e->offset = a->used;
+	e->crc = crc32(img, rec->size);
+	e->kind = rec->kind;
+	e->tablesId = rec->tablesId;
+	a->used += imageSpan(rec->size);
+	a->count++;
+	if(a->dirtyUs == 0) a->dirtyUs = monotonicUs();
+}
+
+// Number one past the highest segment file already in dir, so segments
+// sort in capture order across runs whatever has been deleted
+static unsigned int nextSegmentIn(const char* dir)
+{
+	DIR*			d = opendir(dir);
+	struct dirent*	ent;
+	unsigned int	n, next = 0;
+	char			tail;
+	if(d == NULL) return 0; // reported when the first segment is made
+	while((ent = readdir(d)) != NULL)
+	{
+		if(strlen(ent->d_name) == 12 &&
+				sscanf(ent->d_name, "seg%5u.hc%c", &n, &tail) == 2 &&
+				tail == 'a' && n >= next)
+		{
+			next = n + 1;
+		}
+	}
+	closedir(d);
+	return next;
+}
+
+// Make the next segment file, preallocate it and map it. Abbreviated
+// frames in it can be read on their own: it starts with the last tables
+// stream written. False when storage gives out.
+static bool openSegment(struct frameArchive* a)
+{
+	struct archiveHeader*	header;
+	char					name[256];
+	int						err;
+	do
+	{
+		snprintf(name, sizeof(name), "%s/seg%05u.hca", a->dir,
+				a->nextSegment++);
+		a->fd = open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	} while(a->fd == -1 && errno == EEXIST &&
+			a->nextSegment < ARCHIVE_MAX_SEGMENTS);
+	if(a->fd == -1)
+	{
+		perror(name);
+		return false;
+	}
+	err = posix_fallocate(a->fd, 0, a->segmentBytes);
+	if(err == 0)
+	{
+		a->map = (byte*)mmap(NULL, a->segmentBytes, PROT_READ | PROT_WRITE,
+				MAP_SHARED, a->fd, 0);
+		if(a->map == MAP_FAILED)
+		{
+			err = errno;
+			a->map = NULL;
+		}
+	}
+	if(err != 0)
+	{
+		errno = err;
+		perror(name);
+		close(a->fd);
+		unlink(name);
+		a->fd = -1;
+		return false;
+	}
+	header = (struct archiveHeader*)a->map;
+	memcpy(header->magic, ARCHIVE_MAGIC, sizeof(header->magic));
+	header->version = ARCHIVE_VERSION;
+	header->entrySize = sizeof(struct archiveEntry);
+	header->entries = a->entries;
+	header->count = 0;
+	header->dataOffset = a->dataOffset;
+	header->bytes = a->segmentBytes;
+	a->used = a->dataOffset;
+	a->synced = a->used;
+	a->count = 0;
+	a->segments++;
+	if(a->tablesRec.size > 0) appendEntry(a, &a->tablesRec, a->tables);
+	return true;
+}
+
+// Write the rest of the open segment back and cut the file to the images
+// it holds
+static void closeSegment(struct frameArchive* a)
+{
+	if(a->map == NULL) return;
+	syncSegment(a);
+	munmap(a->map, a->segmentBytes);
+	a->map = NULL;
+	if(ftruncate(a->fd, a->used) != 0 || fsync(a->fd) != 0)
+	{
+		perror("Could not trim the archive segment");
+	}
+	close(a->fd);
+	a->fd = -1;
+}
+
+// Writer: add a record from the queue to the archive, in a new segment when
+// the open one is full. An image too large for a new segment, after the
+// tables stream that starts it, is left out.
+static void archiveRecord(struct frameArchive* a, const struct frameRecord* rec)
+{
+	uint64_t span = imageSpan(rec->size);
+	if(a->failed || span > a->segmentBytes - a->dataOffset -
+			imageSpan(ARCHIVE_TABLES_BYTES))
+	{
+		return;
+	}
+	if(a->map != NULL && (a->count == a->entries ||
+			a->segmentBytes - a->used < span))
+	{
+		closeSegment(a);
+	}
+	if(a->map == NULL && !openSegment(a))
+	{
+		fprintf(stderr, "Archive stopped, frames are no longer kept.\n");
+		a->failed = true;
+		return;
+	}
+	if(rec->kind == RECORD_TABLES && rec->size <= ARCHIVE_TABLES_BYTES)
+	{
+		memcpy(a->tables, rec->data, rec->size);
+		a->tablesRec = *rec;
+	}
+	appendEntry(a, rec, rec->data);
+	if(rec->kind == RECORD_FRAME)
+	{
+		a->frames++;
+		a->bytes += rec->size;
+	}
+}
+
+// The archive writer's thread: takes frames off the queue as they are
+// posted and writes them back once enough are waiting or the oldest has
+// waited long enough. Stops once the queue is empty after stopArchive().
+static void* writeArchive(void* arg)
+{
+	struct frameArchive*	a = (struct frameArchive*)arg;
+	struct frameRecord*		rec;
+	struct timespec			due;
+	uint64_t				dueUs;
+	bool					stopping;
+	while(true)
+	{
+		stopping = atomic_load_explicit(&a->stopping, memory_order_acquire);
+		while((rec = ringPeek(&a->queue)) != NULL)
+		{
+			archiveRecord(a, rec);
+			ringRelease(&a->queue, rec);
+		}
+		if(stopping) break;
+		dueUs = a->dirtyUs + ARCHIVE_SYNC_MS * 1000;
+		if(a->dirtyUs != 0 && (a->used - a->synced >= ARCHIVE_SYNC_BYTES ||
+				monotonicUs() >= dueUs))
+		{
+			syncSegment(a);
+		}
+		if(a->dirtyUs == 0) sem_wait(&a->ready);
+		else
+		{
+			due.tv_sec = dueUs / 1000000;
+			due.tv_nsec = dueUs % 1000000 * 1000;
+			sem_clockwait(&a->ready, CLOCK_MONOTONIC, &due);
+		}
+	}
+	closeSegment(a);
+	return NULL;
+}
+
+// Start archiving to segment files of segmentBytes in dir. The queue comes
+// from the frame arena when it has room.
+void startArchive(struct frameArchive* a, const char* dir,
+		size_t segmentBytes)
+{
+	CLEAR(*a);
+	initCrc();
+	a->dir = dir;
+	a->segmentBytes = segmentBytes;
+	a->entries = segmentBytes / ARCHIVE_BYTES_PER_ENTRY;
+	a->dataOffset = (sizeof(struct archiveHeader) + (uint64_t)a->entries *
+			sizeof(struct archiveEntry) + ARCHIVE_PAGE - 1) &
+			~(uint64_t)(ARCHIVE_PAGE - 1);
+	a->fd = -1;
+	a->nextSegment = nextSegmentIn(dir);
+	initFrameRing(&a->queue, ARCHIVE_QUEUE_BYTES, true);
+	sem_init(&a->ready, 0, 0);
+	atomic_init(&a->stopping, false);
+	if(pthread_create(&a->thread, NULL, writeArchive, a) != 0)
+	{
+		exitWithError("Could not start the archive writer.");
+	}
+}
+
+// Producer: a record in the queue for size bytes of image, filled in like
+// one of the frame ring's. NULL, with the frame counted as dropped by the
+// caller, when the writer is too far behind.
+struct frameRecord* archiveAppend(struct frameArchive* a, uint32_t size,
+		enum recordKind kind)
+{
+	return ringAppend(&a->queue, size, kind);
+}
+
+// Producer: hand the records appended so far to the writer. Posting a
+// semaphore never blocks.
+void archivePublish(struct frameArchive* a)
+{
+	ringPublish(&a->queue);
+	sem_post(&a->ready);
+}
+
+// Write out what is queued, close the last segment and stop the writer
+void stopArchive(struct frameArchive* a)
+{
+	atomic_store_explicit(&a->stopping, true, memory_order_release);
+	sem_post(&a->ready);
+	pthread_join(a->thread, NULL);
+	sem_destroy(&a->ready);
+	freeFrameRing(&a->queue);
+}
@@ -0,0 +1,219 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Preallocated storage for frame and packet buffers.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#include "../headers/arena.h"
+
+struct frameArena frameArena = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Map the arena: blocks frame buffers of blockBytes each and extraBytes for
+// other buffers. Pages are touched now, not on first use, and locked in RAM
+// when asked; huge pages, when asked, cut the TLB misses of walking frames.
+// Either falls back with a warning when the system will not allow it.
+void createFrameArena(unsigned int blocks, size_t blockBytes,
+		size_t extraBytes, bool lock, bool hugePages)
+{
+	struct frameArena*	a = &frameArena;
+	size_t				size;
+	void*				base = MAP_FAILED;
+	blockBytes = (blockBytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	size = blocks * blockBytes + extraBytes + ARENA_ALIGN;
+	if(hugePages)
+	{
+		size = (size + HUGE_PAGE_BYTES - 1) & ~(size_t)(HUGE_PAGE_BYTES - 1);
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+				MAP_ANONYMOUS | MAP_POPULATE | MAP_HUGETLB, -1, 0);
+		if(base == MAP_FAILED)
+		{
+			fprintf(stderr, "No huge pages for the frame arena, using "
+					"normal pages.\n");
+		}
+	}
+	a->hugePages = base != MAP_FAILED;
+	if(base == MAP_FAILED)
+	{
+		base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE |
+				MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	}
+	if(base == MAP_FAILED) exitWithError("Could not map the frame arena.");
+	a->locked = lock && mlock(base, size) == 0;
+	if(lock && !a->locked)
+	{
+		perror("Could not lock the frame arena");
+	}
+	a->base = (byte*)base;
+	a->size = size;
+	a->used = 0;
+	a->blockBytes = blockBytes;
+	a->blocks = blocks;
+	a->taken = 0;
+	atomic_init(&a->heapAllocs, 0);
+}
+
+// Carve bytes from the arena, called with it locked
+static byte* carve(struct frameArena* a, size_t bytes)
+{
+	byte* p = NULL;
+	bytes = (bytes + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if(a->base != NULL && a->size - a->used >= bytes)
+	{
+		p = a->base + a->used;
+		a->used += bytes;
+	}
+	return p;
+}
+
+// Carve bytes from the arena, or NULL when there is no arena or not enough
+// of it left
+byte* arenaAlloc(size_t bytes)
+{
+	byte* p;
+	pthread_mutex_lock(&frameArena.lock);
+	p = carve(&frameArena, bytes);
+	pthread_mutex_unlock(&frameArena.lock);
+	return p;
+}
+
+// Whether a buffer is storage in the arena
+static bool inArena(const byte* buf)
+{
+	return frameArena.base != NULL && buf >= frameArena.base &&
+			buf < frameArena.base + frameArena.size;
+}
+
+// Make sure *buf holds at least len bytes, keeping its contents. Storage
+// for a frame buffer is a block of the arena if one is left and big enough;
+// otherwise, or when a buffer outgrows its block, the heap. *buf and
+// *capacity may change.
+void reserveImage(byte** buf, size_t* capacity, size_t len)
+{
+	byte* grown;
+	if(*capacity >= len) return;
+	if(*buf == NULL && len <= frameArena.blockBytes)
+	{
+		pthread_mutex_lock(&frameArena.lock);
+		grown = carve(&frameArena, frameArena.blockBytes);
+		if(grown != NULL) frameArena.taken++;
+		pthread_mutex_unlock(&frameArena.lock);
+		if(grown != NULL)
+		{
+			*buf = grown;
+			*capacity = frameArena.blockBytes;
+			return;
+		}
+	}
+	if(frameArena.base != NULL)
+	{
+		atomic_fetch_add_explicit(&frameArena.heapAllocs, 1,
+				memory_order_relaxed);
+	}
+	if(inArena(*buf)) // the block is left behind, it is too small
+	{
+		grown = (byte*)malloc(len);
+		if(grown != NULL) memcpy(grown, *buf, *capacity);
+	}
+	else grown = (byte*)realloc(*buf, len);
+	if(grown == NULL) exitWithError("Could not allocate image.");
+	*buf = grown;
+	*capacity = len;
+}
+
+// Give up a buffer from reserveImage(); arena storage goes with the arena
+void releaseImage(byte* buf)
+{
+	if(!inArena(buf)) free(buf);
+}
+
+void destroyFrameArena()
+{
+	if(frameArena.base == NULL) return;
+	munmap(frameArena.base, frameArena.size);
+	frameArena.base = NULL;
+}
+
+#ifdef ARENA_DEBUG
+// Built with ARENA_DEBUG, malloc(), calloc() and realloc() calls from this
+// program's own objects are linked here (-Wl,--wrap) and counted. libjpeg
+// and the C library keep their own references and are not counted: libjpeg
+// still takes and frees its working pools in the heap for every frame.
+static _Atomic unsigned long allocations;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* p, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size)
+{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* p, size_t size)
+{
+	atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+	return __real_realloc(p, size);
+}
+
+unsigned long heapAllocations()
+{
+	return atomic_load_explicit(&allocations, memory_order_relaxed);
+}
+
+// Called as each frame is published. Once the warm-up frames have gone,
+// every frame and packet buffer has its storage and the program's own code
+// may not touch the heap again.
+void assertSteadyState()
+{
+	static unsigned long	frames = 0;
+	static unsigned long	settled = 0;
+	frames++;
+	if(frames == ARENA_WARMUP_FRAMES) settled = heapAllocations();
+	else if(frames > ARENA_WARMUP_FRAMES)
+	{
+		assert(heapAllocations() == settled);
+	}
+}
+#endif
@@ -0,0 +1,263 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Encoder benchmarks.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#include "../headers/bench.h"
+
+// Open the configured source unpaced, asking a camera for raw frames even
+// where the run itself would take MJPEG, and check it delivers them
+struct frameSource* openBenchSource(const struct srcConfig* cfg)
+{
+	struct srcConfig	benchCfg = *cfg;
+	struct frameSource*	src;
+	benchCfg.maxSpeed = TRUE;
+	if(benchCfg.pixelformat == 0) benchCfg.pixelformat = V4L2_PIX_FMT_YUYV;
+	src = openFrameSource(&benchCfg);
+	if(src->pixelformat != V4L2_PIX_FMT_YUYV)
+	{
+		exitWithError("Encoder benchmark needs YUYV frames.");
+	}
+	return src;
+}
+
+// Time a persistent encoder in one mode over frames, adding up the bytes.
+// The encoder makes frames the way the run's settings would: abbreviated,
+// progressive or arithmetic coded.
+double timeEncodeMode(struct frameSource* src,
+		const struct encodeSettings* settings, enum encodeMode mode,
+		unsigned int frames, size_t* bytes, byte** buf, size_t* capacity)
+{
+	unsigned int		quality = settings->quality;
+	struct jpegEncoder	enc;
+	struct frame		frm;
+	struct timespec		t;
+	double				ms = 0;
+	unsigned int		n;
+	*bytes = 0;
+	initEncoder(&enc);
+	enc.abbreviated = settings->abbreviated;
+	enc.progressive = settings->progressive;
+	enc.arithmetic = settings->arithmetic;
+	for(n = 0; n < frames; n++)
+	{
+		while(!src->next(src, &frm));
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		configureEncoder(&enc, src->det, quality, mode);
+		*bytes += encodeFrame(&enc, frm.data, buf, capacity);
+		ms += elapsedMs(&t);
+		src->release(src, &frm);
+	}
+	destroyEncoder(&enc);
+	return ms;
+}
+
+// Compare encoding with a libjpeg object created and destroyed for every
+// frame against one persistent encoder, on the same frames. The setup cost
+// is timed on its own for both: create, set defaults, set quality and
+// destroy per frame, against the per frame configureEncoder() check. With
+// stripes set, the latency of a frame split into restart interval stripes
+// is measured as well. Last, the direct YUYV encoder is raced against
+// libjpeg at 4:2:2 on the same frames, for speed and size, along with
+// TurboJPEG when it is built in.
+void benchmarkEncoder(const struct srcConfig* cfg,
+		const struct encodeSettings* settings, unsigned int frames)
+{
+	unsigned int		quality = settings->quality;
+	enum encodeMode		mode = settings->mode;
+	unsigned int		stripes = settings->stripes;
+	struct encodeSettings	baseline = *settings;
+	struct frameSource*	src = openBenchSource(cfg);
+	struct jpegEncoder	enc;
+	struct frame		frm;
+	struct timespec		t;
+	struct stripeEncoder	striped;
+	double				perFrameMs = 0, persistentMs = 0, configureMs = 0;
+	double				stripedMs = 0;
+	double				setupMs, directMs, libjpegMs;
+	size_t				directBytes, libjpegBytes;
+#ifdef HAVE_TURBOJPEG
+	double				turboMs;
+	size_t				turboBytes;
+#endif
+	unsigned int		n;
+	byte*				buf = NULL;
+	size_t				capacity = 0;
+	for(n = 0; n < frames; n++) // libjpeg set up for every frame
+	{
+		while(!src->next(src, &frm));
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		compressJpegYUYV(frm.data, quality, src->det, mode, &buf, &capacity);
+		perFrameMs += elapsedMs(&t);
+		src->release(src, &frm);
+	}
+	initEncoder(&enc);
+	for(n = 0; n < frames; n++) // one encoder reused for every frame
+	{
+		while(!src->next(src, &frm));
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		configureEncoder(&enc, src->det, quality, mode);
+		configureMs += elapsedMs(&t);
+		encodeFrame(&enc, frm.data, &buf, &capacity);
+		persistentMs += elapsedMs(&t);
+		src->release(src, &frm);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	for(n = 0; n < frames; n++) // setup alone, as the per frame path does it
+	{
+		struct jpegEncoder once;
+		initEncoder(&once);
+		configureEncoder(&once, src->det, quality, mode);
+		destroyEncoder(&once);
+	}
+	setupMs = elapsedMs(&t);
+	if(stripes > 1)
+	{
+		initStripeEncoder(&striped, stripes);
+		for(n = 0; n < frames; n++) // one frame split across threads
+		{
+			while(!src->next(src, &frm));
+			clock_gettime(CLOCK_MONOTONIC, &t);
+			encodeStriped(&striped, frm.data, src->det, quality, mode, &buf,
+					&capacity);
+			stripedMs += elapsedMs(&t);
+			src->release(src, &frm);
+		}
+		destroyStripeEncoder(&striped);
+	}
+	// the direct and TurboJPEG encoders only make baseline Huffman frames
+	baseline.abbreviated = baseline.progressive = baseline.arithmetic = FALSE;
+	directMs = timeEncodeMode(src, &baseline, ENC_DIRECT422, frames,
+			&directBytes, &buf, &capacity);
+	libjpegMs = timeEncodeMode(src, &baseline, ENC_RAW422, frames,
+			&libjpegBytes, &buf, &capacity);
+#ifdef HAVE_TURBOJPEG
+	turboMs = timeEncodeMode(src, &baseline, ENC_TURBO422, frames,
+			&turboBytes, &buf, &capacity);
+#endif
+	printf("Encoder benchmark: %u frames of %ux%u, quality %u\n", frames,
+			src->det.width, src->det.height, quality);
+	printf("Per-frame encoder:  %.3f ms/frame, setup %.3f ms/frame\n",
+			perFrameMs / frames, setupMs / frames);
+	printf("Persistent encoder: %.3f ms/frame, setup %.3f ms/frame "
+			"(configured %u times)\n", persistentMs / frames,
+			configureMs / frames, enc.reconfigurations);
+	if(stripes > 1)
+	{
+		printf("Striped encoder:    %.3f ms/frame in %u stripes\n",
+				stripedMs / frames, stripes);
+	}
+	printf("Direct encoder:     %.3f ms/frame, %zu bytes/frame (%s DCT)\n",
+			directMs / frames, directBytes / frames, dctKernel.name);
+	printf("libjpeg 4:2:2:      %.3f ms/frame, %zu bytes/frame\n",
+			libjpegMs / frames, libjpegBytes / frames);
+#ifdef HAVE_TURBOJPEG
+	printf("TurboJPEG 4:2:2:    %.3f ms/frame, %zu bytes/frame\n",
+			turboMs / frames, turboBytes / frames);
+#endif
+	destroyEncoder(&enc);
+	free(buf);
+	closeFrameSource(src);
+}
+
+// Stitched stripes share the Huffman tables of stripe 0 and carry their
+// own restart intervals, so profiles that change either do not fit them
+bool profileFits(const struct encodeProfile* profile,
+		const struct encodeSettings* settings)
+{
+	return settings->stripes <= 1 ||
+			(!profile->optimize && profile->restartRows == 0);
+}
+
+// Pick the encoder profile for this board and scene. Each profile that fits
+// the settings encodes the same sample frames from the source, a frame at
+// a time on one encoder set up as the run's are, and the one with the
+// fewest bytes per frame whose mean time meets deadlineMs becomes
+// encodeProfile. If none is fast enough the fastest is taken. The first
+// frame of each run sets the encoder up and is not counted.
+void calibrateProfile(const struct srcConfig* cfg,
+		const struct encodeSettings* settings, double deadlineMs)
+{
+	struct frameSource*			src = openBenchSource(cfg);
+	const struct encodeProfile*	best = NULL;
+	const struct encodeProfile*	fastest = NULL;
+	double						ms, bestMs = 0, fastestMs = 0;
+	size_t						bytes, bestBytes = 0;
+	unsigned int				i;
+	byte*						buf = NULL;
+	size_t						capacity = 0;
+	printf("Calibrating encoder profiles on %u frames of %ux%u, quality %u\n",
+			CALIBRATION_FRAMES, src->det.width, src->det.height,
+			settings->quality);
+	for(i = 0; i < ENCODE_PROFILES; i++)
+	{
+		if(!profileFits(&encodeProfiles[i], settings)) continue;
+		encodeProfile = &encodeProfiles[i];
+		timeEncodeMode(src, settings, settings->mode, 1, &bytes, &buf,
+				&capacity);
+		ms = timeEncodeMode(src, settings, settings->mode,
+				CALIBRATION_FRAMES, &bytes, &buf, &capacity) /
+				CALIBRATION_FRAMES;
+		bytes /= CALIBRATION_FRAMES;
+		printf("Profile %-9s %.3f ms/frame, %zu bytes/frame%s\n",
+				encodeProfile->name, ms, bytes,
+				ms > deadlineMs ? ", too slow" : "");
+		if(fastest == NULL || ms < fastestMs)
+		{
+			fastest = encodeProfile;
+			fastestMs = ms;
+		}
+		if(ms <= deadlineMs && (best == NULL || bytes < bestBytes ||
+				(bytes == bestBytes && ms < bestMs)))
+		{
+			best = encodeProfile;
+			bestMs = ms;
+			bestBytes = bytes;
+		}
+	}
+	if(best == NULL)
+	{
+		printf("No profile meets %.1f ms/frame, using the fastest\n",
+				deadlineMs);
+		best = fastest;
+	}
+	encodeProfile = best;
+	free(buf);
+	closeFrameSource(src);
+}
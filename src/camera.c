@@ -44,312 +44,756 @@
 #define _GNU_SOURCE
 #include "../headers/camera.h"
 
-// Open the camera device as a file
-void openDevice(const char* location, int* fd)
+// Fill in a record appended for a job: the image, and the sequence number
+// and times of the frame it is for
+void fillRecord(struct frameRecord* rec, unsigned int tablesId,
+		const byte* img, const struct encodeJob* job)
 {
-	*fd = open(location, O_RDWR, 0);
-	if(*fd==1)
-	{
-		exitWithError("Open camera failed");
-	}
-	else
-	{
-		printf("Opened Camera");
-	}
-}
-
-// Get the capabilities of the camera device
-// as described here:
-// http://linuxtv.org/downloads/v4l-dvb-apis/vidioc-querycap.html#device-capabi
-// lities
-void getCapabilities(int* fd)
-{
-	struct v4l2_capability cap;
-	xioctl(*fd, VIDIOC_QUERYCAP, &cap);
-	printf("Capabilities: %x\nDriver: %s\n", cap.capabilities, cap.driver);
+	memcpy(rec->data, img, rec->size);
+	rec->tablesId = tablesId;
+	rec->sequence = job->frm.sequence;
+	rec->captureUs = timevalUs(&job->frm.timestamp);
+	rec->encodedUs = job->encodedUs;
 }
 
-// Close the camera device
-void closeDevice(int* fd)
+// The tables-only stream abbreviated frames at quality need, written into
+// the writer's own buffer, as libjpeg needs storage it can grow, when the
+// quality changes. Returns its length.
+size_t tablesFor(struct ringWriter* writer, unsigned int quality)
 {
-	if(*fd != -1) close(*fd);
-	printf("Close device successful (%d)", *fd);
-	*fd = -1;
-	return;
-}
-
-// Get the format in which the camera driver provides frames from the camera
-struct imgDetails getFrameFormat(int* fd)
-{
-	struct imgDetails det; // struct to hold image information
-	struct v4l2_format fmt; // the v4l2 struct for frame format
-	CLEAR(fmt); // clear this structs memory
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE; // we are performing video capture
-    xioctl(*fd, VIDIOC_G_FMT, &fmt); // request the format from the driver
-    det.width = fmt.fmt.pix.width; // set the image width for later on
-    det.height = fmt.fmt.pix.height; // set the image height for later on
-    det.size = det.width*det.height*3; // set the image size for later on
-    return det;
+	if(writer->tablesQuality != quality)
+	{
+		configureEncoder(&writer->tables, writer->det, quality, writer->mode);
+		writer->tablesSize = writeTables(&writer->tables, &writer->tablesImg,
+				&writer->tablesCapacity);
+		writer->tablesQuality = quality;
+	}
+	return writer->tablesSize;
 }
 
-// Get the struct to be sent to v4l2 to retrieve the image data
-struct v4l2_requestbuffers getReqBufs(uint nbuffers, uint minbuffers, int* fd)
+// Appends a tables-only stream to the ring, ahead of the abbreviated frame
+// that needs it. Returns FALSE when there is no room.
+bool publishTables(struct ringWriter* writer, const struct encodeJob* job)
 {
-	struct v4l2_requestbuffers reqbuf;
-	CLEAR(reqbuf); // Clear the required memory
-	reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE; // we are capturing video
-	reqbuf.memory = V4L2_MEMORY_MMAP; // map kernel-space memory to user-space
-	reqbuf.count = nbuffers; // the number of frames we wish to retrieve
-	xioctl(*fd, VIDIOC_REQBUFS, &reqbuf); // request the buffers
-	if (reqbuf.count < minbuffers)
-	{
-		// Should never be w/out enough memory unless other proc is hogging
-		printf("Not enough buffer memory - trying again\n");
-	}
-	return reqbuf;
+	struct frameRecord*	rec;
+	rec = ringAppend(writer->ring, tablesFor(writer, job->quality),
+			RECORD_TABLES);
+	if(rec == NULL) return FALSE;
+	fillRecord(rec, job->quality, writer->tablesImg, job);
+	writer->tablesId = job->quality;
+	writer->run->tables++;
+	return TRUE;
 }
 
-// Map the buffer of image data from kernel to user space
-void mapBuffer(const struct v4l2_requestbuffers reqbuf, int nbuffers,
-		struct v4l2_buffer buf, struct buffer* buffers, int* fd)
+// Queues an encoded frame for the archive, after its tables when the
+// archive has not had them. The frame is left out, and counted, when the
+// archive writer has fallen so far behind that the queue is full.
+void archiveImage(struct ringWriter* writer, const struct encodeJob* job,
+		bool abbreviated)
 {
-	CLEAR(buf); // clear the v4l2 frame buffer struct
-	buf.type = reqbuf.type; // we are capturing video
-	buf.memory = V4L2_MEMORY_MMAP; // we are mapping from kernel-space to user
-	buf.index = nbuffers; // the number of buffers requested
-	xioctl(*fd, VIDIOC_QUERYBUF, &buf); // query v4l2 for these buffers
-	// Set the length of the buffer pointer struct to the number of buffers
-	// returned by v4l2
-	buffers[nbuffers].length = buf.length;
-	// Perform the mapping, with the pointer of the memory mapped stored in
-	// the user-space buffer pointer struct
-	buffers[nbuffers].start = (byte*)mmap(NULL, buf.length,
-			PROT_READ | PROT_WRITE, MAP_SHARED, *fd, buf.m.offset);
-	// Memory mapping should not fail is performed on a correct fp for a
-	// camera. If mmap does fail in testing, reasons for failure available
-	// here: http://pubs.opengroup.org/onlinepubs/009695399/functions/mmap.html
-	if (MAP_FAILED == buffers[nbuffers].start)
-	{
-		exitWithError("Memory mapping failed.");
+	struct frameArchive*	archive = writer->archive;
+	struct frameRecord*		rec = NULL;
+	if(archive == NULL) return;
+	if(abbreviated && job->quality != archive->tablesId)
+	{
+		rec = archiveAppend(archive, tablesFor(writer, job->quality),
+				RECORD_TABLES);
+		if(rec != NULL)
+		{
+			fillRecord(rec, job->quality, writer->tablesImg, job);
+			archive->tablesId = job->quality;
+		}
 	}
+	if(!abbreviated || job->quality == archive->tablesId)
+	{
+		rec = archiveAppend(archive, job->size, RECORD_FRAME);
+	}
+	if(rec == NULL) archive->dropped++;
+	else
+	{
+		fillRecord(rec, abbreviated ? job->quality : 0, job->data, job);
+	}
+	archivePublish(archive);
 }
 
-// Queue a buffer capture in the V4L2 driver
-void queueBuffer(int i, struct v4l2_buffer buf, int* fd) {
-	CLEAR(buf);
-	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf.memory = V4L2_MEMORY_MMAP;
-	buf.index = i;
-	ioctl(*fd, VIDIOC_QBUF, &buf);
-}
-
-// Takes the image data from the buffer and places it in a singly-linked list
-// node prepared for output via serial communication
-void createImage(struct v4l2_buffer buf, struct buffer* buffers,
-		const int i, struct lstnode* node, int* fd,
-		struct imgDetails det, int cqual)
+// Appends an encoded frame to the ring, prepared for output via serial
+// communication, and to the archive when there is one. Called by the encode
+// pool in capture order, one frame at a time. The frame is copied in after
+// the last, evicting the oldest frames already sent when the byte budget
+// runs out. Abbreviated frames are preceded by their tables whenever those
+// change. When the downlink has fallen so far behind that every frame held
+// is still to be sent the frame is dropped from the ring: the oldest may be
+// partly sent.
+void publishImage(void* ctx, struct encodeJob* job)
 {
-	byte* imageData = (byte*)calloc(AVG_IMG_SIZE, sizeof(byte)); // img data buf
-	FILE* fout = fmemopen(imageData, AVG_IMG_SIZE, "wb"); // open buffer
-    CLEAR(buf); // clear from the buffer object all previous settings applied
-	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE; // this is a video capture buffer
-    buf.memory = V4L2_MEMORY_MMAP; // we are using kernel memory mapping
-    ioctl(*fd, VIDIOC_DQBUF, &buf); // dequeue the buffer from v4l2 for reading
-    byte* yuvBytes = YUYVtoYUV(buffers[i].start, det); // YUYV bytes to YUV
-    // Compress these bytes to a JPEG image using libjpeg
-	compressJpeg(fout, yuvBytes, cqual, det.width, det.height, 3);
-	unsigned long int bytesWritten = ftell(fout); // # bytes written to file
-	if(node->size > 0) // set the data for this node of the singly linked list
-	{
-		node->size = 0;
-		free(node->img);
-	}
-	node->img = (byte*)malloc(sizeof(byte)*bytesWritten); // alloc image
-	node->size = bytesWritten; // set the size of the node to the bytes written
-	node->tstamp = time(NULL); // set the timestamp for the time image taken
-	memcpy(node->img, imageData, node->size); // copy the data into the node
-	fclose(fout); // close the image data memory file ptr
-	free(imageData); // free the image data byte array
-	free(yuvBytes); // free the yuyBytes data byte array
+	struct ringWriter*	writer = (struct ringWriter*)ctx;
+	struct frameRecord*	rec = NULL;
+	bool				abbreviated = writer->abbreviated && job->quality > 0;
+	assertSteadyState(); // with ARENA_DEBUG, no heap of ours once warmed up
+	writer->run->encodeMs += job->encodeMs;
+	writer->run->passes += job->passes;
+	archiveImage(writer, job, abbreviated);
+	if(!abbreviated || job->quality == writer->tablesId ||
+			publishTables(writer, job))
+	{
+		rec = ringAppend(writer->ring, job->size, RECORD_FRAME);
+	}
+	if(rec == NULL)
+	{
+		writer->run->ringDropped++;
+		ringPublish(writer->ring); // any tables that did fit
+		return;
+	}
+	fillRecord(rec, abbreviated ? job->quality : 0, job->data, job);
+	writer->run->bytes += job->size;
+	writer->run->qualitySum += job->quality;
+	writer->run->encodeLatencyUs += job->encodedUs -
+			timevalUs(&job->frm.timestamp);
+	if(job->flags & HCAM_KEY) writer->run->keyFrames++;
+	if(job->flags & HCAM_DELTA) writer->run->deltaFrames++;
+	writer->run->blocksSent += job->blocks;
+	writer->run->blocksTotal += job->frameBlocks;
+	if(writer->targetBytes > 0 && job->size > writer->targetBytes)
+	{
+		writer->run->overBudget++;
+	}
+	ringPublish(writer->ring); // hand the tables and frame over
 }
 
-struct lstnode* writeDataToSerial(struct telpkt* req, int fd,
-		struct lstnode* cNode, int nOffset)
+// Sends the next part of the current image in answer to a request, framed
+// in the packet buffer. img and size are what is downlinked for the record,
+// its own image or a copy of it at a lower quality. bytesSent is set to the
+// number of image bytes written. Returns TRUE once the whole image has gone.
+bool writeDataToSerial(struct telpkt* req, int fd, struct downlink* dl,
+		byte* packet, size_t* bytesSent)
 {
-	if (req->bytesRequested > 0 && cNode->size - nOffset > 0)
+	struct telpkt t;
+	size_t remaining = dl->size - dl->offset;
+	*bytesSent = 0;
+	if (req->bytesRequested > 0 && remaining > 0)
 	{
 		printf("Bytes requested: %d\n", req->bytesRequested);
-		//printf(".");
 		// Number of bytes requested is larger than image bytes remaining
 		// Image "fits within buffer"
-		if(req->bytesRequested >= cNode->size - nOffset)
+		if(req->bytesRequested >= remaining)
 		{
-			struct telpkt* t = createOutputTelPkt(req->bytesRequested,
-												  cNode->size - nOffset);
+			initOutputTelPkt(&t, packet, req->bytesRequested, remaining);
 			// Copy number of bytes in image from image to telemetry packet
-			memcpy(t->data, cNode->img + nOffset, cNode->size - nOffset);
-			writeToUart(t, fd);
-			// We've transmitted the whole image so start again
-			nOffset = 0;
-			cNode = cNode->next;
+			memcpy(t.data, dl->img + dl->offset, remaining);
+			writeToUart(&t, fd);
+			*bytesSent = remaining;
+			// We've transmitted the whole image
+			dl->offset = dl->size;
 		}
 		else // Number of bytes requested is smaller than image size
 		{
-			printf("Bytes requested: %d\n", req->bytesRequested);
-			struct telpkt* t = createOutputTelPkt(req->bytesRequested,
-												  req->bytesRequested);
+			initOutputTelPkt(&t, packet, req->bytesRequested,
+					req->bytesRequested);
 			// Copy number of bytes in request from image to telemetry packet
-			memcpy(t->data, cNode->img + nOffset, req->bytesRequested);
+			memcpy(t.data, dl->img + dl->offset, req->bytesRequested);
 			// Encode the telemetry packet
-			writeToUart(t, fd);
-			// We have only transmitted part of the image so move imageBuffer
-			// by the bytes requested
-			cNode->img += req->bytesRequested;
-			// Change image size to take away bytes requested
-			cNode->size -= req->bytesRequested;
+			writeToUart(&t, fd);
+			*bytesSent = req->bytesRequested;
+			// We have only transmitted part of the image so move on by the
+			// bytes requested
+			dl->offset += req->bytesRequested;
 		}
 	}
-	return cNode;
+	return dl->offset == dl->size;
 }
 
-// Writes image data to a file on the non-temporary storage (ie. HDD or flash
-// memory) of the device running this sofware.
+// Choose what to downlink for a record. Frames are requantised to the
+// downlink quality, if one is set and it is below the frame's own, into the
+// thread's buffer; the ring keeps the frame at the quality it was captured.
+// Tables streams, and frames that cannot be requantised, go as they are.
+void prepareDownlink(struct downlink* dl, struct frameRecord* rec)
+{
+	size_t size = 0;
+	dl->rec = rec;
+	dl->offset = 0;
+	if(dl->quality > 0 && rec->kind == RECORD_FRAME && rec->tablesId == 0)
+	{
+		size = transcodeJpeg(&dl->tc, rec->data, rec->size, dl->quality,
+				dl->arithmetic, 0, &dl->buf, &dl->capacity);
+	}
+	if(size > 0 && size < rec->size)
+	{
+		dl->img = dl->buf;
+		dl->size = size;
+	}
+	else
+	{
+		dl->img = rec->data;
+		dl->size = rec->size;
+	}
+}
+
+// Stamp a record once the last of it has gone and count how long the frame
+// took from capture
+void finishDownlink(struct downlink* dl, struct linkStats* link)
+{
+	struct frameRecord*	rec = dl->rec;
+	uint64_t			latency;
+	rec->downlinkedUs = monotonicUs();
+	if(rec->kind != RECORD_FRAME) return;
+	latency = rec->downlinkedUs - rec->captureUs;
+	atomic_fetch_add_explicit(&link->frames, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&link->latencyUs, latency, memory_order_relaxed);
+	if(latency > atomic_load_explicit(&link->maxLatencyUs,
+			memory_order_relaxed))
+	{
+		atomic_store_explicit(&link->maxLatencyUs, latency,
+				memory_order_relaxed);
+	}
+	printf("Sent frame %u: %zu bytes, %.1f ms after capture\n", rec->sequence,
+			dl->size, latency / 1000.0);
+}
+
+// Sends frames down the serial link as the ground asks for them, the
+// consumer side of the ring: a record stays unsent, owned by this thread,
+// until all of it has been sent, so the UART is written without holding
+// anything the encode pool waits on.
 void* writeImageContentToFile(void* args)
 {
 	struct threadArgs* 	inputs = (struct threadArgs*)args;
-	int 				nodeCtr = 0;
-	struct lstnode* 	node = inputs->cNode;
-	pthread_mutex_t* 	mutex = inputs->mutex;
+	struct frameRing*	ring = inputs->ring;
+	byte*				packet = inputs->packet;
+	byte				buf[6];
+	struct telpkt		tp;
+	size_t				sent;
+	struct linkStats*	link = inputs->link;
+	struct downlink		dl;
+	int fd = openPort(inputs->serialPort); // open the serial port
+	CLEAR(dl);
+	dl.quality = inputs->downlinkQuality;
+	dl.arithmetic = inputs->arithmetic;
+	initTranscoder(&dl.tc);
 	free(args);
-	int fd = openPort(); 		        // open the serial port
 	while(TRUE)
 	{
-		byte* buf = (byte*)malloc(6); // allocate buffer for meta data
 		if(read(fd, buf, 6) == 6) // read meta data
 		{
-			pthread_mutex_lock(mutex); // lock so other thread can't change ptrs
-			printf("Received: %s\n", buf);
-			struct telpkt* tp = decode(buf, 5); // create telemetry pkt
-			if(node->size > 0) node = writeDataToSerial(tp, fd, node, nodeCtr);
-			free(tp);
-			pthread_mutex_unlock(mutex);
+			printf("Received: %.6s\n", buf);
+			decode(&tp, buf, 5); // create telemetry pkt
+			if(dl.rec == NULL)
+			{
+				struct frameRecord* rec = ringPeek(ring);
+				if(rec != NULL) prepareDownlink(&dl, rec);
+			}
+			if(dl.rec != NULL)
+			{
+				if(writeDataToSerial(&tp, fd, &dl, packet, &sent))
+				{
+					finishDownlink(&dl, link);
+					ringRelease(ring, dl.rec); // history from now on
+					dl.rec = NULL;
+				}
+				atomic_fetch_add_explicit(&link->requests, 1,
+						memory_order_relaxed);
+				atomic_fetch_add_explicit(&link->bytes, sent,
+						memory_order_relaxed);
+			}
 		}
-		free(buf);
 	}
-	free(inputs);
 	pthread_exit(NULL);
 }
 
-// Turn on video streaming - this is the point at which the LED on the
-// camera should light up
-bool turnOnCamera(int* fd, bool streamOn, int* imageCaptureType)
-{
-	if (!streamOn) {
-		ioctl(*fd, VIDIOC_STREAMON, imageCaptureType);
-		streamOn = TRUE;
-	}
-	return streamOn;
-}
-
-void createThread(struct lstnode* cNode,
-		pthread_mutex_t* mutex) {
+void createThread(struct frameRing* ring, const struct camOptions* opts,
+		struct linkStats* link) {
 	pthread_t thread;
 	struct threadArgs* arg =
 			(struct threadArgs*)malloc(sizeof(struct threadArgs));
-	arg->cNode = cNode;
-	arg->mutex = mutex;
+	arg->ring = ring;
+	arg->packet = arenaAlloc(TELEMETRY_MAX_BYTES);
+	if(arg->packet == NULL) exitWithError("No room for the serial packet.");
+	arg->serialPort = opts->serialPort;
+	arg->link = link;
+	arg->downlinkQuality = opts->downlinkQuality;
+	arg->arithmetic = opts->enc.arithmetic;
 	pthread_create(&thread, NULL, writeImageContentToFile, (void*) arg);
 }
 
-// Get a frame from the camera device
-void getFrames(int noFrames, int minNoFrames, int* fd, int* imgCaptureType,
-			   int cqual, int fps, int bufferSize)
+// Storage for one frame buffer when -M is not given: TurboJPEG's bound on a
+// baseline frame (tjBufSize()) padded to whole MCUs, with room for the HCAM
+// and HMAP segments
+size_t frameBlockBytes(struct imgDetails det, const struct encodeSettings* enc)
+{
+	size_t width = (det.width + 15) & ~15;
+	size_t height = (det.height + 15) & ~15;
+	size_t bytes = width * height * (enc->mode == ENC_YUV444 ? 6 : 4) + 2048 +
+			4 + HCAM_TAG_LENGTH;
+	if(enc->keyInterval > 0) bytes += 4 + HMAP_MAX_LENGTH;
+	return bytes;
+}
+
+// The ring's byte budget: -B, or bufferSize frames of a typical size
+size_t ringBudget(const struct camOptions* opts)
+{
+	return opts->ringBytes > 0 ? opts->ringBytes :
+			(size_t)opts->bufferSize * AVG_IMG_SIZE;
+}
+
+// Map the arena every frame buffer of the run starts in: one block for each
+// buffer a worker keeps and the writer's tables, then the ring's log, the
+// serial packet and the archive queue
+void prepareArena(const struct camOptions* opts, struct imgDetails det)
+{
+	size_t			blockBytes = opts->frameBytes;
+	unsigned int	perWorker = 1; // the frame being encoded
+	unsigned int	blocks;
+	size_t			extraBytes;
+	if(blockBytes == 0) blockBytes = frameBlockBytes(det, &opts->enc);
+	if(blockBytes < AVG_IMG_SIZE) blockBytes = AVG_IMG_SIZE;
+	if(opts->enc.targetBytes > 0) perWorker++; // rate control scratch
+	if(opts->enc.stripes > 1) perWorker += opts->enc.stripes;
+	blocks = opts->workers * perWorker;
+	if(opts->enc.abbreviated) blocks++; // tables stream
+	if(opts->downlinkQuality > 0) blocks++; // requantised copy
+	extraBytes = ringBudget(opts) + ARENA_ALIGN + TELEMETRY_MAX_BYTES;
+	if(opts->archiveDir != NULL)
+	{
+		extraBytes += ARCHIVE_QUEUE_BYTES + ARENA_ALIGN;
+	}
+	createFrameArena(blocks, blockBytes, extraBytes, opts->lockArena,
+			opts->hugePages);
+}
+
+// Print the throughput of a finished run
+void printSummary(const struct frameSource* src, const struct runStats* run,
+		const struct linkStats* link, struct frameRing* ring,
+		const struct frameArchive* archive, const struct encodeSettings* enc,
+		double ms)
 {
-	struct v4l2_buffer 			buf;
-	struct buffer* 				bufs;
-	struct v4l2_requestbuffers 	reqbuf = getReqBufs(noFrames, minNoFrames, fd);
-	unsigned int 				n_buffers, i, ctr = 0;
-    bool 						started = FALSE, streamOn = false;
-    struct lstnode* cNode = allocate(bufferSize);
-    pthread_mutex_t* mutex = (pthread_mutex_t*)malloc(sizeof(pthread_mutex_t));
-    pthread_mutex_init(mutex, NULL);
-	struct imgDetails det = getFrameFormat(fd); // get video format details
-	bufs = (struct buffer*)calloc(reqbuf.count, sizeof(*bufs)); // alloc buffers
-	// If allocation fails
-	if (bufs == NULL) exitWithError("Could not allocate buffers.");
-	// Map the memory in kernel space to user space to access video efficiently
-	for (n_buffers = 0; n_buffers < reqbuf.count; n_buffers++)
-	{
-		mapBuffer(reqbuf, n_buffers, buf, bufs, fd);
-	}
-	// Queue the request struct to v4l2 to retrieve the video data mem location
-	for(i = 0; i < reqbuf.count; i++)	queueBuffer(i, buf, fd);
-	streamOn = turnOnCamera(fd, streamOn, imgCaptureType); // turn on camera
-    while(true) //forever
-    {
-		if(!started) // if the write data thread has not yet been started
+	double secs = ms / 1000.0;
+	double history = ringHistorySeconds(ring);
+	unsigned long bytes = atomic_load_explicit(&link->bytes,
+			memory_order_relaxed);
+	printf("Frames: %u in %.2f s (%.2f fps), dropped: %u\n",
+			src->stats.frames, secs, src->stats.frames / secs,
+			src->stats.dropped);
+	printf("Encode: %.2f ms/frame, %.0f bytes/frame\n",
+			run->encodeMs / src->stats.frames,
+			(double)run->bytes / src->stats.frames);
+	if(enc->targetBytes > 0)
+	{
+		printf("Rate control: mean quality %.1f, %.2f encodes/frame, "
+				"%lu frames over %zu bytes\n",
+				(double)run->qualitySum / src->stats.frames,
+				(double)run->passes / src->stats.frames, run->overBudget,
+				enc->targetBytes);
+	}
+	if(enc->abbreviated)
+	{
+		printf("Abbreviated frames: %lu tables streams sent\n", run->tables);
+	}
+	if(enc->keyInterval > 0 && run->blocksTotal > 0)
+	{
+		printf("Replenishment: %lu key, %lu delta frames, %.1f%% of blocks "
+				"sent\n", run->keyFrames, run->deltaFrames,
+				100.0 * run->blocksSent / run->blocksTotal);
+	}
+	printf("Downlink: %lu bytes in %lu requests (%.0f bytes/s), %lu frames "
+			"dropped with the ring full\n", bytes,
+			atomic_load_explicit(&link->requests, memory_order_relaxed),
+			bytes / secs, run->ringDropped);
+	if(run->bytes > 0)
+	{
+		unsigned long sentFrames = atomic_load_explicit(&link->frames,
+				memory_order_relaxed);
+		printf("Latency: capture to encoded %.1f ms mean", run->encodeLatencyUs
+				/ 1000.0 / (src->stats.frames - run->ringDropped));
+		if(sentFrames > 0)
 		{
-			started = TRUE;
-			createThread(cNode, mutex);
+			printf(", to downlinked %.1f ms mean, %.1f ms max",
+					atomic_load_explicit(&link->latencyUs,
+							memory_order_relaxed) / 1000.0 / sentFrames,
+					atomic_load_explicit(&link->maxLatencyUs,
+							memory_order_relaxed) / 1000.0);
 		}
-		for(i = 0; i < reqbuf.count; i++) // for each frame returned
+		printf("\n");
+	}
+	printf("Ring: %u frames in %u of %u bytes, %.1f s of history",
+			ring->frames, ring->bytes, ring->capacity, history);
+	if(ring->bytes > 0 && history > 0)
+	{
+		printf(", %.1f s would fit", history * ring->capacity / ring->bytes);
+	}
+	printf("\n");
+	if(archive != NULL)
+	{
+		printf("Archive: %lu frames, %lu bytes in %lu segments, %lu write "
+				"backs, %lu frames left out with the queue full%s\n",
+				archive->frames, archive->bytes, archive->segments,
+				archive->syncs, archive->dropped,
+				archive->failed ? ", stopped" : "");
+	}
+	printf("Arena: %u of %u blocks of %zu bytes taken%s%s, %lu frame "
+			"buffer allocations in the heap\n", frameArena.taken,
+			frameArena.blocks, frameArena.blockBytes,
+			frameArena.locked ? ", locked" : "",
+			frameArena.hugePages ? ", huge pages" : "",
+			atomic_load_explicit(&frameArena.heapAllocs,
+					memory_order_relaxed));
+#ifdef ARENA_DEBUG
+	printf("Heap allocations outside libjpeg: %lu\n", heapAllocations());
+#endif
+}
+
+// Capture frames from the frame source. The loop takes whichever frame is
+// ready and hands it to the encode pool, whose workers give the buffer back
+// to the source once it is encoded and publish frames to the ring in capture
+// order. Runs forever unless a frame count was given.
+void getFrames(struct camOptions* opts)
+{
+	struct frameSource*		src = openFrameSource(&opts->src);
+	struct encodePool*		pool;
+	struct frame			frm;
+	struct runStats			run;
+	struct linkStats		link;
+	struct ringWriter		writer;
+	struct frameRing		ring;
+	struct frameArchive		archive;
+	struct timespec			start;
+	unsigned int			submitted = 0;
+	prepareArena(opts, src->det);
+	initFrameRing(&ring, ringBudget(opts),
+			strcmp(opts->serialPort, NO_SERIAL) != 0);
+	CLEAR(run);
+	CLEAR(link);
+	writer.ring = &ring;
+	writer.run = &run;
+	writer.targetBytes = opts->enc.targetBytes;
+	writer.abbreviated = opts->enc.abbreviated;
+	writer.tablesId = 0;
+	writer.det = src->det;
+	writer.mode = opts->enc.mode;
+	writer.tablesImg = NULL;
+	writer.tablesCapacity = 0;
+	writer.tablesSize = 0;
+	writer.tablesQuality = 0;
+	writer.archive = NULL;
+	initEncoder(&writer.tables);
+	if(opts->archiveDir != NULL)
+	{
+		startArchive(&archive, opts->archiveDir, opts->segmentBytes);
+		writer.archive = &archive;
+	}
+	if(strcmp(opts->serialPort, NO_SERIAL) != 0)
+	{
+		createThread(&ring, opts, &link); // serial writer
+	}
+	pool = createEncodePool(opts->workers, src, &opts->enc, publishImage,
+			&writer);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while(opts->frameCount == 0 || submitted < opts->frameCount)
+	{
+		if(!src->next(src, &frm)) continue;
+		submitFrame(pool, &frm);
+		submitted++;
+		printf("|%u| queued: %u dropped: %u\n", src->stats.frames,
+				src->stats.queued, src->stats.dropped);
+	}
+	drainEncodePool(pool);
+	if(writer.archive != NULL) stopArchive(writer.archive);
+	printSummary(src, &run, &link, &ring, writer.archive, &opts->enc,
+			elapsedMs(&start));
+	destroyEncodePool(pool);
+	destroyEncoder(&writer.tables);
+	closeFrameSource(src);
+}
+
+// Parse a byte count with an optional k, M or G suffix (powers of 1024)
+size_t parseBytes(const char* arg)
+{
+	char*	end;
+	double	bytes = strtod(arg, &end);
+	if(*end == 'k' || *end == 'K') bytes *= 1024;
+	else if(*end == 'm' || *end == 'M') bytes *= 1024 * 1024;
+	else if(*end == 'g' || *end == 'G') bytes *= 1024.0 * 1024 * 1024;
+	return bytes > 0 ? (size_t)bytes : 0;
+}
+
+void usage(const char* name)
+{
+	char errorMsg[512];
+	sprintf(errorMsg, "usage: %s [-n captureBuffers] [-s v4l2|replay|pattern] "
+			"[-r WIDTHxHEIGHT] [-F yuyv|mjpeg] [-e 422|444|direct|turbo] "
+			"[-m] [-c frameCount] [-p serialPort|none] [-b benchFrames] "
+			"[-t workers] [-i stripes] "
+			"[-T targetBytes] [-a] [-P] [-A] [-D downlinkQuality] "
+			"[-R keyInterval[:threshold]] [-E fast|balanced|small|robust] "
+			"[-C deadlineMs] [-M frameBytes] [-L] [-H] [-B ringBytes] "
+			"[-o archiveDir] [-S segmentBytes] "
+			"cameraDevice JpegQuality fps bufferSize", name);
+	exitWithError(errorMsg);
+}
+
+// Parse the command line into the capture options. The positional arguments
+// are unchanged; optional settings are given as flags before them.
+void parseOptions(int argc, char *argv[], struct camOptions* opts)
+{
+	int			opt;
+	CLEAR(*opts);
+	opts->src.type = SRC_V4L2;
+	opts->src.nbuffers = CAPTURE_BUFFERS;
+	opts->serialPort = MODEMDEVICE;
+	opts->enc.mode = ENC_RAW422;
+	opts->workers = defaultWorkers();
+	opts->enc.stripes = 1;
+	opts->segmentBytes = ARCHIVE_SEGMENT_BYTES;
+	while((opt = getopt(argc, argv,
+			"n:s:r:F:e:mc:p:b:t:i:T:aPAD:R:E:C:M:LHB:o:S:")) != -1)
+	{
+		switch(opt)
 		{
-			usleep(fps); // maintain steady frame rate
-			pthread_mutex_lock(mutex); // lock pointers
-			createImage(buf, bufs, i, cNode, fd, det, cqual);
-			cNode = cNode->next; // work with the next node in the list
-			printf("|%d|\n", ctr++);
-			pthread_mutex_unlock(mutex); // release locks
-			queueBuffer(i, buf, fd); // queue up a new buffer
+			case 'n': // number of buffers in the capture ring
+				opts->src.nbuffers = atoi(optarg);
+				if(opts->src.nbuffers < MIN_CAPTURE_BUFFERS ||
+						opts->src.nbuffers > MAX_CAPTURE_BUFFERS)
+				{
+					exitWithError("Set captureBuffers between 2 and 8.");
+				}
+				break;
+			case 's': // where frames come from
+				if(strcmp(optarg, "v4l2") == 0) opts->src.type = SRC_V4L2;
+				else if(strcmp(optarg, "replay") == 0)
+				{
+					opts->src.type = SRC_REPLAY;
+				}
+				else if(strcmp(optarg, "pattern") == 0)
+				{
+					opts->src.type = SRC_PATTERN;
+				}
+				else usage(argv[0]);
+				break;
+			case 'r': // frame geometry
+				if(sscanf(optarg, "%ux%u", &opts->src.width,
+						&opts->src.height) != 2)
+				{
+					usage(argv[0]);
+				}
+				break;
+			case 'F': // pixel format to capture in
+				if(strcmp(optarg, "yuyv") == 0)
+				{
+					opts->src.pixelformat = V4L2_PIX_FMT_YUYV;
+				}
+				else if(strcmp(optarg, "mjpeg") == 0)
+				{
+					opts->src.pixelformat = V4L2_PIX_FMT_MJPEG;
+				}
+				else usage(argv[0]);
+				break;
+			case 'e': // how YUYV frames are encoded
+				if(strcmp(optarg, "422") == 0) opts->enc.mode = ENC_RAW422;
+				else if(strcmp(optarg, "444") == 0)
+				{
+					opts->enc.mode = ENC_YUV444;
+				}
+				else if(strcmp(optarg, "direct") == 0)
+				{
+					opts->enc.mode = ENC_DIRECT422;
+				}
+				else if(strcmp(optarg, "turbo") == 0)
+				{
+#ifndef HAVE_TURBOJPEG
+					exitWithError("Built without TurboJPEG, make with "
+							"TURBOJPEG=1.");
+#endif
+					opts->enc.mode = ENC_TURBO422;
+				}
+				else usage(argv[0]);
+				break;
+			case 'm': // replay as fast as frames can be consumed
+				opts->src.maxSpeed = TRUE;
+				break;
+			case 'c': // stop after this many frames
+				opts->frameCount = atoi(optarg);
+				break;
+			case 'p': // serial port to downlink on
+				opts->serialPort = optarg;
+				break;
+			case 't': // number of encode workers
+				opts->workers = atoi(optarg);
+				if(opts->workers < 1 || opts->workers > MAX_WORKERS)
+				{
+					exitWithError("Set workers between 1 and 16.");
+				}
+				break;
+			case 'i': // split each frame into stripes encoded in parallel
+				opts->enc.stripes = atoi(optarg);
+				if(opts->enc.stripes < 1 || opts->enc.stripes > MAX_STRIPES)
+				{
+					exitWithError("Set stripes between 1 and 8.");
+				}
+				break;
+			case 'T': // fit each frame in this many bytes
+				opts->enc.targetBytes = atol(optarg);
+				break;
+			case 'a': // send tables once rather than with every frame
+				opts->enc.abbreviated = TRUE;
+				break;
+			case 'P': // progressive frames for partial downlinks
+				opts->enc.progressive = TRUE;
+				break;
+			case 'A': // arithmetic coding, smaller than Huffman
+#ifndef C_ARITH_CODING_SUPPORTED
+				exitWithError("libjpeg was built without arithmetic coding.");
+#endif
+				opts->enc.arithmetic = TRUE;
+				break;
+			case 'D': // downlink at a lower quality than frames are kept at
+				opts->downlinkQuality = atoi(optarg);
+				if(opts->downlinkQuality < 1 || opts->downlinkQuality > 100)
+				{
+					exitWithError("Set downlinkQuality between 1 and 100.");
+				}
+				break;
+			case 'R': // send only the blocks that changed between key frames
+				opts->enc.threshold = REPLEN_THRESHOLD;
+				if(sscanf(optarg, "%u:%u", &opts->enc.keyInterval,
+						&opts->enc.threshold) < 1 || opts->enc.keyInterval < 1)
+				{
+					exitWithError("Set keyInterval to 1 or more.");
+				}
+				break;
+			case 'E': // libjpeg settings past quality
+				opts->profile = findProfile(optarg);
+				if(opts->profile == NULL) usage(argv[0]);
+				break;
+			case 'C': // pick the profile by timing each against a deadline
+				opts->calibrateMs = atof(optarg);
+				if(opts->calibrateMs <= 0)
+				{
+					exitWithError("Set the calibration deadline above 0 ms.");
+				}
+				break;
+			case 'M': // arena storage for each frame buffer
+				opts->frameBytes = atol(optarg);
+				if(opts->frameBytes < AVG_IMG_SIZE)
+				{
+					exitWithError("Set frameBytes to 20000 or more.");
+				}
+				break;
+			case 'L': // keep the arena in RAM
+				opts->lockArena = TRUE;
+				break;
+			case 'H': // map the arena with huge pages
+				opts->hugePages = TRUE;
+				break;
+			case 'B': // bytes of frames to hold, in place of bufferSize
+				opts->ringBytes = parseBytes(optarg);
+				if(opts->ringBytes < AVG_IMG_SIZE ||
+						opts->ringBytes > UINT32_MAX)
+				{
+					exitWithError("Set ringBytes between 20000 and 4G.");
+				}
+				break;
+			case 'o': // keep every frame in segment files in this directory
+				opts->archiveDir = optarg;
+				break;
+			case 'S': // size of each archive segment file
+				opts->segmentBytes = (parseBytes(optarg) + ARCHIVE_PAGE - 1) &
+						~(size_t)(ARCHIVE_PAGE - 1); // whole pages
+				if(opts->segmentBytes < ARCHIVE_MIN_SEGMENT ||
+						opts->segmentBytes > UINT32_MAX)
+				{
+					exitWithError("Set segmentBytes between 1M and 4G.");
+				}
+				break;
+			case 'b': // benchmark the encoder on this many frames and exit
+				opts->benchFrames = atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
 		}
-    }
-    for (i = 0; i < reqbuf.count; ++i) // unmap memory
-    {
-    	munmap(bufs[i].start, bufs[i].length);
-    }
-    free(mutex);
-    free(cNode);
-    free(bufs);
+	}
+	if(opts->enc.progressive && opts->enc.stripes > 1)
+	{
+		// stripes are stitched as restart intervals of a single scan
+		exitWithError("Progressive frames cannot be encoded in stripes.");
+	}
+	if(opts->downlinkQuality > 0 && opts->enc.abbreviated)
+	{
+		// requantising needs the tables in the frame
+		exitWithError("Downlink quality needs frames with their tables.");
+	}
+	if(opts->enc.mode == ENC_DIRECT422 &&
+			(opts->enc.progressive || opts->enc.arithmetic))
+	{
+		// the direct encoder writes baseline Huffman coded frames only
+		exitWithError("Direct encoding cannot be progressive or arithmetic.");
+	}
+	if(opts->enc.mode == ENC_TURBO422 && (opts->enc.abbreviated ||
+			opts->enc.stripes > 1 || opts->enc.progressive ||
+			opts->enc.arithmetic))
+	{
+		// TurboJPEG sets up every frame itself, tables and scans included
+		exitWithError("TurboJPEG frames are whole baseline Huffman JPEGs.");
+	}
+	if((opts->profile != NULL || opts->calibrateMs > 0) &&
+			opts->enc.mode != ENC_RAW422 && opts->enc.mode != ENC_YUV444)
+	{
+		// profiles are settings of libjpeg's own encoder
+		exitWithError("Encoder profiles need -e 422 or 444.");
+	}
+	if(opts->profile != NULL && !profileFits(opts->profile, &opts->enc))
+	{
+		exitWithError("Stripes need a profile without optimised tables or "
+				"restarts.");
+	}
+	if(opts->enc.keyInterval > 0 &&
+			opts->src.pixelformat == V4L2_PIX_FMT_MJPEG)
+	{
+		// blocks are compared in the YUYV frame
+		exitWithError("Conditional replenishment needs YUYV frames.");
+	}
+	if((opts->calibrateMs > 0 || opts->benchFrames > 0) &&
+			opts->src.pixelformat == V4L2_PIX_FMT_MJPEG)
+	{
+		// the encoders are timed on raw frames
+		exitWithError("Encoder benchmarks and -C need YUYV frames.");
+	}
+	if(opts->enc.keyInterval > 0)
+	{
+		// rather than MJPEG, which the camera is otherwise asked for first
+		opts->src.pixelformat = V4L2_PIX_FMT_YUYV;
+	}
+	if(argc - optind != 4) usage(argv[0]); // Check correct number of args
+	opts->src.location = argv[optind];	// camera location
+	// Image quality
+	opts->enc.quality = atoi(argv[optind + 1]);
+	if(opts->enc.quality == 0 || opts->enc.quality > 100)
+	{
+		exitWithError("Set JpegQuality between 1 and 100 inclusive.");
+	}
+	// frame rate, timed by the sensor or paced by replay and pattern sources
+	if(atoi(argv[optind + 2]) > 0) opts->src.fps = atoi(argv[optind + 2]);
+	// frames held for downlink, unless -B gives a byte budget
+	if(atoi(argv[optind + 3]) > 0) opts->bufferSize = atoi(argv[optind + 3]);
 }
 
 int main(int argc, char *argv[]) {
-	int 		*fd = (int*)malloc(sizeof(int)), qual = 0, fps = 0, bufSize = 0;
-	char 		*camera;
-	if(argc != 5) 						// Check correct number of args
+	struct camOptions	opts;
+	parseOptions(argc, argv, &opts);
+	printf("Camera Interface  Copyright (C) 2012  Jacob Appleton\n\n");
+	printf("This program comes with ABSOLUTELY NO WARRANTY;\n");
+	printf("This is free software, and you are welcome to redistribute it \n");
+	printf("under certain conditions.\n");
+	printf("Visit http://www.gnu.org/licenses/gpl.html for more details.\n\n");
+	selectConvertKernel();
+	selectDctKernel();
+	if(opts.calibrateMs > 0)
 	{
-		char errorMsg[256];
-		sprintf(errorMsg, "usage: %s cameraDevice JpegQuality fps bufferSize",
-				argv[0]);
-		exitWithError(errorMsg);
+		calibrateProfile(&opts.src, &opts.enc, opts.calibrateMs);
 	}
-	else
+	else if(opts.profile != NULL) encodeProfile = opts.profile;
+	printf("Encoder profile: %s\n", encodeProfile->name);
+	if(opts.benchFrames > 0)
 	{
-		camera = argv[1];	// camera location
-		// Image quality
-		if(atoi(argv[2]) > 0 && atoi(argv[2]) <= 100) qual = atoi(argv[2]);
-		else exitWithError("Set JpegQuality between 1 and 100 inclusive.");
-		// frame delay
-		if(atoi(argv[3]) > 0) fps = atoi(argv[3]);
-		// list size
-		if(atoi(argv[4]) > 0) bufSize = atoi(argv[4]);
+		benchmarkEncoder(&opts.src, &opts.enc, opts.benchFrames);
+		return 0;
 	}
-	printf("Camera Interface  Copyright (C) 2012  Jacob Appleton\n\n");
-	printf("This program comes with ABSOLUTELY NO WARRANTY;\n");
-    printf("This is free software, and you are welcome to redistribute it \n");
-    printf("under certain conditions.\n");
-    printf("Visit http://www.gnu.org/licenses/gpl.html for more details.\n\n");
-	*fd = -1;
-	openDevice(camera, fd);
-	getCapabilities(fd);
-	int* imageCaptureType = (int*)malloc(sizeof(int));
-	*imageCaptureType = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	getFrames(1, 1, fd, imageCaptureType, qual, fps, bufSize);
-    // Turn the stream off - this will turn off the camera's LED light
-    ioctl(*fd, VIDIOC_STREAMOFF, imageCaptureType);
-	closeDevice(fd);
-	free(fd);
-	free(imageCaptureType);
-	pthread_exit(NULL);
+	getFrames(&opts);
 	return 0;
 }
-
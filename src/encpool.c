@@ -0,0 +1,332 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Pool of frame encoding threads with ordered hand-off.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#include "../headers/encpool.h"
+
+// One worker per online core unless told otherwise
+unsigned int defaultWorkers()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if(n < 1) return 1;
+	return n > MAX_WORKERS ? MAX_WORKERS : (unsigned int)n;
+}
+
+// Wait for a queued frame, FALSE once the pool is stopping and drained
+bool takeJob(struct encodePool* pool, struct encodeJob* job)
+{
+	pthread_mutex_lock(&pool->lock);
+	while(pool->queued == 0 && !pool->stopping)
+	{
+		pthread_cond_wait(&pool->jobReady, &pool->lock);
+	}
+	if(pool->queued == 0)
+	{
+		pthread_mutex_unlock(&pool->lock);
+		return FALSE;
+	}
+	job->frm = pool->queue[pool->queueHead];
+	job->order = pool->nextOrder - pool->queued;
+	pool->queueHead = (pool->queueHead + 1) % pool->queueSize;
+	pool->queued--;
+	pthread_cond_signal(&pool->slotFree);
+	pthread_mutex_unlock(&pool->lock);
+	return TRUE;
+}
+
+// Wait until every earlier frame has been published, publish this one and
+// let the next in line go
+void publishInOrder(struct encodePool* pool, struct encodeJob* job)
+{
+	pthread_mutex_lock(&pool->lock);
+	while(pool->nextPublish != job->order)
+	{
+		pthread_cond_wait(&pool->turn, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	pool->publish(pool->ctx, job); // only this worker can be publishing
+	pthread_mutex_lock(&pool->lock);
+	pool->nextPublish++;
+	pthread_cond_broadcast(&pool->turn);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Encode the worker's current picture at a quality, in stripes if the pool
+// is set up for them
+size_t encodeAtQuality(void* ctx, unsigned int quality, byte** buf,
+		size_t* capacity)
+{
+	struct encodeWorkerState*	w = (struct encodeWorkerState*)ctx;
+	struct encodePool*			pool = w->pool;
+	if(pool->cfg.stripes > 1)
+	{
+		w->striped.sequence = w->frm->sequence;
+		w->striped.flags = w->pic.flags;
+		w->striped.map = w->pic.map;
+		w->striped.mapLength = w->pic.mapLength;
+		return encodeStriped(&w->striped, w->pic.yuyv, w->pic.det, quality,
+				w->pic.mode, buf, capacity);
+	}
+	configureEncoder(&w->enc, w->pic.det, quality, w->pic.mode);
+	w->enc.sequence = w->frm->sequence;
+	w->enc.flags = w->pic.flags;
+	w->enc.map = w->pic.map;
+	w->enc.mapLength = w->pic.mapLength;
+	return encodeFrame(&w->enc, w->pic.yuyv, buf, capacity);
+}
+
+// Choose what to encode for a YUYV frame: the frame itself, or under
+// conditional replenishment a key frame or the mosaic of its changed MCUs
+void choosePicture(struct encodeWorkerState* w, struct encodeJob* job)
+{
+	struct encodePool* pool = w->pool;
+	w->frm = &job->frm;
+	if(pool->cfg.keyInterval > 0)
+	{
+		replenish(&w->replen, job->frm.data, pool->src->det,
+				job->frm.sequence, &w->pic);
+		job->frameBlocks = w->replen.cols * w->replen.rows;
+	}
+	else
+	{
+		w->pic.yuyv = job->frm.data;
+		w->pic.det = pool->src->det;
+		w->pic.mode = pool->cfg.mode;
+		w->pic.flags = 0;
+		w->pic.map = NULL;
+		w->pic.mapLength = 0;
+		w->pic.blocks = 0;
+		job->frameBlocks = 0;
+	}
+	job->flags = w->pic.flags;
+	job->blocks = w->pic.blocks;
+}
+
+// Encode frames as they arrive. Each worker keeps its own libjpeg encoder
+// and output buffer, hands the capture buffer back to the source as soon as
+// the frame is encoded and then waits its turn to publish, so frames leave
+// the pool in the order they were captured however long each one took.
+// MJPEG frames sent as they are keep the capture buffer until published,
+// so they are copied once, straight into the ring.
+// With stripes set, each worker also splits its frames across helper
+// threads to cut the time any one frame takes, and with a byte budget it
+// keeps its own rate control model. Conditional replenishment compares each
+// frame with the last, so it needs a pool of one worker.
+void* encodeWorker(void* args)
+{
+	struct encodePool*			pool = (struct encodePool*)args;
+	struct encodeWorkerState	w;
+	struct encodeJob			job;
+	struct timespec				start;
+	bool						held;	// publishing from the capture buffer
+	CLEAR(job);
+	w.pool = pool;
+	initEncoder(&w.enc);
+	w.enc.abbreviated = pool->cfg.abbreviated;
+	w.enc.progressive = pool->cfg.progressive;
+	w.enc.arithmetic = pool->cfg.arithmetic;
+	if(pool->cfg.stripes > 1)
+	{
+		initStripeEncoder(&w.striped, pool->cfg.stripes);
+		w.striped.abbreviated = pool->cfg.abbreviated;
+		w.striped.arithmetic = pool->cfg.arithmetic;
+	}
+	initTranscoder(&w.transcoder);
+	initRateControl(&w.rate, pool->cfg.targetBytes, pool->cfg.quality);
+	initReplenisher(&w.replen, pool->cfg.keyInterval, pool->cfg.threshold,
+			pool->cfg.mode);
+	while(takeJob(pool, &job))
+	{
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		held = FALSE;
+		if(pool->src->pixelformat == V4L2_PIX_FMT_MJPEG) // already compressed
+		{
+			job.size = 0;
+			if(pool->cfg.arithmetic)
+			{
+				job.size = transcodeJpeg(&w.transcoder, job.frm.data,
+						job.frm.bytesused, 0, TRUE, job.frm.sequence, &job.img,
+						&job.capacity);
+			}
+			if(job.size == 0) // sent as the camera made it
+			{
+				job.data = job.frm.data;
+				job.size = job.frm.bytesused;
+				held = TRUE;
+			}
+			job.quality = 0;
+			job.passes = 0;
+			job.flags = 0;
+			job.blocks = 0;
+			job.frameBlocks = 0;
+		}
+		else if(pool->cfg.targetBytes > 0)
+		{
+			choosePicture(&w, &job);
+			job.passes = w.rate.passes;
+			job.size = encodeToBudget(&w.rate, encodeAtQuality, &w, &job.img,
+					&job.capacity, &job.quality);
+			job.passes = w.rate.passes - job.passes;
+		}
+		else
+		{
+			choosePicture(&w, &job);
+			job.size = encodeAtQuality(&w, pool->cfg.quality, &job.img,
+					&job.capacity);
+			job.quality = pool->cfg.quality;
+			job.passes = 1;
+		}
+		job.encodeMs = elapsedMs(&start);
+		job.encodedUs = monotonicUs();
+		if(!held) // give the buffer straight back
+		{
+			job.data = job.img;
+			pool->src->release(pool->src, &job.frm);
+		}
+		publishInOrder(pool, &job);
+		if(held) pool->src->release(pool->src, &job.frm);
+	}
+	destroyEncoder(&w.enc);
+	if(pool->cfg.stripes > 1) destroyStripeEncoder(&w.striped);
+	freeRateControl(&w.rate);
+	destroyTranscoder(&w.transcoder);
+	freeReplenisher(&w.replen);
+	releaseImage(job.img);
+	pthread_exit(NULL);
+}
+
+// Start a pool of encoding threads for frames from a source. The queue holds
+// as many frames as the source has buffers, which bounds how far capture can
+// run ahead of encoding.
+struct encodePool* createEncodePool(unsigned int nworkers,
+		struct frameSource* src, const struct encodeSettings* cfg,
+		publishFn publish, void* ctx)
+{
+	unsigned int		i;
+	struct encodePool*	pool =
+			(struct encodePool*)calloc(1, sizeof(struct encodePool));
+	if(pool == NULL) exitWithError("Could not allocate encode pool.");
+	if(nworkers < 1) nworkers = 1;
+	if(nworkers > MAX_WORKERS) nworkers = MAX_WORKERS;
+	if(cfg->keyInterval > 0 && nworkers > 1)
+	{
+		printf("Conditional replenishment needs frames in order, "
+				"using 1 worker\n");
+		nworkers = 1;
+	}
+	pool->nworkers = nworkers;
+	pool->src = src;
+	pool->cfg = *cfg;
+	pool->publish = publish;
+	pool->ctx = ctx;
+	pool->queueSize = src->nbuffers > 0 ? src->nbuffers : 1;
+	pool->queue = (struct frame*)calloc(pool->queueSize, sizeof(struct frame));
+	if(pool->queue == NULL) exitWithError("Could not allocate encode queue.");
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->jobReady, NULL);
+	pthread_cond_init(&pool->slotFree, NULL);
+	pthread_cond_init(&pool->turn, NULL);
+	for(i = 0; i < nworkers; i++)
+	{
+		if(pthread_create(&pool->threads[i], NULL, encodeWorker, pool) != 0)
+		{
+			exitWithError("Could not start encode worker.");
+		}
+	}
+	if(cfg->stripes > 1)
+	{
+		printf("Encoding with %u workers, %u stripes each\n", nworkers,
+				cfg->stripes);
+	}
+	else printf("Encoding with %u workers\n", nworkers);
+	if(cfg->targetBytes > 0)
+	{
+		printf("Rate control: %zu bytes per frame\n", cfg->targetBytes);
+	}
+	if(cfg->keyInterval > 0)
+	{
+		printf("Conditional replenishment: key frame every %u, threshold "
+				"%u\n", cfg->keyInterval, cfg->threshold);
+	}
+	return pool;
+}
+
+// Queue a captured frame for encoding, waiting if every slot is taken
+void submitFrame(struct encodePool* pool, const struct frame* frm)
+{
+	pthread_mutex_lock(&pool->lock);
+	while(pool->queued == pool->queueSize)
+	{
+		pthread_cond_wait(&pool->slotFree, &pool->lock);
+	}
+	pool->queue[(pool->queueHead + pool->queued) % pool->queueSize] = *frm;
+	pool->queued++;
+	pool->nextOrder++;
+	pthread_cond_signal(&pool->jobReady);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Wait until every submitted frame has been published
+void drainEncodePool(struct encodePool* pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while(pool->nextPublish != pool->nextOrder)
+	{
+		pthread_cond_wait(&pool->turn, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Finish the queued frames, stop the workers and free the pool
+void destroyEncodePool(struct encodePool* pool)
+{
+	unsigned int i;
+	pthread_mutex_lock(&pool->lock);
+	pool->stopping = TRUE;
+	pthread_cond_broadcast(&pool->jobReady);
+	pthread_mutex_unlock(&pool->lock);
+	for(i = 0; i < pool->nworkers; i++) pthread_join(pool->threads[i], NULL);
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->jobReady);
+	pthread_cond_destroy(&pool->slotFree);
+	pthread_cond_destroy(&pool->turn);
+	free(pool->queue);
+	free(pool);
+}
@@ -0,0 +1,521 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Forward DCT and quantisation kernels for the direct YUYV encoder.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+
+#include <math.h>
+#include "../headers/fdct.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define HAVE_X86_KERNELS
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#include <arm_neon.h>
+	#define HAVE_NEON_KERNEL
+#endif
+
+// libjpeg's ifast multipliers in 8 bit fixed point. A product is taken as
+// the high half of (x << 2) * (c << 6), which is what a 16 bit SIMD
+// multiply-high gives, so every kernel rounds the same way.
+#define FIX_0_382683433	98
+#define FIX_0_541196100	139
+#define FIX_0_707106781	181
+#define FIX_1_306562965	334
+#define PRE_SHIFT		2
+#define CONST_SHIFT		6
+
+struct dctKernel dctKernel = {"scalar", fdctMcuScalar, quantiseScalar};
+
+// Scale of coefficient k of an AAN transform against the true DCT:
+// 1 for DC, cos(k pi / 16) * sqrt(2) otherwise
+double aanScale(unsigned int k)
+{
+	return k == 0 ? 1.0 : cos(k * M_PI / 16) * M_SQRT2;
+}
+
+int16_t mulFix(int16_t x, int16_t c)
+{
+	return (int16_t)(((int32_t)(int16_t)(x << PRE_SHIFT) *
+			(c << CONST_SHIFT)) >> 16);
+}
+
+// One 8 point AAN transform of samples step apart, in place
+void fdct8Scalar(int16_t* d, int step)
+{
+	int16_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	int16_t tmp10, tmp11, tmp12, tmp13, z1, z2, z3, z4, z5, z11, z13;
+	tmp0 = d[0] + d[7 * step];
+	tmp7 = d[0] - d[7 * step];
+	tmp1 = d[step] + d[6 * step];
+	tmp6 = d[step] - d[6 * step];
+	tmp2 = d[2 * step] + d[5 * step];
+	tmp5 = d[2 * step] - d[5 * step];
+	tmp3 = d[3 * step] + d[4 * step];
+	tmp4 = d[3 * step] - d[4 * step];
+	tmp10 = tmp0 + tmp3; // even part
+	tmp13 = tmp0 - tmp3;
+	tmp11 = tmp1 + tmp2;
+	tmp12 = tmp1 - tmp2;
+	d[0] = tmp10 + tmp11;
+	d[4 * step] = tmp10 - tmp11;
+	z1 = mulFix(tmp12 + tmp13, FIX_0_707106781);
+	d[2 * step] = tmp13 + z1;
+	d[6 * step] = tmp13 - z1;
+	tmp10 = tmp4 + tmp5; // odd part
+	tmp11 = tmp5 + tmp6;
+	tmp12 = tmp6 + tmp7;
+	z5 = mulFix(tmp10 - tmp12, FIX_0_382683433);
+	z2 = mulFix(tmp10, FIX_0_541196100) + z5;
+	z4 = mulFix(tmp12, FIX_1_306562965) + z5;
+	z3 = mulFix(tmp11, FIX_0_707106781);
+	z11 = tmp7 + z3;
+	z13 = tmp7 - z3;
+	d[5 * step] = z13 + z2;
+	d[3 * step] = z13 - z2;
+	d[step] = z11 + z4;
+	d[7 * step] = z11 - z4;
+}
+
+// Reference transform, one sample at a time
+void fdctMcuScalar(const byte* yuyv, size_t stride, int16_t* coefs)
+{
+	int16_t*	y0 = coefs;
+	int16_t*	y1 = coefs + 64;
+	int16_t*	cb = coefs + 128;
+	int16_t*	cr = coefs + 192;
+	int			r, i, b;
+	for(r = 0; r < MCU_ROWS; r++, yuyv += stride)
+	{
+		for(i = 0; i < 4; i++)
+		{
+			y0[r * 8 + 2 * i] = yuyv[4 * i] - 128;
+			y0[r * 8 + 2 * i + 1] = yuyv[4 * i + 2] - 128;
+			y1[r * 8 + 2 * i] = yuyv[16 + 4 * i] - 128;
+			y1[r * 8 + 2 * i + 1] = yuyv[16 + 4 * i + 2] - 128;
+		}
+		for(i = 0; i < 8; i++)
+		{
+			cb[r * 8 + i] = yuyv[4 * i + 1] - 128;
+			cr[r * 8 + i] = yuyv[4 * i + 3] - 128;
+		}
+	}
+	for(b = 0; b < MCU_BLOCKS; b++, coefs += 64)
+	{
+		for(i = 0; i < 8; i++) fdct8Scalar(coefs + i * 8, 1); // rows
+		for(i = 0; i < 8; i++) fdct8Scalar(coefs + i, 8); // columns
+	}
+}
+
+// Reference quantiser. lrintf() rounds as the SIMD conversions do, in the
+// default round to nearest even mode.
+uint64_t quantiseScalar(const int16_t* coefs, const float* recip, int16_t* q)
+{
+	uint64_t		nonzero = 0;
+	unsigned int	n;
+	for(n = 0; n < 64; n++)
+	{
+		q[n] = (int16_t)lrintf(coefs[n] * recip[n]);
+		nonzero |= (uint64_t)(q[n] != 0) << n;
+	}
+	return nonzero;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Eight 8 point transforms at once, one per lane, across the eight vectors
+__attribute__((target("sse2")))
+static inline void fdct8SSE2(__m128i* d)
+{
+	const __m128i	c0382 = _mm_set1_epi16(FIX_0_382683433 << CONST_SHIFT);
+	const __m128i	c0541 = _mm_set1_epi16(FIX_0_541196100 << CONST_SHIFT);
+	const __m128i	c0707 = _mm_set1_epi16(FIX_0_707106781 << CONST_SHIFT);
+	const __m128i	c1306 = _mm_set1_epi16(FIX_1_306562965 << CONST_SHIFT);
+	__m128i			tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	__m128i			tmp10, tmp11, tmp12, tmp13, z1, z2, z3, z4, z5, z11, z13;
+	tmp0 = _mm_add_epi16(d[0], d[7]);
+	tmp7 = _mm_sub_epi16(d[0], d[7]);
+	tmp1 = _mm_add_epi16(d[1], d[6]);
+	tmp6 = _mm_sub_epi16(d[1], d[6]);
+	tmp2 = _mm_add_epi16(d[2], d[5]);
+	tmp5 = _mm_sub_epi16(d[2], d[5]);
+	tmp3 = _mm_add_epi16(d[3], d[4]);
+	tmp4 = _mm_sub_epi16(d[3], d[4]);
+	tmp10 = _mm_add_epi16(tmp0, tmp3);
+	tmp13 = _mm_sub_epi16(tmp0, tmp3);
+	tmp11 = _mm_add_epi16(tmp1, tmp2);
+	tmp12 = _mm_sub_epi16(tmp1, tmp2);
+	d[0] = _mm_add_epi16(tmp10, tmp11);
+	d[4] = _mm_sub_epi16(tmp10, tmp11);
+	z1 = _mm_mulhi_epi16(_mm_slli_epi16(_mm_add_epi16(tmp12, tmp13),
+			PRE_SHIFT), c0707);
+	d[2] = _mm_add_epi16(tmp13, z1);
+	d[6] = _mm_sub_epi16(tmp13, z1);
+	tmp10 = _mm_add_epi16(tmp4, tmp5);
+	tmp11 = _mm_add_epi16(tmp5, tmp6);
+	tmp12 = _mm_add_epi16(tmp6, tmp7);
+	z5 = _mm_mulhi_epi16(_mm_slli_epi16(_mm_sub_epi16(tmp10, tmp12),
+			PRE_SHIFT), c0382);
+	z2 = _mm_add_epi16(_mm_mulhi_epi16(_mm_slli_epi16(tmp10, PRE_SHIFT),
+			c0541), z5);
+	z4 = _mm_add_epi16(_mm_mulhi_epi16(_mm_slli_epi16(tmp12, PRE_SHIFT),
+			c1306), z5);
+	z3 = _mm_mulhi_epi16(_mm_slli_epi16(tmp11, PRE_SHIFT), c0707);
+	z11 = _mm_add_epi16(tmp7, z3);
+	z13 = _mm_sub_epi16(tmp7, z3);
+	d[5] = _mm_add_epi16(z13, z2);
+	d[3] = _mm_sub_epi16(z13, z2);
+	d[1] = _mm_add_epi16(z11, z4);
+	d[7] = _mm_sub_epi16(z11, z4);
+}
+
+// Transpose an 8x8 block of 16 bit samples held as eight row vectors
+__attribute__((target("sse2")))
+static inline void transpose8SSE2(__m128i* r)
+{
+	__m128i a0, a1, a2, a3, a4, a5, a6, a7, b0, b1, b2, b3, b4, b5, b6, b7;
+	a0 = _mm_unpacklo_epi16(r[0], r[1]);
+	a1 = _mm_unpackhi_epi16(r[0], r[1]);
+	a2 = _mm_unpacklo_epi16(r[2], r[3]);
+	a3 = _mm_unpackhi_epi16(r[2], r[3]);
+	a4 = _mm_unpacklo_epi16(r[4], r[5]);
+	a5 = _mm_unpackhi_epi16(r[4], r[5]);
+	a6 = _mm_unpacklo_epi16(r[6], r[7]);
+	a7 = _mm_unpackhi_epi16(r[6], r[7]);
+	b0 = _mm_unpacklo_epi32(a0, a2);
+	b1 = _mm_unpackhi_epi32(a0, a2);
+	b2 = _mm_unpacklo_epi32(a1, a3);
+	b3 = _mm_unpackhi_epi32(a1, a3);
+	b4 = _mm_unpacklo_epi32(a4, a6);
+	b5 = _mm_unpackhi_epi32(a4, a6);
+	b6 = _mm_unpacklo_epi32(a5, a7);
+	b7 = _mm_unpackhi_epi32(a5, a7);
+	r[0] = _mm_unpacklo_epi64(b0, b4);
+	r[1] = _mm_unpackhi_epi64(b0, b4);
+	r[2] = _mm_unpacklo_epi64(b1, b5);
+	r[3] = _mm_unpackhi_epi64(b1, b5);
+	r[4] = _mm_unpacklo_epi64(b2, b6);
+	r[5] = _mm_unpackhi_epi64(b2, b6);
+	r[6] = _mm_unpacklo_epi64(b3, b7);
+	r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+// Each 32 byte row splits into luma for both blocks by masking the low
+// byte of each 16 bit lane, and chroma from the high bytes, U and V then
+// parted as the low and high halves of 32 bit lanes. Each block is
+// transposed so the row transform runs across vectors, transformed,
+// transposed back and transformed down its columns.
+__attribute__((target("sse2")))
+void fdctMcuSSE2(const byte* yuyv, size_t stride, int16_t* coefs)
+{
+	const __m128i	lowByte = _mm_set1_epi16(0x00FF);
+	const __m128i	lowHalf = _mm_set1_epi32(0x0000FFFF);
+	const __m128i	centre = _mm_set1_epi16(128);
+	__m128i			blk[MCU_BLOCKS][8], lo, hi, c0, c1;
+	int				r, b;
+	for(r = 0; r < MCU_ROWS; r++, yuyv += stride)
+	{
+		lo = _mm_loadu_si128((const __m128i*)yuyv);
+		hi = _mm_loadu_si128((const __m128i*)(yuyv + 16));
+		blk[0][r] = _mm_sub_epi16(_mm_and_si128(lo, lowByte), centre);
+		blk[1][r] = _mm_sub_epi16(_mm_and_si128(hi, lowByte), centre);
+		c0 = _mm_srli_epi16(lo, 8); // U V U V of pairs 0-3
+		c1 = _mm_srli_epi16(hi, 8);
+		blk[2][r] = _mm_sub_epi16(_mm_packs_epi32(_mm_and_si128(c0,
+				lowHalf), _mm_and_si128(c1, lowHalf)), centre);
+		blk[3][r] = _mm_sub_epi16(_mm_packs_epi32(_mm_srli_epi32(c0, 16),
+				_mm_srli_epi32(c1, 16)), centre);
+	}
+	for(b = 0; b < MCU_BLOCKS; b++, coefs += 64)
+	{
+		transpose8SSE2(blk[b]);
+		fdct8SSE2(blk[b]); // rows
+		transpose8SSE2(blk[b]);
+		fdct8SSE2(blk[b]); // columns
+		for(r = 0; r < 8; r++)
+		{
+			_mm_storeu_si128((__m128i*)(coefs + r * 8), blk[b][r]);
+		}
+	}
+}
+
+// Eight coefficients at a time are widened to float, multiplied, converted
+// back with rounding and narrowed. Compares against zero, packed to bytes,
+// give the mask sixteen coefficients at a time.
+__attribute__((target("sse2")))
+uint64_t quantiseSSE2(const int16_t* coefs, const float* recip, int16_t* q)
+{
+	const __m128i	zero = _mm_setzero_si128();
+	uint64_t		zeros = 0;
+	__m128i			v, lo, hi, pair[2];
+	int				i;
+	for(i = 0; i < 64; i += 8)
+	{
+		v = _mm_loadu_si128((const __m128i*)(coefs + i));
+		lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+		lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(lo),
+				_mm_loadu_ps(recip + i)));
+		hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(hi),
+				_mm_loadu_ps(recip + i + 4)));
+		v = _mm_packs_epi32(lo, hi);
+		_mm_storeu_si128((__m128i*)(q + i), v);
+		pair[(i / 8) % 2] = _mm_cmpeq_epi16(v, zero);
+		if(i % 16 == 8)
+		{
+			zeros |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+					_mm_packs_epi16(pair[0], pair[1])) << (i - 8);
+		}
+	}
+	return ~zeros;
+}
+
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+
+// vqdmulh doubles the product before taking the high half, so the
+// constants are shifted one less to give the same result as the others
+static inline int16x8_t mulFixNEON(int16x8_t x, int16_t c)
+{
+	return vqdmulhq_n_s16(vshlq_n_s16(x, PRE_SHIFT),
+			(int16_t)(c << (CONST_SHIFT - 1)));
+}
+
+static inline void fdct8NEON(int16x8_t* d)
+{
+	int16x8_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	int16x8_t tmp10, tmp11, tmp12, tmp13, z1, z2, z3, z4, z5, z11, z13;
+	tmp0 = vaddq_s16(d[0], d[7]);
+	tmp7 = vsubq_s16(d[0], d[7]);
+	tmp1 = vaddq_s16(d[1], d[6]);
+	tmp6 = vsubq_s16(d[1], d[6]);
+	tmp2 = vaddq_s16(d[2], d[5]);
+	tmp5 = vsubq_s16(d[2], d[5]);
+	tmp3 = vaddq_s16(d[3], d[4]);
+	tmp4 = vsubq_s16(d[3], d[4]);
+	tmp10 = vaddq_s16(tmp0, tmp3);
+	tmp13 = vsubq_s16(tmp0, tmp3);
+	tmp11 = vaddq_s16(tmp1, tmp2);
+	tmp12 = vsubq_s16(tmp1, tmp2);
+	d[0] = vaddq_s16(tmp10, tmp11);
+	d[4] = vsubq_s16(tmp10, tmp11);
+	z1 = mulFixNEON(vaddq_s16(tmp12, tmp13), FIX_0_707106781);
+	d[2] = vaddq_s16(tmp13, z1);
+	d[6] = vsubq_s16(tmp13, z1);
+	tmp10 = vaddq_s16(tmp4, tmp5);
+	tmp11 = vaddq_s16(tmp5, tmp6);
+	tmp12 = vaddq_s16(tmp6, tmp7);
+	z5 = mulFixNEON(vsubq_s16(tmp10, tmp12), FIX_0_382683433);
+	z2 = vaddq_s16(mulFixNEON(tmp10, FIX_0_541196100), z5);
+	z4 = vaddq_s16(mulFixNEON(tmp12, FIX_1_306562965), z5);
+	z3 = mulFixNEON(tmp11, FIX_0_707106781);
+	z11 = vaddq_s16(tmp7, z3);
+	z13 = vsubq_s16(tmp7, z3);
+	d[5] = vaddq_s16(z13, z2);
+	d[3] = vsubq_s16(z13, z2);
+	d[1] = vaddq_s16(z11, z4);
+	d[7] = vsubq_s16(z11, z4);
+}
+
+// Join the low or high halves of two 32 bit transposed pairs
+#define JOIN_LOW(a, b) vcombine_s16(vget_low_s16(vreinterpretq_s16_s32(a)), \
+		vget_low_s16(vreinterpretq_s16_s32(b)))
+#define JOIN_HIGH(a, b) vcombine_s16(vget_high_s16(vreinterpretq_s16_s32(a)), \
+		vget_high_s16(vreinterpretq_s16_s32(b)))
+
+static inline void transpose8NEON(int16x8_t* r)
+{
+	int16x8x2_t	t0 = vtrnq_s16(r[0], r[1]);
+	int16x8x2_t	t1 = vtrnq_s16(r[2], r[3]);
+	int16x8x2_t	t2 = vtrnq_s16(r[4], r[5]);
+	int16x8x2_t	t3 = vtrnq_s16(r[6], r[7]);
+	int32x4x2_t	u0 = vtrnq_s32(vreinterpretq_s32_s16(t0.val[0]),
+			vreinterpretq_s32_s16(t1.val[0]));	// columns 0, 4 and 2, 6
+	int32x4x2_t	u1 = vtrnq_s32(vreinterpretq_s32_s16(t0.val[1]),
+			vreinterpretq_s32_s16(t1.val[1]));	// columns 1, 5 and 3, 7
+	int32x4x2_t	u2 = vtrnq_s32(vreinterpretq_s32_s16(t2.val[0]),
+			vreinterpretq_s32_s16(t3.val[0]));
+	int32x4x2_t	u3 = vtrnq_s32(vreinterpretq_s32_s16(t2.val[1]),
+			vreinterpretq_s32_s16(t3.val[1]));
+	r[0] = JOIN_LOW(u0.val[0], u2.val[0]);
+	r[4] = JOIN_HIGH(u0.val[0], u2.val[0]);
+	r[2] = JOIN_LOW(u0.val[1], u2.val[1]);
+	r[6] = JOIN_HIGH(u0.val[1], u2.val[1]);
+	r[1] = JOIN_LOW(u1.val[0], u3.val[0]);
+	r[5] = JOIN_HIGH(u1.val[0], u3.val[0]);
+	r[3] = JOIN_LOW(u1.val[1], u3.val[1]);
+	r[7] = JOIN_HIGH(u1.val[1], u3.val[1]);
+}
+
+// vld4 parts each row into even luma, U, odd luma and V
+void fdctMcuNEON(const byte* yuyv, size_t stride, int16_t* coefs)
+{
+	const uint8x8_t	centre = vdup_n_u8(128);
+	int16x8_t		blk[MCU_BLOCKS][8];
+	uint8x8x4_t		in;
+	uint8x8x2_t		luma;
+	int				r, b;
+	for(r = 0; r < MCU_ROWS; r++, yuyv += stride)
+	{
+		in = vld4_u8(yuyv);
+		luma = vzip_u8(in.val[0], in.val[2]);
+		blk[0][r] = vreinterpretq_s16_u16(vsubl_u8(luma.val[0], centre));
+		blk[1][r] = vreinterpretq_s16_u16(vsubl_u8(luma.val[1], centre));
+		blk[2][r] = vreinterpretq_s16_u16(vsubl_u8(in.val[1], centre));
+		blk[3][r] = vreinterpretq_s16_u16(vsubl_u8(in.val[3], centre));
+	}
+	for(b = 0; b < MCU_BLOCKS; b++, coefs += 64)
+	{
+		transpose8NEON(blk[b]);
+		fdct8NEON(blk[b]); // rows
+		transpose8NEON(blk[b]);
+		fdct8NEON(blk[b]); // columns
+		for(r = 0; r < 8; r++) vst1q_s16(coefs + r * 8, blk[b][r]);
+	}
+}
+
+#ifdef __aarch64__
+
+// Only AArch64 has a float to integer conversion that rounds to nearest;
+// 32 bit ARM keeps the scalar quantiser
+uint64_t quantiseNEON(const int16_t* coefs, const float* recip, int16_t* q)
+{
+	uint64_t		nonzero = 0;
+	int16x8_t		v;
+	int32x4_t		lo, hi;
+	int				i, n;
+	for(i = 0; i < 64; i += 8)
+	{
+		v = vld1q_s16(coefs + i);
+		lo = vcvtnq_s32_f32(vmulq_f32(vcvtq_f32_s32(vmovl_s16(
+				vget_low_s16(v))), vld1q_f32(recip + i)));
+		hi = vcvtnq_s32_f32(vmulq_f32(vcvtq_f32_s32(vmovl_s16(
+				vget_high_s16(v))), vld1q_f32(recip + i + 4)));
+		vst1q_s16(q + i, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+	}
+	for(n = 0; n < 64; n++) nonzero |= (uint64_t)(q[n] != 0) << n;
+	return nonzero;
+}
+
+#else
+	#define quantiseNEON quantiseScalar
+#endif
+
+#endif
+
+// Run a kernel and the scalar reference over test MCUs and make sure they
+// agree exactly: a ramp, and bars of black and white that drive the
+// intermediate sums as far as samples can. The coefficients are then
+// quantised by steps from 1 to 12, which round a good share of them at
+// exactly one half.
+bool dctMatchesScalar(mcuTransform fdct, blockQuantiser quantise)
+{
+	const unsigned int	size = MCU_BYTES * MCU_ROWS;
+	byte				in[3][MCU_BYTES * MCU_ROWS];
+	int16_t				want[MCU_BLOCKS * 64], got[MCU_BLOCKS * 64];
+	int16_t				wantQ[64], gotQ[64];
+	float				recip[64];
+	unsigned int		i, row, t, b;
+	bool				match = true;
+	for(i = 0; i < size; i++)
+	{
+		row = i / MCU_BYTES;
+		in[0][i] = (byte)(i * 37 + row);
+		in[1][i] = (i / 4 + row) % 2 ? 255 : 0;
+		in[2][i] = row < 2 || row > 5 ? 255 : 0;
+	}
+	for(i = 0; i < 64; i++) recip[i] = 1.0f / (1 + i % 12);
+	for(t = 0; t < 3 && match; t++)
+	{
+		fdctMcuScalar(in[t], MCU_BYTES, want);
+		fdct(in[t], MCU_BYTES, got);
+		match = memcmp(want, got, sizeof(want)) == 0;
+		for(b = 0; b < MCU_BLOCKS && match; b++)
+		{
+			match = quantiseScalar(want + b * 64, recip, wantQ) ==
+					quantise(want + b * 64, recip, gotQ) &&
+					memcmp(wantQ, gotQ, sizeof(wantQ)) == 0;
+		}
+	}
+	return match;
+}
+
+// Use a kernel if it checks out bit-exact against the scalar one
+bool tryDctKernel(const char* name, mcuTransform fdct,
+		blockQuantiser quantise)
+{
+	if(!dctMatchesScalar(fdct, quantise))
+	{
+		printf("DCT kernel %s does not match scalar, skipped\n", name);
+		return false;
+	}
+	dctKernel.name = name;
+	dctKernel.fdct = fdct;
+	dctKernel.quantise = quantise;
+	return true;
+}
+
+// Pick the forward DCT kernel for the direct encoder. Call once at start-up
+// before any thread encodes.
+void selectDctKernel()
+{
+	bool found = false;
+	#ifdef HAVE_X86_KERNELS
+		__builtin_cpu_init();
+		if(__builtin_cpu_supports("sse2"))
+		{
+			found = tryDctKernel("sse2", fdctMcuSSE2, quantiseSSE2);
+		}
+	#endif
+	#ifdef HAVE_NEON_KERNEL
+		if(!found)
+		{
+			found = tryDctKernel("neon", fdctMcuNEON, quantiseNEON);
+		}
+	#endif
+	if(!found)
+	{
+		dctKernel.name = "scalar";
+		dctKernel.fdct = fdctMcuScalar;
+		dctKernel.quantise = quantiseScalar;
+	}
+	printf("Forward DCT kernel: %s\n", dctKernel.name);
+}
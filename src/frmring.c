@@ -0,0 +1,243 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Single-producer, single-consumer byte log of encoded frames for downlink.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+#include "../headers/frmring.h"
+
+#define RECORD_HEADER	sizeof(struct frameRecord)
+
+// Make an empty log of about bytes, from the frame arena when it has room
+void initFrameRing(struct frameRing* ring, size_t bytes, bool downlinked)
+{
+	if(bytes > UINT32_MAX) bytes = UINT32_MAX;
+	ring->capacity = bytes & ~(size_t)(RECORD_ALIGN - 1);
+	ring->log = arenaAlloc(ring->capacity);
+	if(ring->log == NULL) ring->log = (byte*)malloc(ring->capacity);
+	if(ring->log == NULL) exitWithError("Could not allocate frame ring.");
+	ring->downlinked = downlinked;
+	ring->oldest = 0;
+	ring->pending = 0;
+	ring->newest = 0;
+	ring->frames = 0;
+	ring->bytes = 0;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->sent, 0);
+}
+
+void freeFrameRing(struct frameRing* ring)
+{
+	releaseImage(ring->log);
+	ring->log = NULL;
+}
+
+// Where a record starting at pos ends, back at the start of the log when it
+// reaches the end
+static inline uint32_t recordEnd(const struct frameRing* ring, uint32_t pos,
+		uint32_t span)
+{
+	return pos + span == ring->capacity ? 0 : pos + span;
+}
+
+// The record at pos, or NULL at the end of a lap: the end of the log is too
+// short for a header or holds a pad record
+static struct frameRecord* recordAt(const struct frameRing* ring,
+		uint32_t pos)
+{
+	struct frameRecord* rec = (struct frameRecord*)(ring->log + pos);
+	if(ring->capacity - pos < RECORD_HEADER || rec->kind == RECORD_PAD)
+	{
+		return NULL;
+	}
+	return rec;
+}
+
+// Producer: where span bytes fit between the records held, if they do. The
+// free space never closes up entirely, so pending meets oldest only when the
+// log is empty.
+static bool findRoom(const struct frameRing* ring, uint32_t span,
+		uint32_t* at)
+{
+	uint32_t end = ring->pending, start = ring->oldest;
+	if(end >= start) // free space runs to the end of the log and from the start
+	{
+		if(span < ring->capacity - end ||
+				(span == ring->capacity - end && start > 0))
+		{
+			*at = end;
+			return true;
+		}
+		*at = 0;
+		return span < start;
+	}
+	*at = end;
+	return span < start - end;
+}
+
+// Producer: drop the oldest record to make room. Only records the downlink
+// has finished with can go, or any with no downlink.
+static bool evictOldest(struct frameRing* ring)
+{
+	struct frameRecord*	rec;
+	uint32_t			limit = ring->downlinked ?
+			atomic_load_explicit(&ring->sent, memory_order_acquire) :
+			ring->pending;
+	if(ring->oldest == limit) return false;
+	rec = recordAt(ring, ring->oldest);
+	if(rec == NULL)
+	{
+		ring->oldest = 0;
+		return true;
+	}
+	if(rec->kind == RECORD_FRAME) ring->frames--;
+	ring->bytes -= rec->span;
+	ring->oldest = recordEnd(ring, ring->oldest, rec->span);
+	return true;
+}
+
+// Producer: once the log is empty, start the next lap at the beginning, as
+// neither side of where the last record ended may have room for a large
+// one. With no downlink the log just starts again. Otherwise the consumer
+// may still look at that position, so the end of the lap is marked and
+// published, and the room there is only reused once the consumer has
+// stepped past it.
+static void restartLog(struct frameRing* ring)
+{
+	struct frameRecord* pad = (struct frameRecord*)(ring->log + ring->pending);
+	if(ring->capacity - ring->pending >= RECORD_HEADER)
+	{
+		pad->kind = RECORD_PAD;
+		pad->span = ring->capacity - ring->pending;
+		pad->size = 0;
+	}
+	if(!ring->downlinked) ring->oldest = 0;
+	ring->pending = 0;
+	ringPublish(ring);
+}
+
+// Producer: a record for size bytes of image after those appended so far,
+// evicting the oldest records as needed. The caller fills in the tables
+// id, times and image; it goes to the consumer with the next
+// ringPublish().
+// NULL when the records in the way are still to be sent or the image is
+// larger than the log.
+struct frameRecord* ringAppend(struct frameRing* ring, uint32_t size,
+		enum recordKind kind)
+{
+	struct frameRecord*	rec;
+	uint32_t			at;
+	uint64_t			span = (RECORD_HEADER + (uint64_t)size +
+			RECORD_ALIGN - 1) & ~(uint64_t)(RECORD_ALIGN - 1);
+	if(span >= ring->capacity) return NULL;
+	while(!findRoom(ring, span, &at))
+	{
+		if(evictOldest(ring)) continue;
+		if(ring->oldest == ring->pending && ring->pending != 0)
+		{
+			restartLog(ring);
+			continue;
+		}
+		assert(ring->oldest != ring->pending); // an empty log takes anything
+		return NULL;
+	}
+	if(at != ring->pending && ring->capacity - ring->pending >= RECORD_HEADER)
+	{
+		rec = (struct frameRecord*)(ring->log + ring->pending); // lap ends
+		rec->kind = RECORD_PAD;
+		rec->span = ring->capacity - ring->pending;
+		rec->size = 0;
+	}
+	rec = (struct frameRecord*)(ring->log + at);
+	rec->span = span;
+	rec->size = size;
+	rec->kind = kind;
+	rec->tablesId = 0;
+	rec->downlinkedUs = 0;
+	ring->newest = at;
+	ring->pending = recordEnd(ring, at, span);
+	if(kind == RECORD_FRAME) ring->frames++;
+	ring->bytes += span;
+	return rec;
+}
+
+// Producer: hand the records appended so far to the consumer
+void ringPublish(struct frameRing* ring)
+{
+	atomic_store_explicit(&ring->head, ring->pending, memory_order_release);
+}
+
+// Producer: seconds between the captures of the oldest record held and the
+// newest
+double ringHistorySeconds(struct frameRing* ring)
+{
+	struct frameRecord*	oldest;
+	struct frameRecord*	newest = (struct frameRecord*)(ring->log +
+			ring->newest);
+	if(ring->oldest == ring->pending) return 0;
+	oldest = recordAt(ring, ring->oldest);
+	if(oldest == NULL) oldest = (struct frameRecord*)ring->log;
+	return (newest->captureUs - oldest->captureUs) / 1e6;
+}
+
+// Consumer: the oldest published record not yet sent, or NULL when there is
+// none
+struct frameRecord* ringPeek(struct frameRing* ring)
+{
+	struct frameRecord*	rec;
+	uint32_t			pos = atomic_load_explicit(&ring->sent,
+			memory_order_relaxed);
+	uint32_t			head = atomic_load_explicit(&ring->head,
+			memory_order_acquire);
+	while(pos != head)
+	{
+		rec = recordAt(ring, pos);
+		if(rec != NULL) return rec;
+		pos = 0; // past the end of the lap, which the producer may now reuse
+		atomic_store_explicit(&ring->sent, 0, memory_order_release);
+	}
+	return NULL;
+}
+
+// Consumer: give the record from ringPeek() back to the producer, which may
+// keep it as history or reuse its room
+void ringRelease(struct frameRing* ring, const struct frameRecord* rec)
+{
+	uint32_t pos = (const byte*)rec - ring->log;
+	atomic_store_explicit(&ring->sent, recordEnd(ring, pos, rec->span),
+			memory_order_release);
+}
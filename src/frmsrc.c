@@ -0,0 +1,266 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Frame source interface and backends.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#define _GNU_SOURCE
+#include "../headers/frmsrc.h"
+
+// Open the frame source selected in the configuration. Every backend fills
+// in the same frameSource so the capture path never needs to know which one
+// it is talking to.
+struct frameSource* openFrameSource(const struct srcConfig* cfg)
+{
+	struct frameSource* src =
+			(struct frameSource*)calloc(1, sizeof(struct frameSource));
+	if(src == NULL) exitWithError("Could not allocate frame source.");
+	src->type = cfg->type;
+	src->fd = -1;
+	switch(cfg->type)
+	{
+		case SRC_V4L2:
+			openV4l2Source(src, cfg);
+			break;
+		case SRC_REPLAY:
+			openReplaySource(src, cfg);
+			break;
+		case SRC_PATTERN:
+			openPatternSource(src, cfg);
+			break;
+	}
+	return src;
+}
+
+// Stop a frame source and free it
+void closeFrameSource(struct frameSource* src)
+{
+	src->close(src);
+	free(src);
+}
+
+// Update the capture statistics from a frame's sequence number. Sources
+// number every frame they capture, so a gap in the sequence means frames were
+// dropped because no buffer was free when they arrived.
+void trackSequence(struct captureStats* stats, uint32_t sequence)
+{
+	if(stats->frames > 0 && sequence > stats->lastSequence + 1)
+	{
+		stats->dropped += sequence - stats->lastSequence - 1;
+	}
+	stats->lastSequence = sequence;
+	stats->frames++;
+}
+
+// Set up real-time pacing for sources that generate their own frames
+void initPacing(struct frameSource* src, const struct srcConfig* cfg)
+{
+	src->period = (cfg->maxSpeed || cfg->fps <= 0) ? 0 : 1000000000L / cfg->fps;
+	clock_gettime(CLOCK_MONOTONIC, &src->deadline);
+}
+
+// Sleep until the next paced frame is due. If the consumer has fallen more
+// than a frame behind, start again from now rather than bursting to catch up.
+void waitForDeadline(struct frameSource* src)
+{
+	struct timespec now;
+	if(src->period == 0) return;
+	src->deadline.tv_nsec += src->period;
+	while(src->deadline.tv_nsec >= 1000000000L)
+	{
+		src->deadline.tv_nsec -= 1000000000L;
+		src->deadline.tv_sec++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if((int64_t)(now.tv_sec - src->deadline.tv_sec) * 1000000000L +
+			now.tv_nsec - src->deadline.tv_nsec > (int64_t)src->period)
+	{
+		src->deadline = now;
+		return;
+	}
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &src->deadline,
+			NULL) == EINTR);
+}
+
+// Give a generated source nbuffers buffers, all free
+void initBuffers(struct frameSource* src, unsigned int nbuffers)
+{
+	src->stats.queued = nbuffers;
+	sem_init(&src->freeBuffers, 0, nbuffers);
+}
+
+// Claim a buffer for a generated frame. Like a driver with every buffer
+// dequeued, a source has nothing to hand out until the consumer releases
+// one, however far ahead of it capture has got. Sleeps until then, so the
+// encode workers keep the CPU, or returns FALSE after CAPTURE_TIMEOUT_MS as
+// a stalled camera would.
+bool takeBuffer(struct frameSource* src)
+{
+	struct timespec due;
+	clock_gettime(CLOCK_MONOTONIC, &due);
+	due.tv_sec += CAPTURE_TIMEOUT_MS / 1000;
+	due.tv_nsec += (CAPTURE_TIMEOUT_MS % 1000) * 1000000L;
+	if(due.tv_nsec >= 1000000000L)
+	{
+		due.tv_nsec -= 1000000000L;
+		due.tv_sec++;
+	}
+	while(sem_clockwait(&src->freeBuffers, CLOCK_MONOTONIC, &due) == -1)
+	{
+		if(errno != EINTR) return FALSE;
+	}
+	__atomic_fetch_sub(&src->stats.queued, 1, __ATOMIC_RELAXED);
+	return TRUE;
+}
+
+// Hand a generated frame's buffer back, waking the capture loop if it is
+// waiting for one. May be called from any thread.
+void giveBuffer(struct frameSource* src)
+{
+	__atomic_fetch_add(&src->stats.queued, 1, __ATOMIC_RELAXED);
+	sem_post(&src->freeBuffers);
+}
+
+// Timestamp a generated frame with the monotonic clock, as V4L2 does
+void stampFrame(struct frame* frm)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	frm->timestamp.tv_sec = now.tv_sec;
+	frm->timestamp.tv_usec = now.tv_nsec / 1000;
+}
+
+// ----------------------------------------------------------------------------
+// Test pattern source
+// ----------------------------------------------------------------------------
+
+// Write one YUYV pattern frame: colour bars with a fixed noise texture and a
+// block that moves between frames, so consecutive frames differ and encode
+// at a realistic cost.
+void fillPattern(byte* yuyv, struct imgDetails det, unsigned int n)
+{
+	static const byte bars[8][3] = // Y, U, V of 75% colour bars
+	{
+		{180, 128, 128}, {162, 44, 142}, {131, 156, 44}, {112, 72, 58},
+		{84, 184, 198}, {65, 100, 212}, {35, 212, 114}, {16, 128, 128}
+	};
+	unsigned int x, y, bar, noise = 12345;
+	unsigned int boxX = (n * 16) % det.width, boxY = (n * 8) % det.height;
+	for(y = 0; y < det.height; y++)
+	{
+		for(x = 0; x < det.width; x += 2)
+		{
+			byte* px = &yuyv[(y * det.width + x) * 2];
+			bar = x * 8 / det.width;
+			noise = noise * 1103515245 + 12345;
+			px[0] = bars[bar][0] + ((noise >> 16) & 0x0F);
+			px[1] = bars[bar][1];
+			px[2] = bars[bar][0] + ((noise >> 24) & 0x0F);
+			px[3] = bars[bar][2];
+			if(x - boxX < det.width / 8 && y - boxY < det.height / 8)
+			{
+				px[0] = px[2] = 235 - (y - boxY);
+			}
+		}
+	}
+}
+
+bool nextPatternFrame(struct frameSource* src, struct frame* frm)
+{
+	if(!takeBuffer(src)) return FALSE;
+	waitForDeadline(src);
+	frm->index = src->sequence % src->nframes;
+	frm->data = src->bufs[frm->index].start;
+	frm->bytesused = src->frameBytes;
+	frm->sequence = src->sequence++;
+	stampFrame(frm);
+	trackSequence(&src->stats, frm->sequence);
+	return TRUE;
+}
+
+void releasePatternFrame(struct frameSource* src, struct frame* frm)
+{
+	giveBuffer(src);
+}
+
+void closePatternSource(struct frameSource* src)
+{
+	unsigned int i;
+	for(i = 0; i < src->nframes; i++) free(src->bufs[i].start);
+	free(src->bufs);
+	sem_destroy(&src->freeBuffers);
+}
+
+// Generate one pattern frame per capture buffer up front so producing a
+// frame costs nothing and never skews a benchmark.
+void openPatternSource(struct frameSource* src, const struct srcConfig* cfg)
+{
+	unsigned int i;
+	if(cfg->width == 0 || cfg->height == 0)
+	{
+		exitWithError("Pattern source needs a resolution (-r WxH).");
+	}
+	src->det.width = cfg->width;
+	src->det.height = cfg->height;
+	src->det.size = src->det.width * src->det.height * 3;
+	src->frameBytes = src->det.width * src->det.height * 2;
+	if(cfg->pixelformat == V4L2_PIX_FMT_MJPEG)
+	{
+		exitWithError("Pattern source only generates YUYV.");
+	}
+	src->pixelformat = V4L2_PIX_FMT_YUYV;
+	src->nframes = src->nbuffers = cfg->nbuffers;
+	src->bufs = (struct buffer*)calloc(src->nframes, sizeof(struct buffer));
+	if(src->bufs == NULL) exitWithError("Could not allocate pattern buffers.");
+	for(i = 0; i < src->nframes; i++)
+	{
+		src->bufs[i].length = src->frameBytes;
+		src->bufs[i].start = (byte*)malloc(src->frameBytes);
+		if(src->bufs[i].start == NULL)
+		{
+			exitWithError("Could not allocate pattern buffers.");
+		}
+		fillPattern(src->bufs[i].start, src->det, i);
+	}
+	initBuffers(src, src->nframes);
+	src->next = nextPatternFrame;
+	src->release = releasePatternFrame;
+	src->close = closePatternSource;
+	initPacing(src, cfg);
+	printf("Generating %ux%u test pattern\n", src->det.width, src->det.height);
+}
@@ -44,8 +44,52 @@
 // You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
 
 #include "../headers/imgproc.h"
+#include "../headers/yuyvjpeg.h"
+#include "../headers/tjenc.h"
 #include "../headers/jpeglib.h"
 
+// Progressive scan script for a slow link, so any prefix of the frame
+// decodes to the whole image at some fidelity. DC comes first for a block
+// preview, then the lowest luma frequencies, which carry most of the
+// structure, then chroma and the rest of luma at half precision; the
+// refinement scans finish luma before chroma. Each AC scan holds one
+// component, as progressive JPEG requires.
+static const jpeg_scan_info progressiveScans[] = {
+	{3, {0, 1, 2}, 0, 0, 0, 1},		// DC, all components, 1 bit short
+	{1, {0}, 1, 2, 0, 1},			// Y lowest AC
+	{1, {0}, 3, 9, 0, 1},			// Y low AC
+	{1, {1}, 1, 63, 0, 1},			// Cb AC
+	{1, {2}, 1, 63, 0, 1},			// Cr AC
+	{1, {0}, 10, 63, 0, 1},			// Y high AC
+	{3, {0, 1, 2}, 0, 0, 1, 0},		// DC refinement
+	{1, {0}, 1, 63, 1, 0},			// Y AC refinement
+	{1, {1}, 1, 63, 1, 0},			// Cb AC refinement
+	{1, {2}, 1, 63, 1, 0}			// Cr AC refinement
+};
+
+// fast suits a board short of time per frame, small a downlink short of
+// bytes. robust limits a corrupted byte to the rest of its MCU row, at the
+// cost of a few bytes a row; smoothing in small only reaches frames libjpeg
+// downsamples itself, ENC_YUV444.
+const struct encodeProfile encodeProfiles[ENCODE_PROFILES] = {
+	{"fast", JDCT_IFAST, FALSE, 0, 0},
+	{"balanced", JDCT_ISLOW, FALSE, 0, 0},
+	{"small", JDCT_ISLOW, TRUE, 10, 0},
+	{"robust", JDCT_ISLOW, FALSE, 0, 1}
+};
+
+const struct encodeProfile* encodeProfile = &encodeProfiles[1];
+
+const struct encodeProfile* findProfile(const char* name)
+{
+	unsigned int i;
+	for(i = 0; i < ENCODE_PROFILES; i++)
+	{
+		if(strcmp(encodeProfiles[i].name, name) == 0) return &encodeProfiles[i];
+	}
+	return NULL;
+}
+
 // Set the details of the image being compressed in the compression manager
 // struct
 void setImgDetails(int rlen, int imgheight, int inputComponents,
@@ -59,57 +103,370 @@ void setImgDetails(int rlen, int imgheight, int inputComponents,
 	jpeg_set_quality(cinfo, cfactor, TRUE); // set compression factor
 }
 
-// Create the JPEG compression manager struct to handle running the libjpeg
-// compression
-void createJpegMgr(j_compress_ptr cinfo, FILE* outfile) {
-	jpeg_create_compress(cinfo);
-	jpeg_stdio_dest(cinfo, outfile); // set image source details
+// Lay out Y, Cb and Cr rows for one MCU row (DCTSIZE lines) of a frame,
+// padded out to whole MCUs as jpeg_write_raw_data() expects. The storage is
+// only allocated again when the frame is wider than it has been.
+void allocRawPlanes(struct rawPlanes* planes, unsigned int width)
+{
+	unsigned int	r;
+	size_t			bytes;
+	planes->lumaWidth = (width + RAW_MCU_WIDTH - 1) / RAW_MCU_WIDTH *
+			RAW_MCU_WIDTH;
+	planes->chromaWidth = planes->lumaWidth / 2;
+	bytes = DCTSIZE * planes->lumaWidth * 2;
+	if(bytes > planes->capacity)
+	{
+		free(planes->data);
+		planes->data = (byte*)malloc(bytes);
+		if(planes->data == NULL) exitWithError("Could not allocate raw planes.");
+		planes->capacity = bytes;
+	}
+	for(r = 0; r < DCTSIZE; r++)
+	{
+		planes->y[r] = planes->data + r * planes->lumaWidth;
+		planes->cb[r] = planes->data + DCTSIZE * planes->lumaWidth +
+				r * planes->chromaWidth;
+		planes->cr[r] = planes->cb[r] + DCTSIZE * planes->chromaWidth;
+	}
+	planes->rows[0] = planes->y;
+	planes->rows[1] = planes->cb;
+	planes->rows[2] = planes->cr;
+}
+
+void freeRawPlanes(struct rawPlanes* planes)
+{
+	free(planes->data);
+	planes->data = NULL;
+	planes->capacity = 0;
 }
 
-// Takes RAW image data (unsigned char*), generates and saves a compressed
-// JPEG image.
-// compressionFactor scales from 0 to 100. 0 = worst quality,
-// 										   100 = best quality
-void compressJpeg(FILE* outfile, byte* imgbuf, unsigned int cfactor,
-		int rlen, int imgheight, int incomponents)
+// Split the next DCTSIZE lines of a YUYV frame into the planes. Lines past
+// the bottom of the frame and samples past its right edge repeat the last
+// line and sample, so the padding MCUs compress to nothing.
+void fillRawPlanes(struct rawPlanes* planes, const byte* yuyv,
+		struct imgDetails det, unsigned int firstRow)
 {
-	struct jpeg_compress_struct 	cinfo;  // compression manager struct
-	struct jpeg_error_mgr 			jerr;   // error manager struct
-	byte* 							rowptr[imgheight]; // a row of the image
-	unsigned int					stride = 0;
-	if(cfactor < 0 || cfactor > 100) // ensure compression between 0 and 100
+	unsigned int r, row, pairs = det.width / 2;
+	for(r = 0; r < DCTSIZE; r++)
+	{
+		row = firstRow + r < det.height ? firstRow + r : det.height - 1;
+		convertKernel.split(yuyv + row * det.width * 2, planes->y[r],
+				planes->cb[r], planes->cr[r], pairs);
+		memset(planes->y[r] + pairs * 2, planes->y[r][pairs * 2 - 1],
+				planes->lumaWidth - pairs * 2);
+		memset(planes->cb[r] + pairs, planes->cb[r][pairs - 1],
+				planes->chromaWidth - pairs);
+		memset(planes->cr[r] + pairs, planes->cr[r][pairs - 1],
+				planes->chromaWidth - pairs);
+	}
+}
+
+// Tell libjpeg the data arrives already downsampled at 4:2:2: two luma
+// samples across for every chroma sample, full vertical resolution
+void setRawSampling(j_compress_ptr cinfo)
+{
+	cinfo->raw_data_in = TRUE;
+	cinfo->comp_info[0].h_samp_factor = 2;
+	cinfo->comp_info[0].v_samp_factor = 1;
+	cinfo->comp_info[1].h_samp_factor = 1;
+	cinfo->comp_info[1].v_samp_factor = 1;
+	cinfo->comp_info[2].h_samp_factor = 1;
+	cinfo->comp_info[2].v_samp_factor = 1;
+}
+
+// libjpeg destination manager callbacks writing into a growable buffer
+void initBufferDest(j_compress_ptr cinfo)
+{
+	struct bufferDest* dest = (struct bufferDest*)cinfo->dest;
+	reserveImage(dest->buf, dest->capacity, AVG_IMG_SIZE); // on first use
+	dest->pub.next_output_byte = *dest->buf;
+	dest->pub.free_in_buffer = *dest->capacity;
+}
+
+// Called by libjpeg when the buffer is full. Double the storage and carry on
+// after the bytes already written, so frames are never truncated.
+boolean growBufferDest(j_compress_ptr cinfo)
+{
+	struct bufferDest*	dest = (struct bufferDest*)cinfo->dest;
+	size_t				used = *dest->capacity;
+	reserveImage(dest->buf, dest->capacity, used * 2);
+	dest->pub.next_output_byte = *dest->buf + used;
+	dest->pub.free_in_buffer = *dest->capacity - used;
+	return TRUE;
+}
+
+void termBufferDest(j_compress_ptr cinfo)
+{
+	struct bufferDest* dest = (struct bufferDest*)cinfo->dest;
+	dest->size = *dest->capacity - dest->pub.free_in_buffer;
+}
+
+// Point a compression object at a caller's storage. The buffer is used in
+// place and grown with reserveImage() when a frame does not fit, so *buf and
+// *capacity may change; after jpeg_finish_compress() dest->size holds the
+// number of bytes written.
+void setBufferDest(j_compress_ptr cinfo, struct bufferDest* dest, byte** buf,
+		size_t* capacity)
+{
+	dest->pub.init_destination = initBufferDest;
+	dest->pub.empty_output_buffer = growBufferDest;
+	dest->pub.term_destination = termBufferDest;
+	dest->buf = buf;
+	dest->capacity = capacity;
+	dest->size = 0;
+	cinfo->dest = &dest->pub;
+}
+
+// Create an encoder. The libjpeg compression object is made once here and
+// kept for the life of the encoder; configureEncoder() sets it up for a
+// geometry and quality.
+void initEncoder(struct jpegEncoder* enc)
+{
+	memset(enc, 0, sizeof(*enc));
+	enc->cinfo.err = jpeg_std_error(&enc->jerr); // use jerr struct on error
+	jpeg_create_compress(&enc->cinfo); // create JPEG compression manager
+}
+
+// Free the working buffers of every mode
+void freeEncoderBuffers(struct jpegEncoder* enc)
+{
+	freeRawPlanes(&enc->planes);
+	free(enc->strip);
+	enc->strip = NULL;
+	enc->stripBytes = 0;
+	free(enc->frame);
+	enc->frame = NULL;
+	enc->frameBytes = 0;
+}
+
+// The frame coding settings of an encoder as one value to compare
+static uint8_t codingOf(const struct jpegEncoder* enc)
+{
+	return (enc->abbreviated ? 1 : 0) | (enc->progressive ? 2 : 0) |
+			(enc->arithmetic ? 4 : 0);
+}
+
+// Set an encoder up for a frame geometry, quality and mode, with the
+// settings of encodeProfile and its own coding settings. Quantisation
+// tables are only rebuilt when one of them changes, so calling this for
+// every frame costs a comparison. Each mode keeps its own working buffer,
+// through a new quality or a smaller geometry such as the mosaic of a delta
+// frame, so once an encoder has seen its largest frame in each mode it no
+// longer goes to the heap.
+void configureEncoder(struct jpegEncoder* enc, struct imgDetails det,
+		unsigned int cfactor, enum encodeMode mode)
+{
+	unsigned int	r, c, stride = det.width * 3;
+	size_t			stripBytes;
+	if(enc->configured && enc->det.width == det.width &&
+			enc->det.height == det.height && enc->quality == cfactor &&
+			enc->mode == mode && enc->profile == encodeProfile &&
+			enc->coding == codingOf(enc))
+	{
+		return;
+	}
+	if(cfactor > 100) // ensure compression between 0 and 100
 	{
 		exitWithError("Compression factor must be between 0 and 100.");
 	}
-	createJpegMgr(&cinfo, outfile); // create JPEG compression manager
-	cinfo.err = jpeg_std_error(&jerr); // use jerr struct on error
-	setImgDetails(rlen, imgheight, incomponents, cfactor, &cinfo);
-	jpeg_start_compress(&cinfo, TRUE); // Start the compression
-	if(stride == 0) stride = rlen * incomponents; // alloc 1 row arr of JSAMPLE
-	while (cinfo.next_scanline < cinfo.image_height)
+	setImgDetails(det.width, det.height, 3, cfactor, &enc->cinfo);
+	enc->cinfo.dct_method = encodeProfile->dctMethod;
+	// arithmetic coding has no Huffman tables to optimise, and libjpeg
+	// refuses to be asked
+	enc->cinfo.optimize_coding = encodeProfile->optimize && !enc->arithmetic;
+	enc->cinfo.smoothing_factor = encodeProfile->smoothing;
+	enc->cinfo.restart_in_rows = encodeProfile->restartRows;
+	if(enc->progressive) // libjpeg optimises the Huffman tables for these
+	{
+		enc->cinfo.scan_info = progressiveScans;
+		enc->cinfo.num_scans =
+				sizeof(progressiveScans) / sizeof(progressiveScans[0]);
+	}
+	enc->cinfo.arith_code = enc->arithmetic;
+	if(mode == ENC_RAW422)
+	{
+		setRawSampling(&enc->cinfo);
+		allocRawPlanes(&enc->planes, det.width);
+	}
+	else if(mode == ENC_DIRECT422) // libjpeg only supplies the tables
+	{
+		setRawSampling(&enc->cinfo);
+		if(enc->direct == NULL)
+		{
+			enc->direct = (struct directEncoder*)malloc(
+					sizeof(struct directEncoder));
+			if(enc->direct == NULL)
+			{
+				exitWithError("Could not allocate direct encoder.");
+			}
+		}
+		setDirectTables(enc->direct, &enc->cinfo);
+	}
+	else if(mode == ENC_TURBO422)
+	{
+		configureTurbo(enc, det);
+	}
+	else
 	{
-		rowptr[cinfo.next_scanline] = &imgbuf[cinfo.next_scanline*stride];
-		jpeg_write_scanlines(&cinfo, &rowptr[cinfo.next_scanline], 1);
+		// libjpeg takes max_v_samp_factor * DCTSIZE lines at a time
+		enc->band = 0;
+		for(c = 0; c < enc->cinfo.num_components; c++)
+		{
+			if(enc->cinfo.comp_info[c].v_samp_factor * DCTSIZE > enc->band)
+			{
+				enc->band = enc->cinfo.comp_info[c].v_samp_factor * DCTSIZE;
+			}
+		}
+		stripBytes = enc->band * stride;
+		if(stripBytes > enc->stripBytes)
+		{
+			free(enc->strip);
+			enc->strip = (byte*)malloc(stripBytes);
+			if(enc->strip == NULL) exitWithError("Could not allocate strip.");
+			enc->stripBytes = stripBytes;
+		}
+		for(r = 0; r < enc->band; r++) enc->rowptr[r] = enc->strip + r * stride;
 	}
-	jpeg_finish_compress(&cinfo); // Finish the compression
-	jpeg_destroy_compress(&cinfo); // Free all memory used by libjpeg
+	enc->det = det;
+	enc->quality = cfactor;
+	enc->mode = mode;
+	enc->profile = encodeProfile;
+	enc->coding = codingOf(enc);
+	enc->configured = TRUE;
+	enc->reconfigurations++;
 }
 
-byte* YUYVtoYUV(byte* yuyvValues, struct imgDetails det)
+// Pack a tag into the body of an HCAM segment
+void packFrameTag(byte* tag, const struct frameTag* ft)
 {
-	unsigned int j, yuvByteCount; // Create a buffer to hold the YUV image
-	byte* yuvOutput = (byte*)malloc(det.size);
-    yuvByteCount = 0;
-	for(j = 0; j < (((det.width * det.height)>>1) * 4); j+=4)
+	memcpy(tag, HCAM_ID, 4);
+	tag[4] = HCAM_VERSION;
+	tag[5] = ft->flags;
+	tag[6] = ft->tablesId;
+	tag[7] = (byte)(ft->sequence >> 24);
+	tag[8] = (byte)(ft->sequence >> 16);
+	tag[9] = (byte)(ft->sequence >> 8);
+	tag[10] = (byte)ft->sequence;
+}
+
+// Write an HCAM segment into the stream being compressed, just after SOI
+void writeFrameTag(j_compress_ptr cinfo, const struct frameTag* ft)
+{
+	byte tag[HCAM_TAG_LENGTH];
+	packFrameTag(tag, ft);
+	jpeg_write_marker(cinfo, HCAM_MARKER, tag, HCAM_TAG_LENGTH);
+}
+
+// Write the tables an abbreviated frame from this encoder needs, as a
+// tables-only stream (SOI, HCAM, DQT, DHT, EOI) in *buf, grown as needed.
+// libjpeg cannot put a marker in a tables-only stream, so the HCAM segment
+// is spliced in after SOI. Returns the length.
+size_t writeTables(struct jpegEncoder* enc, byte** buf, size_t* capacity)
+{
+	struct frameTag	ft;
+	size_t			size, segment = 4 + HCAM_TAG_LENGTH;
+	setBufferDest(&enc->cinfo, &enc->dest, buf, capacity);
+	jpeg_write_tables(&enc->cinfo);
+	size = enc->dest.size;
+	reserveImage(buf, capacity, size + segment);
+	memmove(*buf + 2 + segment, *buf + 2, size - 2);
+	(*buf)[2] = 0xFF;
+	(*buf)[3] = HCAM_MARKER;
+	(*buf)[4] = 0;
+	(*buf)[5] = 2 + HCAM_TAG_LENGTH;
+	ft.flags = HCAM_TABLES;
+	ft.tablesId = enc->quality;
+	ft.sequence = 0;
+	packFrameTag(*buf + 6, &ft);
+	return size + segment;
+}
+
+// Takes a YUYV frame and generates a compressed JPEG image with a configured
+// encoder. Neither mode expands the whole frame:
+// - ENC_RAW422 splits the frame into planes at its native 4:2:2 one MCU row
+//   at a time and hands them to libjpeg through jpeg_write_raw_data(), so
+//   libjpeg skips its colour conversion and downsampling.
+// - ENC_YUV444 converts one MCU band at a time to 4:4:4 into a small strip
+//   that stays in cache and is handed to jpeg_write_scanlines() straight
+//   away, so working memory is O(width) rather than O(frame).
+//
+// The image is written straight into *buf, grown as needed, and its length
+// is returned. An abbreviated frame leaves out the DQT and DHT segments and
+// carries an HCAM tag naming the tables stream to decode it with; arithmetic
+// coded and replenishment frames are tagged too, and a delta frame carries
+// its HMAP segment after the tag. ENC_DIRECT422 frames are written by
+// encodeDirect() instead, in the same layout, and ENC_TURBO422 frames by
+// TurboJPEG through encodeTurbo().
+size_t encodeFrame(struct jpegEncoder* enc, const byte* yuyv, byte** buf,
+		size_t* capacity)
+{
+	j_compress_ptr	cinfo = &enc->cinfo;
+	unsigned int	rows;
+	struct frameTag	ft;
+	if(enc->mode == ENC_DIRECT422)
 	{
-		// Convert this pixel to YUV
-		yuvOutput[0 + yuvByteCount] = yuyvValues[j]; //y0 = y
-		yuvOutput[1 + yuvByteCount] = yuyvValues[j+1]; //u0 = u
-		yuvOutput[2 + yuvByteCount] = yuyvValues[j+3]; //v0 = v
-		yuvOutput[3 + yuvByteCount] = yuyvValues[j+2]; //y0 = y'
-		yuvOutput[4 + yuvByteCount] = yuyvValues[j+1]; //u0 = u
-		yuvOutput[5 + yuvByteCount] = yuyvValues[j+3]; //v0 = v
-		yuvByteCount += 6;
+		return encodeDirect(enc, yuyv, buf, capacity);
 	}
-	return yuvOutput;
+	if(enc->mode == ENC_TURBO422)
+	{
+		return encodeTurbo(enc, yuyv, buf, capacity);
+	}
+	setBufferDest(cinfo, &enc->dest, buf, capacity); // set image destination
+	if(enc->abbreviated) jpeg_suppress_tables(cinfo, TRUE);
+	jpeg_start_compress(cinfo, !enc->abbreviated); // Start the compression
+	if(enc->abbreviated || enc->arithmetic || enc->flags != 0)
+	{
+		ft.flags = (enc->abbreviated ? HCAM_ABBREVIATED : 0) |
+				(enc->arithmetic ? HCAM_ARITHMETIC : 0) | enc->flags;
+		ft.tablesId = enc->abbreviated ? enc->quality : 0;
+		ft.sequence = enc->sequence;
+		writeFrameTag(cinfo, &ft);
+	}
+	if(enc->map != NULL)
+	{
+		jpeg_write_marker(cinfo, HCAM_MARKER, enc->map, enc->mapLength);
+	}
+	while (cinfo->next_scanline < cinfo->image_height)
+	{
+		if(enc->mode == ENC_RAW422)
+		{
+			fillRawPlanes(&enc->planes, yuyv, enc->det, cinfo->next_scanline);
+			jpeg_write_raw_data(cinfo, enc->planes.rows, DCTSIZE);
+		}
+		else
+		{
+			rows = cinfo->image_height - cinfo->next_scanline;
+			if(rows > enc->band) rows = enc->band;
+			convertKernel.convert(yuyv + cinfo->next_scanline *
+					enc->det.width * 2, enc->strip, rows * enc->det.width / 2);
+			jpeg_write_scanlines(cinfo, enc->rowptr, rows);
+		}
+	}
+	jpeg_finish_compress(cinfo); // Finish the compression
+	return enc->dest.size;
+}
+
+void destroyEncoder(struct jpegEncoder* enc)
+{
+	jpeg_destroy_compress(&enc->cinfo); // Free all memory used by libjpeg
+	freeEncoderBuffers(enc);
+	free(enc->direct);
+	enc->direct = NULL;
+	destroyTurbo(enc);
+	enc->configured = FALSE;
+}
+
+// Compress a single YUYV frame with a throwaway encoder. Repeated frames
+// should keep a jpegEncoder instead so libjpeg is not set up every time.
+size_t compressJpegYUYV(const byte* yuyv, unsigned int cfactor,
+		struct imgDetails det, enum encodeMode mode, byte** buf,
+		size_t* capacity)
+{
+	struct jpegEncoder	enc;
+	size_t				size;
+	initEncoder(&enc);
+	configureEncoder(&enc, det, cfactor, mode);
+	size = encodeFrame(&enc, yuyv, buf, capacity);
+	destroyEncoder(&enc);
+	return size;
 }
@@ -0,0 +1,158 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Rate control to fit each encoded frame in a byte budget.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#include "../headers/rate.h"
+
+void initRateControl(struct rateControl* rc, size_t target,
+		unsigned int quality)
+{
+	memset(rc, 0, sizeof(struct rateControl));
+	rc->target = target;
+	rc->quality = quality;
+	rc->slope = RATE_SLOPE;
+}
+
+unsigned int clampQuality(double q)
+{
+	if(q < RATE_MIN_QUALITY) return RATE_MIN_QUALITY;
+	if(q > RATE_MAX_QUALITY) return RATE_MAX_QUALITY;
+	return (unsigned int)(q + 0.5);
+}
+
+// Log of the factor libjpeg scales its quantisation tables by at a quality,
+// as jpeg_quality_scaling() computes it. Size is close to log-linear in
+// this rather than in quality itself.
+double logScale(double q)
+{
+	return log(q < 50 ? 5000.0 / q : 200.0 - 2 * q);
+}
+
+double qualityForLogScale(double s)
+{
+	double scale = exp(s);
+	return scale > 100 ? 5000.0 / scale : (200.0 - scale) / 2;
+}
+
+// Quality expected to land a frame of size at quality q in the middle of the
+// accepted window
+double predictQuality(struct rateControl* rc, unsigned int q, size_t size)
+{
+	double goal = rc->target * (1.0 - RATE_TOLERANCE / 2);
+	return qualityForLogScale(logScale(q) -
+			(log(goal) - log(size > 0 ? size : 1)) / rc->slope);
+}
+
+// Encode a frame at the quality that fits it in the target, at most
+// RATE_MAX_PASSES times. *buf always holds the best encode so far: the
+// largest that fits, or the smallest if none does yet. The quality tried is
+// kept between the highest that fitted and the lowest that did not, so no
+// quality is encoded twice. Returns the length, with the quality used in
+// *quality.
+size_t encodeToBudget(struct rateControl* rc, encodeAtFn encode,
+		void* ctx, byte** buf, size_t* capacity, unsigned int* quality)
+{
+	unsigned int	pass, q, next, fits = 0, over = RATE_MAX_QUALITY + 1;
+	unsigned int	bestQuality = 0, lastQuality = 0;
+	size_t			size, best = 0, lastSize = 0, tmpCapacity;
+	bool			bestFits = false;
+	byte*			tmp;
+	double			slope;
+	q = rc->primed ? clampQuality(predictQuality(rc, rc->quality,
+			rc->lastSize)) : clampQuality(rc->quality);
+	for(pass = 0; pass < RATE_MAX_PASSES; pass++)
+	{
+		size = encode(ctx, q, &rc->scratch, &rc->scratchCapacity);
+		rc->passes++;
+		if(best == 0 || (size <= rc->target && (!bestFits || size > best)) ||
+				(!bestFits && size < best)) // keep this one
+		{
+			tmp = *buf;
+			tmpCapacity = *capacity;
+			*buf = rc->scratch;
+			*capacity = rc->scratchCapacity;
+			rc->scratch = tmp;
+			rc->scratchCapacity = tmpCapacity;
+			best = size;
+			bestQuality = q;
+			bestFits = size <= rc->target;
+		}
+		if(size <= rc->target)
+		{
+			if(size >= rc->target * (1.0 - RATE_TOLERANCE)) break;
+			fits = q;
+		}
+		else over = q;
+		if(lastSize > 0 && lastQuality != q && size != lastSize)
+		{
+			// measured on this frame, so used as it is for the next pass
+			slope = (log(size) - log(lastSize)) /
+					(logScale(lastQuality) - logScale(q));
+			if(slope > RATE_MIN_SLOPE && slope < RATE_MAX_SLOPE)
+			{
+				rc->slope = slope;
+			}
+		}
+		lastQuality = q;
+		lastSize = size;
+		next = clampQuality(predictQuality(rc, q, size));
+		if(next <= fits) next = fits + 1;
+		if(next >= over) next = over - 1;
+		if(next <= fits || next < RATE_MIN_QUALITY || next == q)
+		{
+			break; // no quality left to try
+		}
+		q = next;
+	}
+	rc->frames++;
+	if(!bestFits) rc->overBudget++;
+	rc->quality = bestQuality;
+	rc->lastSize = best;
+	rc->primed = true;
+	*quality = bestQuality;
+	return best;
+}
+
+void freeRateControl(struct rateControl* rc)
+{
+	releaseImage(rc->scratch);
+	rc->scratch = NULL;
+	rc->scratchCapacity = 0;
+}
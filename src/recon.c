@@ -0,0 +1,476 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Ground station reconstruction of downlinked frames.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include "../headers/util.h"
+#include "../headers/imgproc.h"
+#include "../headers/replen.h"
+#include "../headers/sercom.h"
+
+#define JPEG_MARKER		0xFF
+#define JPEG_SOI		0xD8
+#define JPEG_EOI		0xD9
+#define JPEG_SOS		0xDA
+#define JPEG_RST0		0xD0
+#define JPEG_RST7		0xD7
+
+// libjpeg error handler that skips a bad stream rather than exiting
+struct reconError
+{
+	struct jpeg_error_mgr pub;
+	jmp_buf escape;
+};
+
+// The picture the ground station holds, and what it has seen so far
+struct reconstructor
+{
+	struct jpeg_decompress_struct cinfo;
+	struct reconError err;
+	struct imgDetails det;
+	byte* frame;				// YUYV frame rebuilt from key and delta frames
+	byte* mosaic;				// YUYV of the stream being decoded
+	size_t mosaicCapacity;
+	byte* row;					// one decoded YCbCr scanline
+	size_t rowCapacity;
+	bool* changed;				// per MCU, from the delta frame's map
+	size_t changedCapacity;
+	bool valid;					// frame holds the chain up to lastSequence
+	uint32_t lastSequence;
+	int tablesId;				// tables loaded for abbreviated frames, -1 none
+	unsigned long written;
+	unsigned long keyFrames;
+	unsigned long deltaFrames;
+	unsigned long skipped;		// streams lost, corrupt or after a gap
+};
+
+void reconErrorExit(j_common_ptr cinfo)
+{
+	struct reconError* err = (struct reconError*)cinfo->err;
+	longjmp(err->escape, 1);
+}
+
+void reconMessage(j_common_ptr cinfo)
+{
+}
+
+// Length of the JPEG stream starting at an SOI, found by walking its marker
+// segments and scanning past entropy coded data, or 0 if it is cut short.
+// Tables-only streams end at EOI with no scan.
+size_t streamLength(const byte* p, size_t len)
+{
+	size_t	pos = 2;
+	byte	marker;
+	while(pos + 2 <= len)
+	{
+		if(p[pos] != JPEG_MARKER) return 0;
+		marker = p[pos + 1];
+		if(marker == JPEG_MARKER) // fill byte
+		{
+			pos++;
+			continue;
+		}
+		if(marker == JPEG_EOI) return pos + 2;
+		if(pos + 4 > len) return 0;
+		pos += 2 + ((p[pos + 2] << 8) | p[pos + 3]);
+		if(marker != JPEG_SOS) continue;
+		// entropy coded data runs to the next marker that is not a stuffed
+		// zero or a restart
+		while(pos + 1 < len && !(p[pos] == JPEG_MARKER && p[pos + 1] != 0 &&
+				(p[pos + 1] < JPEG_RST0 || p[pos + 1] > JPEG_RST7) &&
+				p[pos + 1] != JPEG_MARKER))
+		{
+			pos++;
+		}
+	}
+	return 0;
+}
+
+// Find an APP11 segment by its id
+jpeg_saved_marker_ptr findSegment(j_decompress_ptr cinfo, const char* id,
+		unsigned int minLength)
+{
+	jpeg_saved_marker_ptr m;
+	for(m = cinfo->marker_list; m != NULL; m = m->next)
+	{
+		if(m->marker == HCAM_MARKER && m->data_length >= minLength &&
+				memcmp(m->data, id, 4) == 0)
+		{
+			return m;
+		}
+	}
+	return NULL;
+}
+
+// Tables id from the HCAM segment of a tables-only stream. libjpeg drops
+// the markers it saved once such a stream ends, so the segments are walked
+// here instead. -1 if the stream has no tag.
+int tablesStreamId(const byte* p, size_t len)
+{
+	size_t	pos = 2, length;
+	while(pos + 4 <= len && p[pos] == JPEG_MARKER && p[pos + 1] != JPEG_EOI)
+	{
+		length = (p[pos + 2] << 8) | p[pos + 3];
+		if(p[pos + 1] == HCAM_MARKER && length >= 2 + HCAM_TAG_LENGTH &&
+				pos + 2 + length <= len &&
+				memcmp(p + pos + 4, HCAM_ID, 4) == 0)
+		{
+			return p[pos + 4 + 6];
+		}
+		pos += 2 + length;
+	}
+	return -1;
+}
+
+void growBuffer(void** buf, size_t* capacity, size_t size)
+{
+	if(*capacity >= size) return;
+	*buf = realloc(*buf, size);
+	if(*buf == NULL) exitWithError("Could not allocate reconstruction.");
+	*capacity = size;
+}
+
+// Decode the image whose header has been read into the mosaic as YUYV.
+// Chroma is replicated rather than interpolated when upsampling, so 4:2:2
+// samples come back exactly where they were.
+void decodeYUYV(struct reconstructor* rc)
+{
+	j_decompress_ptr	cinfo = &rc->cinfo;
+	JSAMPROW			row;
+	byte*				out;
+	unsigned int		x;
+	cinfo->out_color_space = JCS_YCbCr;
+	cinfo->do_fancy_upsampling = FALSE;
+	jpeg_start_decompress(cinfo);
+	growBuffer((void**)&rc->row, &rc->rowCapacity, cinfo->output_width * 3);
+	growBuffer((void**)&rc->mosaic, &rc->mosaicCapacity,
+			cinfo->output_width * cinfo->output_height * 2);
+	row = rc->row;
+	while(cinfo->output_scanline < cinfo->output_height)
+	{
+		out = rc->mosaic + cinfo->output_scanline * cinfo->output_width * 2;
+		jpeg_read_scanlines(cinfo, &row, 1);
+		for(x = 0; x + 1 < cinfo->output_width; x += 2, out += 4)
+		{
+			out[0] = rc->row[x * 3];
+			out[1] = rc->row[x * 3 + 1];
+			out[2] = rc->row[x * 3 + 3];
+			out[3] = rc->row[x * 3 + 2];
+		}
+	}
+	jpeg_finish_decompress(cinfo);
+}
+
+// Unpack the change map of a delta frame. FALSE if it does not fit the
+// frame or the mosaic it came with.
+bool readMap(struct reconstructor* rc, const byte* map, size_t len,
+		unsigned int cols, unsigned int rows, unsigned int* mosaicCols,
+		unsigned int* changed)
+{
+	size_t		pos = HMAP_HEADER_LENGTH, used;
+	uint32_t	run, i = 0, j, total = cols * rows;
+	bool		state = FALSE;
+	growBuffer((void**)&rc->changed, &rc->changedCapacity,
+			total * sizeof(bool));
+	*mosaicCols = (map[12] << 8) | map[13];
+	*changed = 0;
+	while(pos < len)
+	{
+		used = readVarint(map + pos, len - pos, &run);
+		if(used == 0 || run > total - i) return FALSE;
+		for(j = 0; j < run; j++) rc->changed[i++] = state;
+		if(state) *changed += run;
+		state = !state;
+		pos += used;
+	}
+	return i == total && *mosaicCols > 0 && *mosaicCols <= cols;
+}
+
+// Paste the MCUs of a decoded mosaic over the frame where the map says they
+// changed, clipped to the frame at its edges
+void pasteBlocks(struct reconstructor* rc, unsigned int cols,
+		unsigned int rows, unsigned int mosaicCols)
+{
+	size_t			stride = rc->det.width * 2;
+	size_t			mosaicStride = mosaicCols * SAD_BLOCK_BYTES;
+	unsigned int	c, r, l, i = 0, width, lines;
+	for(r = 0; r < rows; r++)
+	{
+		for(c = 0; c < cols; c++)
+		{
+			if(!rc->changed[r * cols + c]) continue;
+			width = stride - c * SAD_BLOCK_BYTES;
+			if(width > SAD_BLOCK_BYTES) width = SAD_BLOCK_BYTES;
+			lines = rc->det.height - r * SAD_BLOCK_ROWS;
+			if(lines > SAD_BLOCK_ROWS) lines = SAD_BLOCK_ROWS;
+			for(l = 0; l < lines; l++)
+			{
+				memcpy(rc->frame + (r * SAD_BLOCK_ROWS + l) * stride +
+						c * SAD_BLOCK_BYTES, rc->mosaic + ((i / mosaicCols) *
+						SAD_BLOCK_ROWS + l) * mosaicStride + (i % mosaicCols) *
+						SAD_BLOCK_BYTES, width);
+			}
+			i++;
+		}
+	}
+}
+
+// Take a key frame, or an untagged full frame, as the new picture
+void applyKeyFrame(struct reconstructor* rc, uint32_t sequence)
+{
+	size_t size;
+	decodeYUYV(rc);
+	rc->det.width = rc->cinfo.output_width;
+	rc->det.height = rc->cinfo.output_height;
+	size = rc->det.width * rc->det.height * 2;
+	rc->frame = (byte*)realloc(rc->frame, size);
+	if(rc->frame == NULL) exitWithError("Could not allocate reconstruction.");
+	memcpy(rc->frame, rc->mosaic, size);
+	rc->valid = TRUE;
+	rc->lastSequence = sequence;
+	rc->keyFrames++;
+}
+
+// Apply a delta frame to the picture, if the picture is the one it was made
+// against. Otherwise a frame in between was lost and nothing can be applied
+// until the next key frame. Returns whether the picture changed.
+bool applyDeltaFrame(struct reconstructor* rc, uint32_t sequence)
+{
+	jpeg_saved_marker_ptr	m = findSegment(&rc->cinfo, HMAP_ID,
+			HMAP_HEADER_LENGTH);
+	unsigned int			width, height, cols, rows, mosaicCols, changed;
+	unsigned int			slots;
+	uint32_t				reference;
+	if(m == NULL || !rc->valid) return FALSE;
+	width = (m->data[4] << 8) | m->data[5];
+	height = (m->data[6] << 8) | m->data[7];
+	reference = ((uint32_t)m->data[8] << 24) | (m->data[9] << 16) |
+			(m->data[10] << 8) | m->data[11];
+	if(width != rc->det.width || height != rc->det.height ||
+			reference != rc->lastSequence)
+	{
+		rc->valid = FALSE;
+		return FALSE;
+	}
+	cols = (width + RAW_MCU_WIDTH - 1) / RAW_MCU_WIDTH;
+	rows = (height + SAD_BLOCK_ROWS - 1) / SAD_BLOCK_ROWS;
+	if(!readMap(rc, m->data, m->data_length, cols, rows, &mosaicCols,
+			&changed))
+	{
+		rc->valid = FALSE;
+		return FALSE;
+	}
+	slots = changed > 0 ? changed : 1;
+	if(rc->cinfo.image_width != mosaicCols * RAW_MCU_WIDTH ||
+			rc->cinfo.image_height != (slots + mosaicCols - 1) / mosaicCols *
+			SAD_BLOCK_ROWS)
+	{
+		rc->valid = FALSE;
+		return FALSE;
+	}
+	decodeYUYV(rc);
+	pasteBlocks(rc, cols, rows, mosaicCols);
+	rc->lastSequence = sequence;
+	rc->deltaFrames++;
+	return TRUE;
+}
+
+// Handle one downlinked stream: load tables, or update the picture and write
+// it out
+void reconstructStream(struct reconstructor* rc, const byte* jpg,
+		size_t len, FILE* out)
+{
+	j_decompress_ptr		cinfo = &rc->cinfo;
+	jpeg_saved_marker_ptr	tag;
+	uint8_t					flags = 0;
+	uint32_t				sequence = 0;
+	bool					updated;
+	if(setjmp(rc->err.escape))
+	{
+		jpeg_abort_decompress(cinfo);
+		rc->valid = FALSE;
+		rc->skipped++;
+		return;
+	}
+	jpeg_mem_src(cinfo, jpg, len);
+	if(jpeg_read_header(cinfo, FALSE) == JPEG_HEADER_TABLES_ONLY)
+	{
+		rc->tablesId = tablesStreamId(jpg, len);
+		return;
+	}
+	tag = findSegment(cinfo, HCAM_ID, HCAM_TAG_LENGTH);
+	if(tag != NULL)
+	{
+		flags = tag->data[5];
+		sequence = ((uint32_t)tag->data[7] << 24) | (tag->data[8] << 16) |
+				(tag->data[9] << 8) | tag->data[10];
+		if((flags & HCAM_ABBREVIATED) && tag->data[6] != rc->tablesId)
+		{
+			jpeg_abort_decompress(cinfo); // its tables were lost
+			rc->skipped++;
+			return;
+		}
+	}
+	if(flags & HCAM_DELTA) updated = applyDeltaFrame(rc, sequence);
+	else
+	{
+		applyKeyFrame(rc, sequence);
+		updated = TRUE;
+	}
+	if(!updated)
+	{
+		jpeg_abort_decompress(cinfo);
+		rc->skipped++;
+		return;
+	}
+	if(fwrite(rc->frame, rc->det.width * rc->det.height * 2, 1, out) != 1)
+	{
+		exitWithError("Could not write reconstructed frame.");
+	}
+	rc->written++;
+}
+
+// Read the whole downlink capture into memory
+byte* readCapture(const char* path, size_t* len)
+{
+	FILE*	in = fopen(path, "rb");
+	byte*	data;
+	long	size;
+	if(in == NULL) exitWithError("Could not open downlink capture.");
+	fseek(in, 0, SEEK_END);
+	size = ftell(in);
+	fseek(in, 0, SEEK_SET);
+	data = (byte*)malloc(size > 0 ? size : 1);
+	if(data == NULL) exitWithError("Could not allocate downlink capture.");
+	if(size > 0 && fread(data, size, 1, in) != 1)
+	{
+		exitWithError("Could not read downlink capture.");
+	}
+	fclose(in);
+	*len = size;
+	return data;
+}
+
+// Strip the serial framing from a capture of replies, in place, keeping the
+// image bytes of each packet whose checksum holds; bytes of a damaged packet
+// are dropped and the next one found. A capture that does not start with a
+// packet, such as archive segments joined in index order, is already bare
+// image data and is left alone. Returns the number of packets kept.
+unsigned long deframeCapture(byte* data, size_t* len)
+{
+	struct telpkt	t;
+	size_t			pos = 0, kept = 0, n;
+	unsigned long	packets = 0;
+	if(decodeReply(&t, data, *len) == 0) return 0;
+	while(pos < *len)
+	{
+		n = decodeReply(&t, data + pos, *len - pos);
+		if(n == 0)
+		{
+			pos++; // resynchronise on the next good packet
+			continue;
+		}
+		memmove(data + kept, t.data, t.bytesContained);
+		kept += t.bytesContained;
+		pos += n;
+		packets++;
+	}
+	*len = kept;
+	return packets;
+}
+
+// Rebuild the frames a camera downlinked, as the ground station would,
+// from the bytes received over the serial link. Tables streams are loaded
+// for the abbreviated frames after them, key and untagged frames replace the
+// picture and delta frames paste their changed MCUs over it. Each picture
+// is written out as a raw YUYV frame, so the result replays with -s replay.
+int main(int argc, char *argv[])
+{
+	struct reconstructor	rc;
+	byte*					data;
+	size_t					len, pos = 0, n;
+	unsigned long			packets;
+	FILE*					out;
+	if(argc != 3) exitWithError("usage: recon downlinkCapture yuyvOutput");
+	data = readCapture(argv[1], &len);
+	packets = deframeCapture(data, &len);
+	out = fopen(argv[2], "wb");
+	if(out == NULL) exitWithError("Could not open output.");
+	CLEAR(rc);
+	rc.tablesId = -1;
+	rc.cinfo.err = jpeg_std_error(&rc.err.pub);
+	rc.err.pub.error_exit = reconErrorExit;
+	rc.err.pub.output_message = reconMessage;
+	jpeg_create_decompress(&rc.cinfo);
+	jpeg_save_markers(&rc.cinfo, HCAM_MARKER, 0xFFFF);
+	while(pos + 1 < len)
+	{
+		if(data[pos] != JPEG_MARKER || data[pos + 1] != JPEG_SOI)
+		{
+			pos++; // between streams, resynchronise on the next SOI
+			continue;
+		}
+		n = streamLength(data + pos, len - pos);
+		if(n == 0) // cut off at the end of the capture
+		{
+			rc.skipped++;
+			break;
+		}
+		reconstructStream(&rc, data + pos, n, out);
+		pos += n;
+	}
+	if(packets > 0) printf("Packets read: %lu\n", packets);
+	printf("Frames written: %lu (%lu key, %lu delta), streams skipped: %lu\n",
+			rc.written, rc.keyFrames, rc.deltaFrames, rc.skipped);
+	if(rc.written > 0)
+	{
+		printf("Frame size: %ux%u\n", rc.det.width, rc.det.height);
+	}
+	jpeg_destroy_decompress(&rc.cinfo);
+	fclose(out);
+	free(data);
+	free(rc.frame);
+	free(rc.mosaic);
+	free(rc.row);
+	free(rc.changed);
+	return 0;
+}
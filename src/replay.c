@@ -0,0 +1,166 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Replay of recorded raw frames from a memory-mapped file.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#include "../headers/frmsrc.h"
+
+// Replay frames straight out of the mapping. Nothing is copied; a frame
+// points into the page cache until the consumer releases it.
+bool nextReplayFrame(struct frameSource* src, struct frame* frm)
+{
+	if(!takeBuffer(src)) return FALSE;
+	waitForDeadline(src);
+	frm->index = src->sequence % src->nframes; // loop back to the first frame
+	frm->data = src->frames[frm->index].start;
+	frm->bytesused = src->frames[frm->index].length;
+	frm->sequence = src->sequence++;
+	stampFrame(frm);
+	trackSequence(&src->stats, frm->sequence);
+	return TRUE;
+}
+
+void releaseReplayFrame(struct frameSource* src, struct frame* frm)
+{
+	giveBuffer(src);
+}
+
+void closeReplaySource(struct frameSource* src)
+{
+	munmap(src->bufs[0].start, src->bufs[0].length);
+	close(src->fd);
+	free(src->frames);
+	free(src->bufs);
+	sem_destroy(&src->freeBuffers);
+}
+
+// Index a file of fixed size raw frames
+void indexRawFrames(struct frameSource* src)
+{
+	unsigned int i;
+	src->nframes = src->bufs[0].length / src->frameBytes;
+	if(src->nframes == 0) exitWithError("Replay file holds no whole frames.");
+	src->frames = (struct buffer*)calloc(src->nframes, sizeof(struct buffer));
+	if(src->frames == NULL) exitWithError("Could not allocate replay index.");
+	for(i = 0; i < src->nframes; i++)
+	{
+		src->frames[i].start = src->bufs[0].start + i * src->frameBytes;
+		src->frames[i].length = src->frameBytes;
+	}
+}
+
+// Index a file of back to back JPEG images, such as a recorded MJPEG stream,
+// by finding each start of image marker and the end of image marker after
+// it. Entropy-coded data never holds 0xFF 0xD9 because 0xFF is stuffed.
+void indexJpegFrames(struct frameSource* src)
+{
+	byte*			data = src->bufs[0].start;
+	size_t			len = src->bufs[0].length, i, soi = 0;
+	unsigned int	capacity = 64;
+	bool			inImage = FALSE;
+	src->frames = (struct buffer*)malloc(capacity * sizeof(struct buffer));
+	if(src->frames == NULL) exitWithError("Could not allocate replay index.");
+	for(i = 0; i + 1 < len; i++)
+	{
+		if(data[i] != 0xFF) continue;
+		if(!inImage && data[i + 1] == 0xD8)
+		{
+			soi = i;
+			inImage = TRUE;
+		}
+		else if(inImage && data[i + 1] == 0xD9)
+		{
+			if(src->nframes == capacity)
+			{
+				capacity *= 2;
+				src->frames = (struct buffer*)realloc(src->frames,
+						capacity * sizeof(struct buffer));
+				if(src->frames == NULL)
+				{
+					exitWithError("Could not allocate replay index.");
+				}
+			}
+			src->frames[src->nframes].start = data + soi;
+			src->frames[src->nframes].length = i + 2 - soi;
+			src->nframes++;
+			inImage = FALSE;
+		}
+	}
+	if(src->nframes == 0) exitWithError("Replay file holds no JPEG frames.");
+}
+
+// Map a file of back to back raw YUYV frames recorded at the configured
+// resolution, or of back to back JPEGs when MJPEG is asked for. The file is
+// replayed in a loop, either paced at fps or as fast as the consumer can
+// take frames.
+void openReplaySource(struct frameSource* src, const struct srcConfig* cfg)
+{
+	struct stat st;
+	if(cfg->pixelformat != V4L2_PIX_FMT_MJPEG &&
+			(cfg->width == 0 || cfg->height == 0))
+	{
+		exitWithError("Replay source needs a resolution (-r WxH).");
+	}
+	src->det.width = cfg->width;
+	src->det.height = cfg->height;
+	src->det.size = src->det.width * src->det.height * 3;
+	src->frameBytes = src->det.width * src->det.height * 2;
+	src->fd = open(cfg->location, O_RDONLY);
+	if(src->fd == -1) exitWithError(cfg->location);
+	if(fstat(src->fd, &st) == -1) exitWithError(cfg->location);
+	if(st.st_size == 0) exitWithError("Replay file is empty.");
+	src->nbuffers = 1;
+	src->bufs = (struct buffer*)calloc(1, sizeof(struct buffer));
+	if(src->bufs == NULL) exitWithError("Could not allocate replay buffer.");
+	src->bufs[0].length = st.st_size;
+	src->bufs[0].start = (byte*)mmap(NULL, src->bufs[0].length, PROT_READ,
+			MAP_PRIVATE | MAP_POPULATE, src->fd, 0);
+	if(src->bufs[0].start == MAP_FAILED) exitWithError("Replay mmap failed.");
+	madvise(src->bufs[0].start, src->bufs[0].length, MADV_WILLNEED);
+	src->pixelformat = cfg->pixelformat == V4L2_PIX_FMT_MJPEG ?
+			V4L2_PIX_FMT_MJPEG : V4L2_PIX_FMT_YUYV;
+	if(src->pixelformat == V4L2_PIX_FMT_MJPEG) indexJpegFrames(src);
+	else indexRawFrames(src);
+	initBuffers(src, cfg->nbuffers);
+	src->next = nextReplayFrame;
+	src->release = releaseReplayFrame;
+	src->close = closeReplaySource;
+	initPacing(src, cfg);
+	printf("Replaying %u frames from %s\n", src->nframes, cfg->location);
+}
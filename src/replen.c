@@ -0,0 +1,314 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Conditional replenishment: only the blocks of a frame that changed.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+
+#include "../headers/replen.h"
+
+void initReplenisher(struct replenisher* rp, unsigned int keyInterval,
+		unsigned int threshold, enum encodeMode keyMode)
+{
+	memset(rp, 0, sizeof(struct replenisher));
+	rp->keyInterval = keyInterval;
+	rp->threshold = threshold;
+	rp->keyMode = keyMode;
+}
+
+// Size the buffers for a frame geometry. A new geometry needs a key frame.
+void setReplenGeometry(struct replenisher* rp, struct imgDetails det)
+{
+	if(rp->reference != NULL && rp->det.width == det.width &&
+			rp->det.height == det.height)
+	{
+		return;
+	}
+	freeReplenisher(rp);
+	rp->det = det;
+	rp->cols = (det.width + RAW_MCU_WIDTH - 1) / RAW_MCU_WIDTH;
+	rp->rows = (det.height + SAD_BLOCK_ROWS - 1) / SAD_BLOCK_ROWS;
+	rp->reference = (byte*)malloc(det.width * det.height * 2);
+	rp->changed = (bool*)malloc(rp->cols * rp->rows * sizeof(bool));
+	rp->mosaic = (byte*)malloc(rp->cols * rp->rows * SAD_BLOCK_BYTES *
+			SAD_BLOCK_ROWS);
+	rp->map = (byte*)malloc(HMAP_MAX_LENGTH);
+	if(rp->reference == NULL || rp->changed == NULL || rp->mosaic == NULL ||
+			rp->map == NULL)
+	{
+		exitWithError("Could not allocate replenishment buffers.");
+	}
+	rp->primed = FALSE;
+}
+
+// Bytes across and lines down of an MCU that the frame covers, fewer than a
+// whole MCU on the right and bottom edges
+void blockExtent(const struct replenisher* rp, unsigned int c,
+		unsigned int r, unsigned int* width, unsigned int* lines)
+{
+	unsigned int stride = rp->det.width * 2;
+	*width = stride - c * SAD_BLOCK_BYTES;
+	if(*width > SAD_BLOCK_BYTES) *width = SAD_BLOCK_BYTES;
+	*lines = rp->det.height - r * SAD_BLOCK_ROWS;
+	if(*lines > SAD_BLOCK_ROWS) *lines = SAD_BLOCK_ROWS;
+}
+
+// Whether an MCU differs from the reference by more than the threshold on
+// average over the samples of any one of its rows. Whole MCUs go through
+// the SIMD kernel.
+bool blockChanged(const struct replenisher* rp, const byte* yuyv,
+		unsigned int c, unsigned int r)
+{
+	size_t			stride = rp->det.width * 2;
+	size_t			at = r * SAD_BLOCK_ROWS * stride + c * SAD_BLOCK_BYTES;
+	unsigned int	width, lines;
+	uint32_t		sad;
+	blockExtent(rp, c, r, &width, &lines);
+	if(width == SAD_BLOCK_BYTES && lines == SAD_BLOCK_ROWS)
+	{
+		sad = convertKernel.sad(yuyv + at, rp->reference + at, stride);
+	}
+	else
+	{
+		sad = sadYUYVClipped(yuyv + at, rp->reference + at, stride, width,
+				lines);
+	}
+	return sad > rp->threshold * width;
+}
+
+// Copy an MCU of the frame into a mosaic slot, repeating the last pixel
+// pair and line of an edge MCU to fill the slot
+void packBlock(const struct replenisher* rp, const byte* yuyv,
+		unsigned int c, unsigned int r, byte* slot, size_t mosaicStride)
+{
+	size_t			stride = rp->det.width * 2;
+	const byte*		line;
+	unsigned int	width, lines, l, i;
+	blockExtent(rp, c, r, &width, &lines);
+	for(l = 0; l < SAD_BLOCK_ROWS; l++, slot += mosaicStride)
+	{
+		line = yuyv + (r * SAD_BLOCK_ROWS + (l < lines ? l : lines - 1)) *
+				stride + c * SAD_BLOCK_BYTES;
+		memcpy(slot, line, width);
+		for(i = width; i < SAD_BLOCK_BYTES; i += 4)
+		{
+			memcpy(slot + i, line + width - 4, 4);
+		}
+	}
+}
+
+// Record an MCU as sent, so the reference matches the ground station
+void updateReference(struct replenisher* rp, const byte* yuyv,
+		unsigned int c, unsigned int r)
+{
+	size_t			stride = rp->det.width * 2;
+	size_t			at = r * SAD_BLOCK_ROWS * stride + c * SAD_BLOCK_BYTES;
+	unsigned int	width, lines, l;
+	blockExtent(rp, c, r, &width, &lines);
+	for(l = 0; l < lines; l++, at += stride)
+	{
+		memcpy(rp->reference + at, yuyv + at, width);
+	}
+}
+
+// Append an unsigned LEB128 varint, returning the new length
+size_t writeVarint(byte* p, size_t len, uint32_t value)
+{
+	while(value >= 0x80)
+	{
+		p[len++] = (byte)(value | 0x80);
+		value >>= 7;
+	}
+	p[len++] = (byte)value;
+	return len;
+}
+
+// Read an unsigned LEB128 varint, returning the bytes it took or 0 if it
+// runs past the end
+size_t readVarint(const byte* p, size_t len, uint32_t* value)
+{
+	size_t			i;
+	unsigned int	shift = 0;
+	*value = 0;
+	for(i = 0; i < len && shift < 32; i++, shift += 7)
+	{
+		*value |= (uint32_t)(p[i] & 0x7F) << shift;
+		if((p[i] & 0x80) == 0) return i + 1;
+	}
+	return 0;
+}
+
+// Write the HMAP segment body for the changed MCUs. Returns its length, or
+// 0 if the runs would not fit in a marker segment.
+size_t buildMap(struct replenisher* rp, unsigned int mosaicCols)
+{
+	unsigned int	i, run = 0, total = rp->cols * rp->rows;
+	bool			state = FALSE;
+	size_t			len = HMAP_HEADER_LENGTH;
+	uint32_t		ref = rp->lastSequence;
+	memcpy(rp->map, HMAP_ID, 4);
+	rp->map[4] = (byte)(rp->det.width >> 8);
+	rp->map[5] = (byte)rp->det.width;
+	rp->map[6] = (byte)(rp->det.height >> 8);
+	rp->map[7] = (byte)rp->det.height;
+	rp->map[8] = (byte)(ref >> 24);
+	rp->map[9] = (byte)(ref >> 16);
+	rp->map[10] = (byte)(ref >> 8);
+	rp->map[11] = (byte)ref;
+	rp->map[12] = (byte)(mosaicCols >> 8);
+	rp->map[13] = (byte)mosaicCols;
+	for(i = 0; i <= total; i++)
+	{
+		if(i == total || rp->changed[i] != state)
+		{
+			if(len + 5 > HMAP_MAX_LENGTH) return 0; // a varint takes 5 at most
+			len = writeVarint(rp->map, len, run);
+			state = !state;
+			run = 0;
+		}
+		run++;
+	}
+	return len;
+}
+
+// Send the whole frame and make it the reference
+void keyFrame(struct replenisher* rp, const byte* yuyv,
+		struct replenFrame* out)
+{
+	memcpy(rp->reference, yuyv, rp->det.width * rp->det.height * 2);
+	rp->primed = TRUE;
+	rp->sinceKey = 0;
+	rp->keyFrames++;
+	out->yuyv = yuyv;
+	out->det = rp->det;
+	out->mode = rp->keyMode;
+	out->flags = HCAM_KEY;
+	out->map = NULL;
+	out->mapLength = 0;
+	out->blocks = rp->cols * rp->rows;
+}
+
+// Decide what to send for a frame, a key frame or a delta against the
+// previous one, and describe it in out. The mosaic of a delta frame packs
+// the changed MCUs in raster order, as many across as the frame has, and
+// is encoded at 4:2:2 so each MCU of the mosaic is exactly one of the
+// frame's; unused slots are flat grey. A frame with nothing changed still
+// sends one slot, so the ground station sees the sequence move on. Frames
+// where every MCU changed, or whose map would be too long, go as key frames.
+void replenish(struct replenisher* rp, const byte* yuyv,
+		struct imgDetails det, uint32_t sequence, struct replenFrame* out)
+{
+	unsigned int	c, r, i, n = 0, slots, mosaicCols, mosaicRows;
+	unsigned int	total;
+	size_t			mosaicStride;
+	setReplenGeometry(rp, det);
+	total = rp->cols * rp->rows;
+	rp->blocksTotal += total;
+	if(!rp->primed || ++rp->sinceKey >= rp->keyInterval)
+	{
+		keyFrame(rp, yuyv, out);
+		rp->blocksSent += total;
+		rp->lastSequence = sequence;
+		return;
+	}
+	for(r = 0, i = 0; r < rp->rows; r++)
+	{
+		for(c = 0; c < rp->cols; c++, i++)
+		{
+			rp->changed[i] = blockChanged(rp, yuyv, c, r);
+			if(rp->changed[i]) n++;
+		}
+	}
+	slots = n > 0 ? n : 1;
+	mosaicCols = slots < rp->cols ? slots : rp->cols;
+	mosaicRows = (slots + mosaicCols - 1) / mosaicCols;
+	out->mapLength = n < total ? buildMap(rp, mosaicCols) : 0;
+	if(out->mapLength == 0)
+	{
+		keyFrame(rp, yuyv, out);
+		rp->blocksSent += total;
+		rp->lastSequence = sequence;
+		return;
+	}
+	mosaicStride = mosaicCols * SAD_BLOCK_BYTES;
+	for(i = 0; i < mosaicCols * mosaicRows; i++) // grey for the unused slots
+	{
+		if(i < n) continue;
+		for(r = 0; r < SAD_BLOCK_ROWS; r++)
+		{
+			memset(rp->mosaic + ((i / mosaicCols) * SAD_BLOCK_ROWS + r) *
+					mosaicStride + (i % mosaicCols) * SAD_BLOCK_BYTES, 128,
+					SAD_BLOCK_BYTES);
+		}
+	}
+	for(r = 0, i = 0; r < rp->rows; r++)
+	{
+		for(c = 0; c < rp->cols; c++)
+		{
+			if(!rp->changed[r * rp->cols + c]) continue;
+			packBlock(rp, yuyv, c, r, rp->mosaic + (i / mosaicCols) *
+					SAD_BLOCK_ROWS * mosaicStride + (i % mosaicCols) *
+					SAD_BLOCK_BYTES, mosaicStride);
+			updateReference(rp, yuyv, c, r);
+			i++;
+		}
+	}
+	rp->deltaFrames++;
+	rp->blocksSent += n;
+	rp->lastSequence = sequence;
+	out->yuyv = rp->mosaic;
+	out->det.width = mosaicCols * RAW_MCU_WIDTH;
+	out->det.height = mosaicRows * SAD_BLOCK_ROWS;
+	out->det.size = out->det.width * out->det.height * 3;
+	out->mode = rp->keyMode == ENC_YUV444 ? ENC_RAW422 : rp->keyMode;
+	out->flags = HCAM_DELTA;
+	out->map = rp->map;
+	out->blocks = n;
+}
+
+void freeReplenisher(struct replenisher* rp)
+{
+	free(rp->reference);
+	free(rp->changed);
+	free(rp->mosaic);
+	free(rp->map);
+	rp->reference = NULL;
+	rp->changed = NULL;
+	rp->mosaic = NULL;
+	rp->map = NULL;
+}
@@ -44,27 +44,27 @@
 
 #include "../headers/sercom.h"
 
-int openPortFd() {
+int openPortFd(const char* device) {
 	int		comFd;
 	/*
 	 Open modem device for reading and writing and not as controlling tty
 	 because we don't want to get killed if linenoise sends CTRL-C.
 	 */
-	comFd = open(MODEMDEVICE, O_RDWR | O_NOCTTY);
+	comFd = open(device, O_RDWR | O_NOCTTY);
 	if (comFd < 0) {
-		perror(MODEMDEVICE);
+		perror(device);
 		exit(-1);
 	}
 	return comFd;
 }
 
-int openPort()
+int openPort(const char* device)
 {
 	int 	fd;					// the file descriptor for the serial port file
 	struct 	termios tio, oldtio;		// struct for serial-coms
 	// Open modem device for reading and writing and not as controlling tty
 	// because we don't want to get killed if linenoise sends CTRL-C.
-	fd = openPortFd();
+	fd = openPortFd(device);
 	//memset(&tio, 0, sizeof(tio)); // clear struct for new port settings
     tcgetattr(fd,&oldtio); /* save current port settings */
     bzero(&tio, sizeof(tio));
@@ -101,26 +101,23 @@ byte calcXor(byte* data, int size)
 	return output;
 }
 
+// Frame the data already in place after the header of the output buffer
 void encode(struct telpkt* t)
 {
 	unsigned int	outputSize;
-	outputSize = 6 + t->bytesContained;
-	byte* output = (byte*)calloc(outputSize, 1); // alloc memory for output stream
-	byte* outputStart = output; // create ptr to start of output stream
+	outputSize = TELEMETRY_OVERHEAD + t->bytesContained;
+	byte* output = t->outputStart; // create ptr to start of output stream
 	output[0] = 0xAA; // as per standard, set first byte to 0x00
 	output[1] = (t->bytesRequested >> 8) & 0xFF;
 	output[2] = t->bytesRequested & 0xFF;
 	output[3] = (t->bytesContained >> 8) & 0xFF;
 	output[4] = t->bytesContained & 0xFF;
-	output += 5;
-	// Copy the data to the output
-	memcpy(output, t->data, t->bytesContained);
-	// Move the output by the number of bytes in the data
-	output += t->bytesContained;
+	// Move the output past the header and the data
+	output += 5 + t->bytesContained;
 	// For everything in the output so far, XOR
-	t->xor = calcXor(outputStart, outputSize - 1); // add checksum to the end
+	t->xor = calcXor(t->outputStart, outputSize - 1); // add checksum to the end
 	*output = t->xor;
-	t->output = outputStart; // set the pointer to the output data
+	t->output = t->outputStart; // set the pointer to the output data
 	t->outputSize = outputSize; // set the size of the output data
 }
 
@@ -134,10 +131,8 @@ void encode(struct telpkt* t)
 // 0xFF is a bit mask, probably just being safe as AFAIK c fills other
 // bits with 0
 
-struct telpkt* decode(byte inputStream[6], unsigned int inputSize)
+void decode(struct telpkt* t, byte inputStream[6], unsigned int inputSize)
 {
-	struct telpkt* t = (struct telpkt*)malloc(sizeof(struct
-			telpkt)); // create telemetry packet
 	byte req[2];
 	if(inputStream[0] == 0xAA && calcXor(inputStream, inputSize) ==
 			inputStream[5]) // if inputstream is valid
@@ -153,33 +148,39 @@ struct telpkt* decode(byte inputStream[6], unsigned int inputSize)
 		// Error case - set no bytes requested so doesn't try to decode garbage
 		t->bytesRequested = 0;
 	}
-	return t;
 }
 
-void cleanUp(struct telpkt* t)
+// Check a reply packet at the start of size bytes of input, as the ground
+// station does: set t's counts and point its data at the image bytes.
+// Returns the length of the packet, or 0 when no whole packet with a good
+// checksum starts there.
+size_t decodeReply(struct telpkt* t, byte* input, size_t size)
 {
-	free(t->output);
-	free(t);
-}
-
-// Create a new telemetry stream packet with the set bytes requested and
-// bytes contained values
-struct telpkt* getTp(int16_t req, int16_t con)
-{
-	struct telpkt* tp = (struct telpkt*)malloc(sizeof(struct telpkt));
-	tp->bytesRequested = req;
-	return tp;
+	unsigned int	contained;
+	if(size < TELEMETRY_OVERHEAD || input[0] != TELEMETRY_HEADER) return 0;
+	contained = (input[3] << 8) | input[4];
+	if(size < TELEMETRY_OVERHEAD + contained ||
+			calcXor(input, 5 + contained) != input[5 + contained])
+	{
+		return 0;
+	}
+	t->bytesRequested = (input[1] << 8) | input[2];
+	t->bytesContained = contained;
+	t->data = input + 5;
+	t->xor = input[5 + contained];
+	return TELEMETRY_OVERHEAD + contained;
 }
 
-// Creates a new telemetry stream packet with memory allocated for output image
-// data
-struct telpkt* createOutputTelPkt(uint16_t bRequested, uint16_t bContained)
+// Sets up a telemetry stream packet in an output buffer of at least
+// TELEMETRY_MAX_BYTES; the caller copies bContained bytes of image data to
+// t->data
+void initOutputTelPkt(struct telpkt* t, byte* output, uint16_t bRequested,
+		uint16_t bContained)
 {
-	struct telpkt* t = (struct telpkt*) malloc(sizeof(struct telpkt));
 	t->bytesRequested = bRequested;
 	t->bytesContained = bContained;
-	t->data = (byte*) malloc(bContained);
-	return t;
+	t->outputStart = output;
+	t->data = output + 5;
 }
 
 // Writes data to the serial port
@@ -188,6 +189,4 @@ void writeToUart(struct telpkt* t, int fd)
 	encode(t); // encode the telemetry packet
 	write(fd, t->output, t->outputSize); // write encoded data to the serial
 	fsync(fd); // flush buffer
-	free(t->data); // free the data
-	cleanUp(t); // cleanup the packet
 }
@@ -0,0 +1,273 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Intra-frame parallel JPEG encoding in restart interval stripes.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#include "../headers/stripe.h"
+
+#define JPEG_MARKER		0xFF
+#define JPEG_SOI		0xD8
+#define JPEG_EOI		0xD9
+#define JPEG_SOS		0xDA
+#define JPEG_DHT		0xC4
+#define JPEG_JPG		0xC8
+#define JPEG_DAC		0xCC
+#define JPEG_RST0		0xD0
+
+// Lines in one MCU row. ENC_RAW422 and ENC_DIRECT422 use 2x1 luma sampling;
+// ENC_YUV444 keeps libjpeg's default 2x2.
+unsigned int mcuRowHeight(enum encodeMode mode)
+{
+	return mode == ENC_YUV444 ? 2 * DCTSIZE : DCTSIZE;
+}
+
+// Split a frame into stripes of whole MCU rows, as even as they can be.
+// Each stripe's restart interval is its own MCU count, so the restart
+// markers put in when stitching fall exactly where the stripes meet.
+unsigned int planStripes(struct stripeEncoder* se, struct imgDetails det,
+		enum encodeMode mode)
+{
+	unsigned int i, mcuHeight = mcuRowHeight(mode);
+	unsigned int mcuRows = (det.height + mcuHeight - 1) / mcuHeight;
+	unsigned int mcuCols = (det.width + RAW_MCU_WIDTH - 1) / RAW_MCU_WIDTH;
+	unsigned int perStripe = (mcuRows + se->nstripes - 1) / se->nstripes;
+	unsigned int n = 0, row = 0;
+	if(perStripe * mcuCols > 65535) // DRI holds 16 bits
+	{
+		perStripe = 65535 / mcuCols;
+	}
+	for(i = 0; i < se->nstripes && row < det.height; i++)
+	{
+		se->tasks[i].firstRow = row;
+		se->tasks[i].det.width = det.width;
+		se->tasks[i].det.height = perStripe * mcuHeight;
+		if(row + se->tasks[i].det.height > det.height)
+		{
+			se->tasks[i].det.height = det.height - row;
+		}
+		se->tasks[i].det.size = det.width * se->tasks[i].det.height * 3;
+		se->tasks[i].restartInterval = perStripe * mcuCols;
+		row += se->tasks[i].det.height;
+		n++;
+	}
+	if(row < det.height)
+	{
+		exitWithError("Frame too large for restart interval stripes.");
+	}
+	return n;
+}
+
+// Encode one stripe as a standalone JPEG. Its restart interval covers the
+// whole stripe, so libjpeg writes a DRI segment but no RST markers, and the
+// DC predictions start from zero as they do after a restart. An arithmetic
+// coder is likewise flushed at the end of the stripe and starts with fresh
+// statistics, just as it would at a restart marker.
+void encodeStripe(struct stripeEncoder* se, struct stripeTask* task)
+{
+	task->enc.abbreviated = se->abbreviated;
+	task->enc.arithmetic = se->arithmetic;
+	task->enc.sequence = se->sequence;
+	task->enc.flags = se->flags;
+	task->enc.map = task == &se->tasks[0] ? se->map : NULL; // headers kept
+	task->enc.mapLength = se->mapLength;
+	configureEncoder(&task->enc, task->det, se->quality, se->mode);
+	task->enc.cinfo.restart_interval = task->restartInterval;
+	task->size = encodeFrame(&task->enc, se->yuyv +
+			task->firstRow * task->det.width * 2, &task->out, &task->capacity);
+}
+
+// Helper thread for one stripe. Stripe 0 is encoded by the calling thread.
+void* stripeWorker(void* args)
+{
+	struct stripeTask*		task = (struct stripeTask*)args;
+	struct stripeEncoder*	se = task->owner;
+	unsigned int			seen = 0;
+	pthread_mutex_lock(&se->lock);
+	while(TRUE)
+	{
+		while(se->generation == seen && !se->stopping)
+		{
+			pthread_cond_wait(&se->start, &se->lock);
+		}
+		if(se->stopping) break;
+		seen = se->generation;
+		if(task->det.height > 0) // stripe in use for this frame
+		{
+			pthread_mutex_unlock(&se->lock);
+			encodeStripe(se, task);
+			pthread_mutex_lock(&se->lock);
+			se->pending--;
+			pthread_cond_signal(&se->done);
+		}
+	}
+	pthread_mutex_unlock(&se->lock);
+	pthread_exit(NULL);
+}
+
+// Find where the entropy coded data starts, just after the SOS segment, and
+// where the SOF segment holding the frame height is
+size_t findScanData(const byte* jpg, size_t len, size_t* sof)
+{
+	size_t	pos = 2; // past SOI
+	byte	marker;
+	if(len < 4 || jpg[0] != JPEG_MARKER || jpg[1] != JPEG_SOI)
+	{
+		exitWithError("Stripe is not a JPEG.");
+	}
+	while(pos + 4 <= len)
+	{
+		if(jpg[pos] != JPEG_MARKER) exitWithError("Stripe marker missing.");
+		marker = jpg[pos + 1];
+		if(marker >= 0xC0 && marker <= 0xCF && marker != JPEG_DHT &&
+				marker != JPEG_JPG && marker != JPEG_DAC)
+		{
+			*sof = pos;
+		}
+		pos += 2 + ((jpg[pos + 2] << 8) | jpg[pos + 3]);
+		if(marker == JPEG_SOS) return pos;
+	}
+	exitWithError("Stripe has no scan.");
+	return 0;
+}
+
+// Stitch the stripes into one JPEG: the headers of stripe 0 with its height
+// set to the whole frame, then each stripe's entropy coded segment with
+// RST0..RST7 in turn between them, then EOI
+size_t stitchStripes(struct stripeEncoder* se, unsigned int n,
+		struct imgDetails det, byte** buf, size_t* capacity)
+{
+	unsigned int	i;
+	size_t			sof = 0, start, len, size, total = 0;
+	for(i = 0; i < n; i++) total += se->tasks[i].size + 2;
+	reserveImage(buf, capacity, total);
+	start = findScanData(se->tasks[0].out, se->tasks[0].size, &sof);
+	size = se->tasks[0].size - 2; // drop EOI
+	memcpy(*buf, se->tasks[0].out, size);
+	(*buf)[sof + 5] = (byte)(det.height >> 8);
+	(*buf)[sof + 6] = (byte)(det.height & 0xFF);
+	for(i = 1; i < n; i++)
+	{
+		start = findScanData(se->tasks[i].out, se->tasks[i].size, &sof);
+		len = se->tasks[i].size - 2 - start;
+		(*buf)[size++] = JPEG_MARKER;
+		(*buf)[size++] = JPEG_RST0 + ((i - 1) & 7);
+		memcpy(*buf + size, se->tasks[i].out + start, len);
+		size += len;
+	}
+	(*buf)[size++] = JPEG_MARKER;
+	(*buf)[size++] = JPEG_EOI;
+	return size;
+}
+
+// Start the helper threads, one per stripe after the first
+void initStripeEncoder(struct stripeEncoder* se, unsigned int nstripes)
+{
+	unsigned int i;
+	memset(se, 0, sizeof(struct stripeEncoder));
+	if(nstripes < 1) nstripes = 1;
+	if(nstripes > MAX_STRIPES) nstripes = MAX_STRIPES;
+	se->nstripes = nstripes;
+	pthread_mutex_init(&se->lock, NULL);
+	pthread_cond_init(&se->start, NULL);
+	pthread_cond_init(&se->done, NULL);
+	for(i = 0; i < nstripes; i++)
+	{
+		se->tasks[i].owner = se;
+		initEncoder(&se->tasks[i].enc);
+	}
+	for(i = 1; i < nstripes; i++)
+	{
+		if(pthread_create(&se->threads[i], NULL, stripeWorker,
+				&se->tasks[i]) != 0)
+		{
+			exitWithError("Could not start stripe worker.");
+		}
+	}
+}
+
+// Encode a YUYV frame as restart interval stripes in parallel and stitch
+// them into one baseline JPEG in *buf, grown as needed. Returns its length.
+// Huffman coded stripes must share tables, which holds as long as libjpeg
+// uses its standard ones rather than optimising them per image.
+size_t encodeStriped(struct stripeEncoder* se, const byte* yuyv,
+		struct imgDetails det, unsigned int cfactor, enum encodeMode mode,
+		byte** buf, size_t* capacity)
+{
+	unsigned int i, n;
+	pthread_mutex_lock(&se->lock);
+	n = planStripes(se, det, mode);
+	for(i = n; i < se->nstripes; i++) se->tasks[i].det.height = 0;
+	se->yuyv = yuyv;
+	se->quality = cfactor;
+	se->mode = mode;
+	se->pending = n - 1;
+	se->generation++;
+	pthread_cond_broadcast(&se->start);
+	pthread_mutex_unlock(&se->lock);
+	encodeStripe(se, &se->tasks[0]);
+	pthread_mutex_lock(&se->lock);
+	while(se->pending > 0) pthread_cond_wait(&se->done, &se->lock);
+	pthread_mutex_unlock(&se->lock);
+	if(n == 1) // nothing to stitch
+	{
+		reserveImage(buf, capacity, se->tasks[0].size);
+		memcpy(*buf, se->tasks[0].out, se->tasks[0].size);
+		return se->tasks[0].size;
+	}
+	return stitchStripes(se, n, det, buf, capacity);
+}
+
+// Stop the helper threads and free the stripe encoders
+void destroyStripeEncoder(struct stripeEncoder* se)
+{
+	unsigned int i;
+	pthread_mutex_lock(&se->lock);
+	se->stopping = TRUE;
+	pthread_cond_broadcast(&se->start);
+	pthread_mutex_unlock(&se->lock);
+	for(i = 1; i < se->nstripes; i++) pthread_join(se->threads[i], NULL);
+	for(i = 0; i < se->nstripes; i++)
+	{
+		destroyEncoder(&se->tasks[i].enc);
+		releaseImage(se->tasks[i].out);
+	}
+	pthread_mutex_destroy(&se->lock);
+	pthread_cond_destroy(&se->start);
+	pthread_cond_destroy(&se->done);
+}
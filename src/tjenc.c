@@ -0,0 +1,156 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// TurboJPEG encoder backend compressing from YUV planes.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+
+#include "../headers/tjenc.h"
+
+#ifdef HAVE_TURBOJPEG
+
+#include <turbojpeg.h>
+
+// Set the backend up for a frame geometry: a compressor handle kept for the
+// life of the encoder, whole frame planes to split YUYV frames into, and
+// the worst case JPEG size to reserve for each frame
+void configureTurbo(struct jpegEncoder* enc, struct imgDetails det)
+{
+	if(enc->turbo == NULL)
+	{
+		enc->turbo = tjInitCompress();
+		if(enc->turbo == NULL) exitWithError("Could not start TurboJPEG.");
+	}
+	if(det.width * det.height * 2 > enc->frameBytes) // kept for smaller ones
+	{
+		free(enc->frame);
+		enc->frame = (byte*)malloc(det.width * det.height * 2);
+		if(enc->frame == NULL) exitWithError("Could not allocate YUV planes.");
+		enc->frameBytes = det.width * det.height * 2;
+	}
+	enc->turboSize = tjBufSize(det.width, det.height, TJSAMP_422);
+}
+
+// Compress a YUYV frame with tjCompressFromYUVPlanes() straight into *buf,
+// which is grown to tjBufSize() first so TurboJPEG never has to reallocate
+// it. TurboJPEG cannot write markers, so the frame is compressed far enough
+// into the buffer for the HCAM tag and map of a replenishment frame to go
+// in after its SOI without moving it. Returns the length.
+size_t encodeTurbo(struct jpegEncoder* enc, const byte* yuyv, byte** buf,
+		size_t* capacity)
+{
+	unsigned int			r, pairs = enc->det.width / 2;
+	size_t					room = 0;
+	const unsigned char*	planes[3];
+	int						strides[3] = {enc->det.width, pairs, pairs};
+	unsigned char*			out;
+	unsigned long			size = 0;
+	struct frameTag			ft;
+	byte*					p;
+	planes[0] = enc->frame;
+	planes[1] = enc->frame + enc->det.width * enc->det.height;
+	planes[2] = planes[1] + pairs * enc->det.height;
+	for(r = 0; r < enc->det.height; r++)
+	{
+		convertKernel.split(yuyv + r * enc->det.width * 2,
+				(byte*)planes[0] + r * strides[0],
+				(byte*)planes[1] + r * pairs, (byte*)planes[2] + r * pairs,
+				pairs);
+	}
+	if(enc->flags != 0) room = 4 + HCAM_TAG_LENGTH;
+	if(enc->map != NULL) room += 4 + enc->mapLength;
+	reserveImage(buf, capacity, enc->turboSize + room);
+	out = *buf + room;
+	size = enc->turboSize;
+	if(tjCompressFromYUVPlanes(enc->turbo, planes, enc->det.width, strides,
+			enc->det.height, TJSAMP_422, &out, &size, enc->quality,
+			TJFLAG_NOREALLOC) != 0)
+	{
+		exitWithError(tjGetErrorStr2(enc->turbo));
+	}
+	p = *buf + 2; // the SOI moves up to the front, its old place is covered
+	if(enc->flags != 0)
+	{
+		*p++ = 0xFF;
+		*p++ = HCAM_MARKER;
+		*p++ = 0;
+		*p++ = 2 + HCAM_TAG_LENGTH;
+		ft.flags = enc->flags;
+		ft.tablesId = 0;
+		ft.sequence = enc->sequence;
+		packFrameTag(p, &ft);
+		p += HCAM_TAG_LENGTH;
+	}
+	if(enc->map != NULL)
+	{
+		*p++ = 0xFF;
+		*p++ = HCAM_MARKER;
+		*p++ = (byte)((2 + enc->mapLength) >> 8);
+		*p++ = (byte)(2 + enc->mapLength);
+		memcpy(p, enc->map, enc->mapLength);
+	}
+	(*buf)[0] = 0xFF;
+	(*buf)[1] = 0xD8;
+	return size + room;
+}
+
+void destroyTurbo(struct jpegEncoder* enc)
+{
+	if(enc->turbo != NULL) tjDestroy(enc->turbo);
+	enc->turbo = NULL;
+}
+
+#else
+
+void configureTurbo(struct jpegEncoder* enc, struct imgDetails det)
+{
+	exitWithError("Built without TurboJPEG, make with TURBOJPEG=1.");
+}
+
+size_t encodeTurbo(struct jpegEncoder* enc, const byte* yuyv, byte** buf,
+		size_t* capacity)
+{
+	exitWithError("Built without TurboJPEG, make with TURBOJPEG=1.");
+	return 0;
+}
+
+void destroyTurbo(struct jpegEncoder* enc)
+{
+}
+
+#endif
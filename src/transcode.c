@@ -0,0 +1,211 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Lossless re-encoding of JPEG frames through their DCT coefficients.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#include "../headers/transcode.h"
+
+// Jump back out of libjpeg rather than exiting on a corrupt frame
+void transcodeErrorExit(j_common_ptr cinfo)
+{
+	struct transcodeError* err = (struct transcodeError*)cinfo->err;
+	longjmp(err->escape, 1);
+}
+
+// Corrupt data warnings are expected from a camera, keep them quiet
+void transcodeMessage(j_common_ptr cinfo)
+{
+}
+
+void initTranscoder(struct jpegTranscoder* tc)
+{
+	memset(tc, 0, sizeof(struct jpegTranscoder));
+	tc->src.err = jpeg_std_error(&tc->err.pub);
+	tc->err.pub.error_exit = transcodeErrorExit;
+	tc->err.pub.output_message = transcodeMessage;
+	tc->dst.err = &tc->err.pub;
+	jpeg_create_decompress(&tc->src);
+	jpeg_create_compress(&tc->dst);
+	jpeg_save_markers(&tc->src, HCAM_MARKER, 0xFFFF);
+}
+
+// The frame's HCAM segment, if it has one
+bool readFrameTag(j_decompress_ptr cinfo, struct frameTag* ft)
+{
+	jpeg_saved_marker_ptr m;
+	for(m = cinfo->marker_list; m != NULL; m = m->next)
+	{
+		if(m->marker == HCAM_MARKER && m->data_length >= HCAM_TAG_LENGTH &&
+				memcmp(m->data, HCAM_ID, 4) == 0)
+		{
+			ft->flags = m->data[5];
+			ft->tablesId = m->data[6];
+			ft->sequence = ((uint32_t)m->data[7] << 24) | (m->data[8] << 16) |
+					(m->data[9] << 8) | m->data[10];
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+// Carry the frame's other APP11 segments, a replenishment map, across
+void copyOtherSegments(j_decompress_ptr src, j_compress_ptr dst)
+{
+	jpeg_saved_marker_ptr m;
+	for(m = src->marker_list; m != NULL; m = m->next)
+	{
+		if(m->marker == HCAM_MARKER && (m->data_length < 4 ||
+				memcmp(m->data, HCAM_ID, 4) != 0))
+		{
+			jpeg_write_marker(dst, m->marker, m->data, m->data_length);
+		}
+	}
+}
+
+// Set the output tables to libjpeg's standard ones for a quality, never
+// finer than the frame's own, and divide every coefficient down to them
+// with rounding. Each coefficient is dequantised with the table the frame
+// was read with, so the result is what quantising at the new steps would
+// have given, less the rounding already done.
+void requantise(struct jpegTranscoder* tc, jvirt_barray_ptr* coefs,
+		unsigned int quality)
+{
+	j_decompress_ptr		src = &tc->src;
+	j_compress_ptr			dst = &tc->dst;
+	jpeg_component_info*	comp;
+	JQUANT_TBL*				tbl;
+	JBLOCKARRAY				row;
+	JCOEFPTR				block;
+	UINT16*					from;
+	UINT16*					to;
+	JDIMENSION				r, b;
+	int						ci, k, v;
+	jpeg_set_quality(dst, quality, TRUE); // tables 0 and 1
+	for(ci = 0; ci < dst->num_components; ci++)
+	{
+		comp = &dst->comp_info[ci];
+		tbl = dst->quant_tbl_ptrs[comp->quant_tbl_no];
+		if(comp->quant_tbl_no > 1) // a third table, treat as chroma
+		{
+			memcpy(tbl->quantval, dst->quant_tbl_ptrs[1]->quantval,
+					sizeof(tbl->quantval));
+		}
+		from = src->comp_info[ci].quant_table->quantval;
+		for(k = 0; k < DCTSIZE2; k++)
+		{
+			if(tbl->quantval[k] < from[k]) tbl->quantval[k] = from[k];
+		}
+	}
+	for(ci = 0; ci < src->num_components; ci++)
+	{
+		comp = &src->comp_info[ci];
+		from = comp->quant_table->quantval;
+		to = dst->quant_tbl_ptrs[dst->comp_info[ci].quant_tbl_no]->quantval;
+		if(memcmp(from, to, sizeof(UINT16) * DCTSIZE2) == 0) continue;
+		for(r = 0; r < comp->height_in_blocks; r++)
+		{
+			row = src->mem->access_virt_barray((j_common_ptr)src, coefs[ci],
+					r, 1, TRUE);
+			for(b = 0; b < comp->width_in_blocks; b++)
+			{
+				block = row[0][b];
+				for(k = 0; k < DCTSIZE2; k++)
+				{
+					if(block[k] == 0) continue; // most of them
+					v = block[k] * from[k];
+					block[k] = (JCOEF)(v >= 0 ? (v + to[k] / 2) / to[k] :
+							-((-v + to[k] / 2) / to[k]));
+				}
+			}
+		}
+	}
+}
+
+// Re-encode a complete JPEG without decoding it to pixels into *buf, grown
+// as needed. With a quality the coefficients are requantised to it, else
+// they are kept exactly; with arithmetic set they are arithmetic coded, and
+// lossless Huffman output gets tables optimised for the frame. The output is
+// tagged with an HCAM segment carrying the frame's own sequence number and
+// replenishment flags if it was tagged, sequence if not, followed by any
+// HMAP segment the frame had. Returns the length, or 0 if the frame could
+// not be read, in which case both objects are reset for the next frame.
+size_t transcodeJpeg(struct jpegTranscoder* tc, const byte* jpg,
+		size_t len, unsigned int quality, bool arithmetic, uint32_t sequence,
+		byte** buf, size_t* capacity)
+{
+	jvirt_barray_ptr*	coefs;
+	struct frameTag		ft, from;
+	if(setjmp(tc->err.escape))
+	{
+		jpeg_abort_decompress(&tc->src);
+		jpeg_abort_compress(&tc->dst);
+		tc->failures++;
+		return 0;
+	}
+	jpeg_mem_src(&tc->src, jpg, len);
+	jpeg_read_header(&tc->src, TRUE);
+	coefs = jpeg_read_coefficients(&tc->src);
+	jpeg_copy_critical_parameters(&tc->src, &tc->dst);
+	if(quality > 0) requantise(tc, coefs, quality);
+	tc->dst.arith_code = arithmetic;
+	// a second pass for optimal Huffman tables costs more than requantising,
+	// so only lossless recodes, whose whole point is size, make it
+	tc->dst.optimize_coding = quality == 0 && !arithmetic;
+	setBufferDest(&tc->dst, &tc->dest, buf, capacity);
+	jpeg_write_coefficients(&tc->dst, coefs);
+	ft.flags = arithmetic ? HCAM_ARITHMETIC : 0;
+	ft.tablesId = 0;
+	ft.sequence = sequence;
+	if(readFrameTag(&tc->src, &from))
+	{
+		ft.flags |= from.flags & (HCAM_KEY | HCAM_DELTA);
+		ft.sequence = from.sequence;
+	}
+	writeFrameTag(&tc->dst, &ft);
+	copyOtherSegments(&tc->src, &tc->dst);
+	jpeg_finish_compress(&tc->dst);
+	jpeg_finish_decompress(&tc->src);
+	return tc->dest.size;
+}
+
+void destroyTranscoder(struct jpegTranscoder* tc)
+{
+	jpeg_destroy_decompress(&tc->src);
+	jpeg_destroy_compress(&tc->dst);
+}
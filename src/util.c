@@ -54,6 +54,29 @@ void xioctl(int fd, int request, void *arg)
 	}
 }
 
+// Milliseconds elapsed since start on the monotonic clock
+double elapsedMs(const struct timespec* start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000.0 +
+			(now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+// Current CLOCK_MONOTONIC time in microseconds
+uint64_t monotonicUs()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// A timestamp, such as a V4L2 buffer's, in microseconds
+uint64_t timevalUs(const struct timeval* tv)
+{
+	return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
 // Convert byte stream to integer
 uint16_t byteToInt(byte bytes[2])
 {
@@ -62,16 +85,3 @@ uint16_t byteToInt(byte bytes[2])
 	rv += (bytes[0] & 0xFF);
 	return rv;
 }
-
-int* prepareDataFile(const char* imagePath)
-{
-    // Create a buffer for the name of the image
-    char out_name[256];
-    // Set the name of the image
-    sprintf(out_name, "%s/out.data", imagePath);
-    // Create an output file
-    int* fout = (int*)malloc(sizeof(int));
-    *fout = open(out_name, O_CREAT | O_RDWR | O_NONBLOCK, 000777);
-	if (*fout == -1) exitWithError(out_name);
-	return fout;
-}
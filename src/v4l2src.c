@@ -0,0 +1,430 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Video for Linux Two camera frame source.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// Code built with inspiration from "Video Grabber example using libv4l -
+// Part I. Video for Linux Two API Specification" by Mauro Carvalho Chehab
+// (mchehab@infradead.org) available at:
+// http://linuxtv.org/downloads/v4l-dvb-apis/v4l2grab-example.html
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#include "../headers/frmsrc.h"
+
+// Open the camera device as a file
+void openDevice(const char* location, int* fd)
+{
+	// Non-blocking so that VIDIOC_DQBUF never stalls once poll() has returned
+	*fd = open(location, O_RDWR | O_NONBLOCK, 0);
+	if(*fd == -1)
+	{
+		exitWithError("Open camera failed");
+	}
+	else
+	{
+		printf("Opened Camera");
+	}
+}
+
+// Get the capabilities of the camera device
+// as described here:
+// http://linuxtv.org/downloads/v4l-dvb-apis/vidioc-querycap.html#device-capabi
+// lities
+void getCapabilities(int* fd)
+{
+	struct v4l2_capability cap;
+	xioctl(*fd, VIDIOC_QUERYCAP, &cap);
+	printf("Capabilities: %x\nDriver: %s\n", cap.capabilities, cap.driver);
+}
+
+// Close the camera device
+void closeDevice(int* fd)
+{
+	if(*fd != -1) close(*fd);
+	printf("Close device successful (%d)", *fd);
+	*fd = -1;
+	return;
+}
+
+// Get the format in which the camera driver provides frames from the camera
+struct imgDetails getFrameFormat(int* fd)
+{
+	struct imgDetails det; // struct to hold image information
+	struct v4l2_format fmt; // the v4l2 struct for frame format
+	CLEAR(fmt); // clear this structs memory
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE; // we are performing video capture
+    xioctl(*fd, VIDIOC_G_FMT, &fmt); // request the format from the driver
+    det.width = fmt.fmt.pix.width; // set the image width for later on
+    det.height = fmt.fmt.pix.height; // set the image height for later on
+    det.size = det.width*det.height*3; // set the image size for later on
+    return det;
+}
+
+// Check whether the driver can deliver frames in a pixel format
+bool formatOffered(int* fd, uint32_t pixelformat)
+{
+	struct v4l2_fmtdesc desc;
+	CLEAR(desc);
+	desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	while(ioctl(*fd, VIDIOC_ENUM_FMT, &desc) == 0) // walk the format list
+	{
+		if(desc.pixelformat == pixelformat) return TRUE;
+		desc.index++;
+	}
+	return FALSE;
+}
+
+// Distance between a supported frame size and the one asked for
+unsigned int sizeDistance(unsigned int w, unsigned int h, unsigned int wantW,
+		unsigned int wantH)
+{
+	return (w > wantW ? w - wantW : wantW - w) +
+			(h > wantH ? h - wantH : wantH - h);
+}
+
+// Clamp a value to a stepwise range and round it to the nearest step
+unsigned int clampToStep(unsigned int v, unsigned int min, unsigned int max,
+		unsigned int step)
+{
+	if(v < min) v = min;
+	if(v > max) v = max;
+	if(step > 1) v = min + ((v - min + step / 2) / step) * step;
+	return v > max ? max : v;
+}
+
+// Pick the supported frame size closest to the one asked for. Drivers list
+// either discrete sizes or a stepwise/continuous range.
+void chooseFrameSize(int* fd, uint32_t pixelformat, unsigned int* width,
+		unsigned int* height)
+{
+	struct v4l2_frmsizeenum	fsz;
+	unsigned int			bestW = *width, bestH = *height, best = ~0u, d;
+	CLEAR(fsz);
+	fsz.pixel_format = pixelformat;
+	while(ioctl(*fd, VIDIOC_ENUM_FRAMESIZES, &fsz) == 0)
+	{
+		if(fsz.type == V4L2_FRMSIZE_TYPE_DISCRETE)
+		{
+			d = sizeDistance(fsz.discrete.width, fsz.discrete.height,
+					*width, *height);
+			if(d < best)
+			{
+				best = d;
+				bestW = fsz.discrete.width;
+				bestH = fsz.discrete.height;
+			}
+		}
+		else // stepwise or continuous, only one entry is reported
+		{
+			bestW = clampToStep(*width, fsz.stepwise.min_width,
+					fsz.stepwise.max_width, fsz.stepwise.step_width);
+			bestH = clampToStep(*height, fsz.stepwise.min_height,
+					fsz.stepwise.max_height, fsz.stepwise.step_height);
+			break;
+		}
+		fsz.index++;
+	}
+	*width = bestW;
+	*height = bestH;
+}
+
+// Pick the supported frame interval closest to 1/fps for the chosen size,
+// compared in microseconds
+struct v4l2_fract chooseFrameInterval(int* fd, uint32_t pixelformat,
+		unsigned int width, unsigned int height, int fps)
+{
+	struct v4l2_frmivalenum	fiv;
+	struct v4l2_fract		best = {1, fps};
+	long					want = 1000000L / fps, us, bestDiff = -1, diff;
+	CLEAR(fiv);
+	fiv.pixel_format = pixelformat;
+	fiv.width = width;
+	fiv.height = height;
+	while(ioctl(*fd, VIDIOC_ENUM_FRAMEINTERVALS, &fiv) == 0)
+	{
+		if(fiv.type == V4L2_FRMIVAL_TYPE_DISCRETE)
+		{
+			us = 1000000L * fiv.discrete.numerator / fiv.discrete.denominator;
+			diff = us > want ? us - want : want - us;
+			if(bestDiff < 0 || diff < bestDiff)
+			{
+				bestDiff = diff;
+				best = fiv.discrete;
+			}
+		}
+		else // stepwise or continuous, clamp to the reported range
+		{
+			us = 1000000L * fiv.stepwise.min.numerator /
+					fiv.stepwise.min.denominator;
+			if(want < us) best = fiv.stepwise.min;
+			us = 1000000L * fiv.stepwise.max.numerator /
+					fiv.stepwise.max.denominator;
+			if(want > us) best = fiv.stepwise.max;
+			break;
+		}
+		fiv.index++;
+	}
+	return best;
+}
+
+// Ask the sensor to time frames itself at the chosen interval
+void setFrameInterval(int* fd, struct v4l2_fract interval)
+{
+	struct v4l2_streamparm parm;
+	CLEAR(parm);
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	xioctl(*fd, VIDIOC_G_PARM, &parm);
+	if(!(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME))
+	{
+		printf("Camera cannot set its frame rate\n");
+		return;
+	}
+	parm.parm.capture.timeperframe = interval;
+	xioctl(*fd, VIDIOC_S_PARM, &parm);
+	interval = parm.parm.capture.timeperframe; // what the driver settled on
+	printf("Frame interval: %u/%u s\n", interval.numerator,
+			interval.denominator);
+}
+
+// Choose the pixel format, frame size and frame interval to capture with and
+// set them on the driver. Compressed MJPEG is preferred whenever the sensor
+// offers it because the frames can then be passed through without being
+// encoded in software. Capturing at the size that is downlinked saves all
+// the conversion and encoding work of a larger frame.
+uint32_t negotiateFormat(int* fd, const struct srcConfig* cfg)
+{
+	struct v4l2_format	fmt;
+	uint32_t			pixelformat = V4L2_PIX_FMT_YUYV;
+	unsigned int		width, height;
+	if(cfg->pixelformat != V4L2_PIX_FMT_YUYV &&
+			formatOffered(fd, V4L2_PIX_FMT_MJPEG))
+	{
+		pixelformat = V4L2_PIX_FMT_MJPEG;
+	}
+	else if(cfg->pixelformat == V4L2_PIX_FMT_MJPEG)
+	{
+		printf("Camera does not offer MJPEG, capturing YUYV\n");
+	}
+	CLEAR(fmt);
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	xioctl(*fd, VIDIOC_G_FMT, &fmt); // start from the current geometry
+	width = cfg->width ? cfg->width : fmt.fmt.pix.width;
+	height = cfg->height ? cfg->height : fmt.fmt.pix.height;
+	chooseFrameSize(fd, pixelformat, &width, &height);
+	fmt.fmt.pix.pixelformat = pixelformat;
+	fmt.fmt.pix.width = width;
+	fmt.fmt.pix.height = height;
+	fmt.fmt.pix.field = V4L2_FIELD_ANY;
+	xioctl(*fd, VIDIOC_S_FMT, &fmt);
+	if(fmt.fmt.pix.pixelformat != pixelformat)
+	{
+		exitWithError("Camera refused the negotiated pixel format");
+	}
+	printf("Frame size: %ux%u\n", fmt.fmt.pix.width, fmt.fmt.pix.height);
+	if(cfg->fps > 0)
+	{
+		setFrameInterval(fd, chooseFrameInterval(fd, pixelformat,
+				fmt.fmt.pix.width, fmt.fmt.pix.height, cfg->fps));
+	}
+	return pixelformat;
+}
+
+// Get the struct to be sent to v4l2 to retrieve the image data
+struct v4l2_requestbuffers getReqBufs(uint nbuffers, uint minbuffers, int* fd)
+{
+	struct v4l2_requestbuffers reqbuf;
+	CLEAR(reqbuf); // Clear the required memory
+	reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE; // we are capturing video
+	reqbuf.memory = V4L2_MEMORY_MMAP; // map kernel-space memory to user-space
+	reqbuf.count = nbuffers; // the number of frames we wish to retrieve
+	xioctl(*fd, VIDIOC_REQBUFS, &reqbuf); // request the buffers
+	if (reqbuf.count < minbuffers)
+	{
+		// Should never be w/out enough memory unless other proc is hogging
+		printf("Not enough buffer memory - trying again\n");
+	}
+	return reqbuf;
+}
+
+// Map the buffer of image data from kernel to user space
+void mapBuffer(const struct v4l2_requestbuffers reqbuf, int nbuffers,
+		struct v4l2_buffer buf, struct buffer* buffers, int* fd)
+{
+	CLEAR(buf); // clear the v4l2 frame buffer struct
+	buf.type = reqbuf.type; // we are capturing video
+	buf.memory = V4L2_MEMORY_MMAP; // we are mapping from kernel-space to user
+	buf.index = nbuffers; // the number of buffers requested
+	xioctl(*fd, VIDIOC_QUERYBUF, &buf); // query v4l2 for these buffers
+	// Set the length of the buffer pointer struct to the number of buffers
+	// returned by v4l2
+	buffers[nbuffers].length = buf.length;
+	// Perform the mapping, with the pointer of the memory mapped stored in
+	// the user-space buffer pointer struct
+	buffers[nbuffers].start = (byte*)mmap(NULL, buf.length,
+			PROT_READ | PROT_WRITE, MAP_SHARED, *fd, buf.m.offset);
+	// Memory mapping should not fail is performed on a correct fp for a
+	// camera. If mmap does fail in testing, reasons for failure available
+	// here: http://pubs.opengroup.org/onlinepubs/009695399/functions/mmap.html
+	if (MAP_FAILED == buffers[nbuffers].start)
+	{
+		exitWithError("Memory mapping failed.");
+	}
+}
+
+// Queue a buffer capture in the V4L2 driver
+void queueBuffer(int i, int* fd)
+{
+	struct v4l2_buffer buf;
+	CLEAR(buf);
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	buf.index = i;
+	xioctl(*fd, VIDIOC_QBUF, &buf);
+}
+
+// Dequeue whichever buffer the driver has filled. Returns FALSE if no buffer
+// was ready (the fd is non-blocking), otherwise buf holds the real index.
+bool dequeueBuffer(struct v4l2_buffer* buf, int* fd)
+{
+	CLEAR(*buf); // clear from the buffer object all previous settings applied
+	buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE; // this is a video capture buffer
+	buf->memory = V4L2_MEMORY_MMAP; // we are using kernel memory mapping
+	if(ioctl(*fd, VIDIOC_DQBUF, buf) == -1)
+	{
+		if(errno == EAGAIN || errno == EINTR) return FALSE;
+		exitWithError("Dequeue buffer failed");
+	}
+	return TRUE;
+}
+
+// Turn on video streaming - this is the point at which the LED on the
+// camera should light up
+bool turnOnCamera(int* fd, bool streamOn, int* imageCaptureType)
+{
+	if (!streamOn) {
+		ioctl(*fd, VIDIOC_STREAMON, imageCaptureType);
+		streamOn = TRUE;
+	}
+	return streamOn;
+}
+
+// Wait for the driver to fill a buffer and hand it out as a frame
+bool nextV4l2Frame(struct frameSource* src, struct frame* frm)
+{
+	struct v4l2_buffer	buf;
+	struct pollfd		pfd;
+	int					ready;
+	pfd.fd = src->fd;
+	pfd.events = POLLIN;
+	ready = poll(&pfd, 1, CAPTURE_TIMEOUT_MS); // wait for a filled buffer
+	if(ready == -1)
+	{
+		if(errno == EINTR) return FALSE;
+		exitWithError("Polling camera failed");
+	}
+	if(ready == 0)
+	{
+		printf("Capture timed out\n");
+		return FALSE;
+	}
+	if(!dequeueBuffer(&buf, &src->fd)) return FALSE;
+	__atomic_fetch_sub(&src->stats.queued, 1, __ATOMIC_RELAXED);
+	trackSequence(&src->stats, buf.sequence);
+	frm->index = buf.index; // track the buffer by its real index
+	frm->data = src->bufs[buf.index].start;
+	frm->bytesused = buf.bytesused;
+	frm->sequence = buf.sequence;
+	frm->timestamp = buf.timestamp;
+	return TRUE;
+}
+
+// Give the buffer straight back to the driver
+void releaseV4l2Frame(struct frameSource* src, struct frame* frm)
+{
+	queueBuffer(frm->index, &src->fd);
+	__atomic_fetch_add(&src->stats.queued, 1, __ATOMIC_RELAXED);
+}
+
+// Turn the stream off, this will turn off the camera's LED light, then unmap
+// the buffers and close the device
+void closeV4l2Source(struct frameSource* src)
+{
+	int				type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	unsigned int	i;
+	ioctl(src->fd, VIDIOC_STREAMOFF, &type);
+	for (i = 0; i < src->nbuffers; ++i) // unmap memory
+	{
+		munmap(src->bufs[i].start, src->bufs[i].length);
+	}
+	free(src->bufs);
+	closeDevice(&src->fd);
+}
+
+// Open the camera, map a ring of buffers from kernel space and queue every
+// one of them to the driver so it always has somewhere to capture
+void openV4l2Source(struct frameSource* src, const struct srcConfig* cfg)
+{
+	struct v4l2_buffer 			buf;
+	struct v4l2_requestbuffers 	reqbuf;
+	unsigned int 				n_buffers, i;
+	int							type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	CLEAR(buf);
+	openDevice(cfg->location, &src->fd);
+	getCapabilities(&src->fd);
+	src->pixelformat = negotiateFormat(&src->fd, cfg);
+	src->det = getFrameFormat(&src->fd); // get video format details
+	reqbuf = getReqBufs(cfg->nbuffers, MIN_CAPTURE_BUFFERS, &src->fd);
+	src->nbuffers = reqbuf.count;
+	src->bufs = (struct buffer*)calloc(reqbuf.count, sizeof(struct buffer));
+	// If allocation fails
+	if (src->bufs == NULL) exitWithError("Could not allocate buffers.");
+	// Map the memory in kernel space to user space to access video efficiently
+	for (n_buffers = 0; n_buffers < reqbuf.count; n_buffers++)
+	{
+		mapBuffer(reqbuf, n_buffers, buf, src->bufs, &src->fd);
+	}
+	for(i = 0; i < reqbuf.count; i++) queueBuffer(i, &src->fd);
+	src->stats.queued = reqbuf.count;
+	src->next = nextV4l2Frame;
+	src->release = releaseV4l2Frame;
+	src->close = closeV4l2Source;
+	turnOnCamera(&src->fd, FALSE, &type); // turn on camera
+	printf("Capturing %s with %u buffers\n",
+			src->pixelformat == V4L2_PIX_FMT_MJPEG ? "MJPEG" : "YUYV",
+			reqbuf.count);
+}
@@ -0,0 +1,445 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// YUYV to YUV 4:4:4 conversion kernels with runtime CPU dispatch.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+#include "../headers/yuvconv.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+	#define HAVE_X86_KERNELS
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	#include <arm_neon.h>
+	#define HAVE_NEON_KERNEL
+	#if defined(__arm__)
+		#include <sys/auxv.h>
+		#include <asm/hwcap.h>
+	#endif
+#endif
+
+// Pixel pairs converted by the start-up self check
+#define CHECK_PAIRS 1031
+
+struct convertKernel convertKernel =
+		{"scalar", convertYUYVScalar, splitYUYVScalar, sadYUYVScalar};
+
+// Reference conversion, one pixel pair at a time
+void convertYUYVScalar(const byte* yuyv, byte* yuv, size_t pairs)
+{
+	size_t i;
+	for(i = 0; i < pairs; i++, yuyv += 4, yuv += 6)
+	{
+		yuv[0] = yuyv[0]; //y0 = y
+		yuv[1] = yuyv[1]; //u0 = u
+		yuv[2] = yuyv[3]; //v0 = v
+		yuv[3] = yuyv[2]; //y0 = y'
+		yuv[4] = yuyv[1]; //u0 = u
+		yuv[5] = yuyv[3]; //v0 = v
+	}
+}
+
+// Reference plane split, one pixel pair at a time
+void splitYUYVScalar(const byte* yuyv, byte* y, byte* cb, byte* cr,
+		size_t pairs)
+{
+	size_t i;
+	for(i = 0; i < pairs; i++, yuyv += 4)
+	{
+		y[2 * i] = yuyv[0];
+		y[2 * i + 1] = yuyv[2];
+		cb[i] = yuyv[1];
+		cr[i] = yuyv[3];
+	}
+}
+
+// Block difference over part of an MCU, for blocks cut by the frame edge
+uint32_t sadYUYVClipped(const byte* a, const byte* b, size_t stride,
+		unsigned int width, unsigned int rows)
+{
+	uint32_t		sum, peak = 0;
+	unsigned int	r, i;
+	for(r = 0; r < rows; r++, a += stride, b += stride)
+	{
+		for(i = 0, sum = 0; i < width; i++) sum += abs((int)a[i] - (int)b[i]);
+		if(sum > peak) peak = sum;
+	}
+	return peak;
+}
+
+// Reference block difference
+uint32_t sadYUYVScalar(const byte* a, const byte* b, size_t stride)
+{
+	return sadYUYVClipped(a, b, stride, SAD_BLOCK_BYTES, SAD_BLOCK_ROWS);
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Every 32 input bytes (8 pairs) become 48 output bytes. Each 16 bytes of
+// output is one byte shuffle of a 16 byte input window, starting at input
+// byte 0, 8 and 16 of the block respectively.
+static const byte shuffleMasks[3][16] __attribute__((aligned(16))) =
+{
+	{0, 1, 3, 2, 1, 3, 4, 5, 7, 6, 5, 7, 8, 9, 11, 10},
+	{1, 3, 4, 5, 7, 6, 5, 7, 8, 9, 11, 10, 9, 11, 12, 13},
+	{7, 6, 5, 7, 8, 9, 11, 10, 9, 11, 12, 13, 15, 14, 13, 15}
+};
+
+// SSE2 has no byte shuffle. Each pair is widened to a 64 bit lane and the
+// six output bytes are assembled with shifts and masks, then written with
+// overlapping 8 byte stores. The last store of a block spills two bytes that
+// the next pair overwrites, so at least one pair is always left for the
+// scalar tail.
+__attribute__((target("sse2")))
+void convertYUYVSSE2(const byte* yuyv, byte* yuv, size_t pairs)
+{
+	const __m128i	zero = _mm_setzero_si128();
+	const __m128i	lowMask = _mm_set1_epi64x(0xFFFF);
+	const __m128i	vMask = _mm_set1_epi64x(0xFF0000);
+	const __m128i	y1Mask = _mm_set1_epi64x(0xFF000000);
+	const __m128i	uMask = _mm_set1_epi64x(0xFF00000000LL);
+	const __m128i	v2Mask = _mm_set1_epi64x(0xFF0000000000LL);
+	__m128i			in, lanes[2], out;
+	size_t			i;
+	int				h;
+	for(i = 0; i + 4 < pairs; i += 4, yuyv += 16, yuv += 24)
+	{
+		in = _mm_loadu_si128((const __m128i*)yuyv);
+		lanes[0] = _mm_unpacklo_epi32(in, zero);
+		lanes[1] = _mm_unpackhi_epi32(in, zero);
+		for(h = 0; h < 2; h++)
+		{
+			out = _mm_and_si128(lanes[h], lowMask); // Y0 U
+			out = _mm_or_si128(out, _mm_and_si128(_mm_srli_epi64(lanes[h], 8),
+					vMask)); // V
+			out = _mm_or_si128(out, _mm_and_si128(_mm_slli_epi64(lanes[h], 8),
+					y1Mask)); // Y1
+			out = _mm_or_si128(out, _mm_and_si128(
+					_mm_slli_epi64(lanes[h], 24), uMask)); // U
+			out = _mm_or_si128(out, _mm_and_si128(
+					_mm_slli_epi64(lanes[h], 16), v2Mask)); // V
+			_mm_storel_epi64((__m128i*)(yuv + h * 12), out);
+			_mm_storel_epi64((__m128i*)(yuv + h * 12 + 6),
+					_mm_srli_si128(out, 8));
+		}
+	}
+	convertYUYVScalar(yuyv, yuv, pairs - i);
+}
+
+__attribute__((target("ssse3")))
+void convertYUYVSSSE3(const byte* yuyv, byte* yuv, size_t pairs)
+{
+	const __m128i	m0 = _mm_load_si128((const __m128i*)shuffleMasks[0]);
+	const __m128i	m1 = _mm_load_si128((const __m128i*)shuffleMasks[1]);
+	const __m128i	m2 = _mm_load_si128((const __m128i*)shuffleMasks[2]);
+	size_t			i;
+	for(i = 0; i + 8 <= pairs; i += 8, yuyv += 32, yuv += 48)
+	{
+		_mm_storeu_si128((__m128i*)yuv, _mm_shuffle_epi8(
+				_mm_loadu_si128((const __m128i*)yuyv), m0));
+		_mm_storeu_si128((__m128i*)(yuv + 16), _mm_shuffle_epi8(
+				_mm_loadu_si128((const __m128i*)(yuyv + 8)), m1));
+		_mm_storeu_si128((__m128i*)(yuv + 32), _mm_shuffle_epi8(
+				_mm_loadu_si128((const __m128i*)(yuyv + 16)), m2));
+	}
+	convertYUYVScalar(yuyv, yuv, pairs - i);
+}
+
+// Gather the lumas of 8 pairs into the low half of one register and the
+// chromas into the high half of another, then store each half
+__attribute__((target("ssse3")))
+void splitYUYVSSSE3(const byte* yuyv, byte* y, byte* cb, byte* cr,
+		size_t pairs)
+{
+	const __m128i	lumaMask = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14,
+			-1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i	chromaMask = _mm_setr_epi8(1, 5, 9, 13, 3, 7, 11, 15,
+			-1, -1, -1, -1, -1, -1, -1, -1);
+	__m128i			lo, hi, luma, chroma;
+	size_t			i;
+	for(i = 0; i + 8 <= pairs; i += 8, yuyv += 32)
+	{
+		lo = _mm_loadu_si128((const __m128i*)yuyv);
+		hi = _mm_loadu_si128((const __m128i*)(yuyv + 16));
+		luma = _mm_unpacklo_epi64(_mm_shuffle_epi8(lo, lumaMask),
+				_mm_shuffle_epi8(hi, lumaMask));
+		chroma = _mm_unpacklo_epi32(_mm_shuffle_epi8(lo, chromaMask),
+				_mm_shuffle_epi8(hi, chromaMask)); // Cb Cb Cr Cr
+		_mm_storeu_si128((__m128i*)(y + 2 * i), luma);
+		_mm_storel_epi64((__m128i*)(cb + i), chroma);
+		_mm_storel_epi64((__m128i*)(cr + i), _mm_srli_si128(chroma, 8));
+	}
+	splitYUYVScalar(yuyv, y + 2 * i, cb + i, cr + i, pairs - i);
+}
+
+// psadbw sums the differences of each 8 byte half of a register into a 64
+// bit lane, two registers a row. A row sums to 8160 at most, so the four
+// partial sums of a row fit one 16 bit lane, where pmaxsw keeps the peak.
+__attribute__((target("sse2")))
+uint32_t sadYUYVSSE2(const byte* a, const byte* b, size_t stride)
+{
+	__m128i	row, peak = _mm_setzero_si128();
+	int		r;
+	for(r = 0; r < SAD_BLOCK_ROWS; r++, a += stride, b += stride)
+	{
+		row = _mm_add_epi64(_mm_sad_epu8(
+				_mm_loadu_si128((const __m128i*)a),
+				_mm_loadu_si128((const __m128i*)b)), _mm_sad_epu8(
+				_mm_loadu_si128((const __m128i*)(a + 16)),
+				_mm_loadu_si128((const __m128i*)(b + 16))));
+		peak = _mm_max_epi16(peak, _mm_add_epi64(row,
+				_mm_srli_si128(row, 8)));
+	}
+	return (uint32_t)_mm_cvtsi128_si32(peak);
+}
+
+// One 32 byte row per vpsadbw, its four partial sums folded into lane 0
+__attribute__((target("avx2")))
+uint32_t sadYUYVAVX2(const byte* a, const byte* b, size_t stride)
+{
+	__m256i	sad;
+	__m128i	row, peak = _mm_setzero_si128();
+	int		r;
+	for(r = 0; r < SAD_BLOCK_ROWS; r++, a += stride, b += stride)
+	{
+		sad = _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)a),
+				_mm256_loadu_si256((const __m256i*)b));
+		row = _mm_add_epi64(_mm256_castsi256_si128(sad),
+				_mm256_extracti128_si256(sad, 1));
+		peak = _mm_max_epi16(peak, _mm_add_epi64(row,
+				_mm_srli_si128(row, 8)));
+	}
+	return (uint32_t)_mm_cvtsi128_si32(peak);
+}
+
+// The AVX2 byte shuffle works within each 128 bit lane, so two of the 16
+// byte windows above are loaded into the lanes of one register. 64 input
+// bytes become three 32 byte stores.
+__attribute__((target("avx2")))
+void convertYUYVAVX2(const byte* yuyv, byte* yuv, size_t pairs)
+{
+	const __m128i	m0 = _mm_load_si128((const __m128i*)shuffleMasks[0]);
+	const __m128i	m1 = _mm_load_si128((const __m128i*)shuffleMasks[1]);
+	const __m128i	m2 = _mm_load_si128((const __m128i*)shuffleMasks[2]);
+	const __m256i	m01 = _mm256_set_m128i(m1, m0);
+	const __m256i	m20 = _mm256_set_m128i(m0, m2);
+	const __m256i	m12 = _mm256_set_m128i(m2, m1);
+	size_t			i;
+	for(i = 0; i + 16 <= pairs; i += 16, yuyv += 64, yuv += 96)
+	{
+		_mm256_storeu_si256((__m256i*)yuv, _mm256_shuffle_epi8(
+				_mm256_loadu2_m128i((const __m128i*)(yuyv + 8),
+				(const __m128i*)yuyv), m01));
+		_mm256_storeu_si256((__m256i*)(yuv + 32), _mm256_shuffle_epi8(
+				_mm256_loadu2_m128i((const __m128i*)(yuyv + 32),
+				(const __m128i*)(yuyv + 16)), m20));
+		_mm256_storeu_si256((__m256i*)(yuv + 64), _mm256_shuffle_epi8(
+				_mm256_loadu2_m128i((const __m128i*)(yuyv + 48),
+				(const __m128i*)(yuyv + 40)), m12));
+	}
+	convertYUYVSSSE3(yuyv, yuv, pairs - i);
+}
+
+#endif
+
+#ifdef HAVE_NEON_KERNEL
+
+// De-interleave 16 pairs into Y0, U, Y1 and V, zip the lumas back together
+// and the chromas with themselves, then store interleaved as Y U V
+void convertYUYVNEON(const byte* yuyv, byte* yuv, size_t pairs)
+{
+	uint8x16x4_t	in;
+	uint8x16x2_t	y, u, v;
+	uint8x16x3_t	out;
+	size_t			i;
+	for(i = 0; i + 16 <= pairs; i += 16, yuyv += 64, yuv += 96)
+	{
+		in = vld4q_u8(yuyv);
+		y = vzipq_u8(in.val[0], in.val[2]);
+		u = vzipq_u8(in.val[1], in.val[1]);
+		v = vzipq_u8(in.val[3], in.val[3]);
+		out.val[0] = y.val[0];
+		out.val[1] = u.val[0];
+		out.val[2] = v.val[0];
+		vst3q_u8(yuv, out);
+		out.val[0] = y.val[1];
+		out.val[1] = u.val[1];
+		out.val[2] = v.val[1];
+		vst3q_u8(yuv + 48, out);
+	}
+	convertYUYVScalar(yuyv, yuv, pairs - i);
+}
+
+void splitYUYVNEON(const byte* yuyv, byte* y, byte* cb, byte* cr,
+		size_t pairs)
+{
+	uint8x16x4_t	in;
+	uint8x16x2_t	luma;
+	size_t			i;
+	for(i = 0; i + 16 <= pairs; i += 16, yuyv += 64)
+	{
+		in = vld4q_u8(yuyv);
+		luma.val[0] = in.val[0];
+		luma.val[1] = in.val[2];
+		vst2q_u8(y + 2 * i, luma);
+		vst1q_u8(cb + i, in.val[1]);
+		vst1q_u8(cr + i, in.val[3]);
+	}
+	splitYUYVScalar(yuyv, y + 2 * i, cb + i, cr + i, pairs - i);
+}
+
+// Absolute differences of a row widened and added pairwise down to two 64
+// bit lanes
+uint32_t sadYUYVNEON(const byte* a, const byte* b, size_t stride)
+{
+	uint16x8_t	sum;
+	uint64x2_t	row;
+	uint32_t	total, peak = 0;
+	int			r;
+	for(r = 0; r < SAD_BLOCK_ROWS; r++, a += stride, b += stride)
+	{
+		sum = vpaddlq_u8(vabdq_u8(vld1q_u8(a), vld1q_u8(b)));
+		sum = vpadalq_u8(sum, vabdq_u8(vld1q_u8(a + 16), vld1q_u8(b + 16)));
+		row = vpaddlq_u32(vpaddlq_u16(sum));
+		total = (uint32_t)(vgetq_lane_u64(row, 0) + vgetq_lane_u64(row, 1));
+		if(total > peak) peak = total;
+	}
+	return peak;
+}
+
+bool neonAvailable()
+{
+	#if defined(__arm__)
+		return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+	#else
+		return true; // NEON is part of the AArch64 base architecture
+	#endif
+}
+
+#endif
+
+// Run a kernel and the scalar reference over a test buffer and make sure
+// they agree byte for byte. An odd pair count exercises the tails; the
+// block differences are taken at every offset in a row, aligned or not.
+bool kernelMatchesScalar(yuyvConverter convert, yuyvSplitter split,
+		yuyvBlockSad sad)
+{
+	byte	*in = (byte*)malloc(CHECK_PAIRS * 4);
+	byte	*want = (byte*)malloc(CHECK_PAIRS * 6);
+	byte	*got = (byte*)malloc(CHECK_PAIRS * 6);
+	size_t	i;
+	bool	match;
+	if(in == NULL || want == NULL || got == NULL)
+	{
+		exitWithError("Could not allocate kernel check buffers.");
+	}
+	for(i = 0; i < CHECK_PAIRS * 4; i++) in[i] = (byte)(i * 37 + (i >> 8));
+	convertYUYVScalar(in, want, CHECK_PAIRS);
+	convert(in, got, CHECK_PAIRS);
+	match = memcmp(want, got, CHECK_PAIRS * 6) == 0;
+	splitYUYVScalar(in, want, want + CHECK_PAIRS * 2, want + CHECK_PAIRS * 3,
+			CHECK_PAIRS);
+	split(in, got, got + CHECK_PAIRS * 2, got + CHECK_PAIRS * 3, CHECK_PAIRS);
+	match = match && memcmp(want, got, CHECK_PAIRS * 4) == 0;
+	for(i = 0; i < SAD_BLOCK_BYTES && match; i++) // stride of 128 bytes
+	{
+		match = sad(in + i, in + i + 1000, 128) ==
+				sadYUYVScalar(in + i, in + i + 1000, 128);
+	}
+	free(in);
+	free(want);
+	free(got);
+	return match;
+}
+
+// Use a kernel if it checks out bit-exact against the scalar routines
+bool tryKernel(const char* name, yuyvConverter convert, yuyvSplitter split,
+		yuyvBlockSad sad)
+{
+	if(!kernelMatchesScalar(convert, split, sad))
+	{
+		printf("Conversion kernel %s does not match scalar, skipped\n", name);
+		return false;
+	}
+	convertKernel.name = name;
+	convertKernel.convert = convert;
+	convertKernel.split = split;
+	convertKernel.sad = sad;
+	return true;
+}
+
+// Pick the fastest conversion kernel the CPU supports. Call once at start-up
+// before any thread converts frames.
+void selectConvertKernel()
+{
+	bool found = false;
+	#ifdef HAVE_X86_KERNELS
+		__builtin_cpu_init();
+		if(!found && __builtin_cpu_supports("avx2"))
+		{
+			found = tryKernel("avx2", convertYUYVAVX2, splitYUYVSSSE3,
+					sadYUYVAVX2);
+		}
+		if(!found && __builtin_cpu_supports("ssse3"))
+		{
+			found = tryKernel("ssse3", convertYUYVSSSE3, splitYUYVSSSE3,
+					sadYUYVSSE2);
+		}
+		if(!found && __builtin_cpu_supports("sse2"))
+		{
+			found = tryKernel("sse2", convertYUYVSSE2, splitYUYVScalar,
+					sadYUYVSSE2);
+		}
+	#endif
+	#ifdef HAVE_NEON_KERNEL
+		if(!found && neonAvailable())
+		{
+			found = tryKernel("neon", convertYUYVNEON, splitYUYVNEON,
+					sadYUYVNEON);
+		}
+	#endif
+	if(!found)
+	{
+		convertKernel.name = "scalar";
+		convertKernel.convert = convertYUYVScalar;
+		convertKernel.split = splitYUYVScalar;
+		convertKernel.sad = sadYUYVScalar;
+	}
+	printf("YUYV conversion kernel: %s\n", convertKernel.name);
+}
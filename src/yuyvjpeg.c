@@ -0,0 +1,418 @@
+// hyper-cam - Interfaces camera sensor with serial communications for
+// autonomous image capture of scientific experiments on embedded Linux
+//
+// Direct YUYV 4:2:2 to baseline JPEG encoder.
+//
+// Copyright (C) 2012 Jacob Appleton
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <www.gnu.org/licenses/>.
+//
+// This software was developed as part of the Scramspace I Flight Experiment,
+// funded by the Australian Space Research Program -
+// http://www.space.gov.au/AUSTRALIANSPACERESEARCHPROGRAM and involving:
+// - The University of Queensland (UQ) - www.uq.edu.au
+// - Australian Government Department of Defence - Defence Science and
+//   Technology Organisation (DSTO) - www.dsto.defence.gov.au
+// - German Aerospace Center (DLR) - www.dlr.de/en/
+// - University of Southern Queensland (USQ) - www.usq.edu.au
+// - BAE Systems - www.baesystems.com
+// - Japan Aerospace Exploration Agency (JAXA) - www.jaxa.jp/index_e.html
+// - University of Minnesota (UMN) - www.umn.edu
+// - AIMTEK, Inc. - www.umn.edu
+// - Australian Youth Aerospace Association (AYAA) - www.ayaa.com.au
+// - Centro Italiano Ricerche Aerospaziali (CIRA) - www.cira.it/en
+// - The University of Adelaide - www.adelaide.edu.au
+// - Teakle Composites - www.cira.colostate.edu
+// - The University of New South Wales (UNSW) - www.unsw.edu.au/
+//
+// You can contact Jacob Appleton via email at: jacob.appleton@uqconnect.edu.au
+
+
+
+#include "../headers/yuyvjpeg.h"
+
+#define JPEG_MARKER		0xFF
+#define JPEG_SOI		0xD8
+#define JPEG_EOI		0xD9
+#define JPEG_SOS		0xDA
+#define JPEG_SOF0		0xC0
+#define JPEG_DHT		0xC4
+#define JPEG_DQT		0xDB
+#define JPEG_DRI		0xDD
+#define JPEG_RST0		0xD0
+
+// Natural order index of each zigzag position, and the reverse
+static const uint8_t zigzagOrder[DCTSIZE2] = {
+	0,  1,  8,  16, 9,  2,  3,  10, 17, 24, 32, 25, 18, 11, 4,  5,
+	12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13, 6,  7,  14, 21, 28,
+	35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+	58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+static const uint8_t zigzagPosition[DCTSIZE2] = {
+	0,  1,  5,  6,  14, 15, 27, 28, 2,  4,  7,  13, 16, 26, 29, 42,
+	3,  8,  12, 17, 25, 30, 41, 43, 9,  11, 18, 24, 31, 40, 44, 53,
+	10, 19, 23, 32, 39, 45, 52, 54, 20, 22, 33, 38, 46, 51, 55, 60,
+	21, 34, 37, 47, 50, 56, 59, 61, 35, 36, 48, 49, 57, 58, 62, 63
+};
+
+// Worst case bytes for one MCU: four blocks of 64 27 bit codes, every byte
+// stuffed, plus a restart marker
+#define MCU_MAX_BYTES	(MCU_BLOCKS * DCTSIZE2 * 4 * 2 + 2)
+
+// Component ids, sampling and quantisation tables, as libjpeg writes them
+static const byte components[3][3] = {
+	{1, 0x21, 0},
+	{2, 0x11, 1},
+	{3, 0x11, 1}
+};
+
+// Code and length of each symbol, as libjpeg's jpeg_make_c_derived_tbl()
+// works them out from the counts per length
+void deriveHuffCodes(struct huffCodes* hc, const JHUFF_TBL* table)
+{
+	unsigned int	length, i, p = 0, code = 0;
+	memset(hc, 0, sizeof(*hc));
+	for(length = 1; length <= 16; length++)
+	{
+		for(i = 0; i < table->bits[length]; i++, p++)
+		{
+			hc->code[table->huffval[p]] = code++;
+			hc->size[table->huffval[p]] = length;
+		}
+		code <<= 1;
+	}
+}
+
+// Take the quantisation and Huffman tables from a configured libjpeg object.
+// The reciprocals fold in the AAN scale of each coefficient and the factor
+// of 8 the transform leaves in, so quantising is a multiply.
+void setDirectTables(struct directEncoder* de, j_compress_ptr cinfo)
+{
+	unsigned int	t, k, n;
+	double			step;
+	for(t = 0; t < 2; t++)
+	{
+		if(cinfo->quant_tbl_ptrs[t] == NULL ||
+				cinfo->dc_huff_tbl_ptrs[t] == NULL ||
+				cinfo->ac_huff_tbl_ptrs[t] == NULL)
+		{
+			exitWithError("Direct encoder needs libjpeg's default tables.");
+		}
+		for(k = 0; k < DCTSIZE2; k++)
+		{
+			n = zigzagOrder[k];
+			de->quant[t][k] = (uint8_t)cinfo->quant_tbl_ptrs[t]->quantval[n];
+			step = 8.0 * cinfo->quant_tbl_ptrs[t]->quantval[n] *
+					aanScale(n % DCTSIZE) * aanScale(n / DCTSIZE);
+			de->recip[t][n] = (float)(1.0 / step);
+		}
+		de->dcTables[t] = *cinfo->dc_huff_tbl_ptrs[t];
+		de->acTables[t] = *cinfo->ac_huff_tbl_ptrs[t];
+		deriveHuffCodes(&de->dc[t], &de->dcTables[t]);
+		deriveHuffCodes(&de->ac[t], &de->acTables[t]);
+	}
+}
+
+// Make room for len more bytes after the ones written
+void reserveBits(struct bitWriter* w, size_t len)
+{
+	size_t	capacity = *w->capacity;
+	if(capacity - w->size >= len) return;
+	if(capacity < AVG_IMG_SIZE) capacity = AVG_IMG_SIZE;
+	while(capacity - w->size < len) capacity *= 2;
+	reserveImage(w->buf, w->capacity, capacity);
+}
+
+void putByte(struct bitWriter* w, byte b)
+{
+	(*w->buf)[w->size++] = b;
+}
+
+void putWord(struct bitWriter* w, unsigned int word)
+{
+	putByte(w, (byte)(word >> 8));
+	putByte(w, (byte)word);
+}
+
+// Write the oldest 32 bits of the accumulator. A word without an 0xFF byte,
+// by far the usual case, is stored whole; otherwise each 0xFF is followed
+// by the stuffed zero byte.
+static inline void flushWord(struct bitWriter* w)
+{
+	uint32_t	word;
+	byte*		out;
+	int			shift;
+	w->bits -= 32;
+	word = (uint32_t)(w->acc >> w->bits);
+	out = *w->buf + w->size;
+	if((((~word) - 0x01010101u) & word & 0x80808080u) == 0) // no 0xFF byte
+	{
+		out[0] = (byte)(word >> 24);
+		out[1] = (byte)(word >> 16);
+		out[2] = (byte)(word >> 8);
+		out[3] = (byte)word;
+		w->size += 4;
+		return;
+	}
+	for(shift = 24; shift >= 0; shift -= 8)
+	{
+		putByte(w, (byte)(word >> shift));
+		if((byte)(word >> shift) == 0xFF) putByte(w, 0);
+	}
+}
+
+// Append n bits, at most 32, to the accumulator
+static inline void putBits(struct bitWriter* w, uint32_t bits, unsigned int n)
+{
+	w->acc = (w->acc << n) | bits;
+	w->bits += n;
+	if(w->bits >= 32) flushWord(w);
+}
+
+// Pad the last byte with ones and write out what is left, as JPEG requires
+// before a restart marker or EOI
+void flushBits(struct bitWriter* w)
+{
+	unsigned int pad = (8 - w->bits % 8) % 8;
+	byte b;
+	putBits(w, (1u << pad) - 1, pad);
+	while(w->bits >= 8)
+	{
+		w->bits -= 8;
+		b = (byte)(w->acc >> w->bits);
+		putByte(w, b);
+		if(b == 0xFF) putByte(w, 0);
+	}
+	w->acc = 0;
+}
+
+// Code a symbol whose low four bits are the size category of value,
+// followed by the value's own bits, in one write
+static inline void putValue(struct bitWriter* w, const struct huffCodes* hc,
+		unsigned int symbol, int value)
+{
+	unsigned int	magnitude = value < 0 ? -value : value;
+	unsigned int	nbits = magnitude ? 32 - __builtin_clz(magnitude) : 0;
+	uint32_t		extra = (uint32_t)(value < 0 ? value - 1 : value) &
+			((1u << nbits) - 1);
+	symbol |= nbits;
+	putBits(w, ((uint32_t)hc->code[symbol] << nbits) | extra,
+			hc->size[symbol] + nbits);
+}
+
+// Quantise one block and Huffman code it. Only the nonzero coefficients
+// the quantiser flags are moved to their zigzag positions, so the AC coder
+// jumps from one to the next rather than test every position for a zero
+// run and most of the block is never looked at again.
+void encodeBlock(struct bitWriter* w, const int16_t* coefs,
+		const float* recip, const struct huffCodes* dc,
+		const struct huffCodes* ac, int* lastDc)
+{
+	int16_t			q[DCTSIZE2];
+	uint64_t		natural = dctKernel.quantise(coefs, recip, q);
+	uint64_t		nonzero = 0;
+	unsigned int	k, run, last = 0;
+	putValue(w, dc, 0, q[0] - *lastDc);
+	*lastDc = q[0];
+	for(natural &= ~(uint64_t)1; natural != 0; natural &= natural - 1)
+	{
+		nonzero |= (uint64_t)1 << zigzagPosition[__builtin_ctzll(natural)];
+	}
+	while(nonzero != 0)
+	{
+		k = __builtin_ctzll(nonzero);
+		nonzero &= nonzero - 1;
+		for(run = k - last - 1; run > 15; run -= 16)
+		{
+			putBits(w, ac->code[0xF0], ac->size[0xF0]); // ZRL
+		}
+		putValue(w, ac, run << 4, q[zigzagOrder[k]]);
+		last = k;
+	}
+	if(last != DCTSIZE2 - 1) putBits(w, ac->code[0], ac->size[0]); // EOB
+}
+
+// Copy an MCU cut off by the right or bottom edge into a whole one, the
+// last pixel pair repeated across and the last line down, as fillRawPlanes()
+// pads for libjpeg
+void padEdgeMcu(byte* edge, const byte* yuyv, size_t stride,
+		unsigned int bytes, unsigned int lines)
+{
+	unsigned int	r, i;
+	const byte*		row;
+	byte*			out;
+	for(r = 0; r < MCU_ROWS; r++)
+	{
+		row = yuyv + (r < lines ? r : lines - 1) * stride;
+		out = edge + r * MCU_BYTES;
+		memcpy(out, row, bytes);
+		for(i = bytes; i < MCU_BYTES; i += 4)
+		{
+			out[i] = row[bytes - 2];
+			out[i + 1] = row[bytes - 3];
+			out[i + 2] = row[bytes - 2];
+			out[i + 3] = row[bytes - 1];
+		}
+	}
+}
+
+// Start a segment of len bytes after its length field
+void putSegment(struct bitWriter* w, byte marker, unsigned int len)
+{
+	putByte(w, JPEG_MARKER);
+	putByte(w, marker);
+	putWord(w, len + 2);
+}
+
+void putHuffTable(struct bitWriter* w, byte id, const JHUFF_TBL* table)
+{
+	unsigned int i, count = 0;
+	for(i = 1; i <= 16; i++) count += table->bits[i];
+	putSegment(w, JPEG_DHT, 1 + 16 + count);
+	putByte(w, id);
+	for(i = 1; i <= 16; i++) putByte(w, table->bits[i]);
+	for(i = 0; i < count; i++) putByte(w, table->huffval[i]);
+}
+
+// Everything before the entropy coded data, in the order libjpeg writes it:
+// SOI, JFIF, the HCAM tag and map, DQT, SOF0, DHT, DRI and SOS
+void putHeaders(struct bitWriter* w, struct jpegEncoder* enc)
+{
+	struct directEncoder*	de = enc->direct;
+	struct frameTag			ft;
+	unsigned int			t, c;
+	static const byte		jfif[14] = {'J', 'F', 'I', 'F', 0, 1, 1, 0,
+			0, 1, 0, 1, 0, 0};
+	reserveBits(w, 1024 + enc->mapLength);
+	putByte(w, JPEG_MARKER);
+	putByte(w, JPEG_SOI);
+	putSegment(w, JPEG_APP0, sizeof(jfif));
+	memcpy(*w->buf + w->size, jfif, sizeof(jfif));
+	w->size += sizeof(jfif);
+	if(enc->abbreviated || enc->flags != 0)
+	{
+		ft.flags = (enc->abbreviated ? HCAM_ABBREVIATED : 0) | enc->flags;
+		ft.tablesId = enc->abbreviated ? enc->quality : 0;
+		ft.sequence = enc->sequence;
+		putSegment(w, HCAM_MARKER, HCAM_TAG_LENGTH);
+		packFrameTag(*w->buf + w->size, &ft);
+		w->size += HCAM_TAG_LENGTH;
+	}
+	if(enc->map != NULL)
+	{
+		putSegment(w, HCAM_MARKER, enc->mapLength);
+		memcpy(*w->buf + w->size, enc->map, enc->mapLength);
+		w->size += enc->mapLength;
+	}
+	for(t = 0; t < 2 && !enc->abbreviated; t++)
+	{
+		putSegment(w, JPEG_DQT, 1 + DCTSIZE2);
+		putByte(w, t);
+		memcpy(*w->buf + w->size, de->quant[t], DCTSIZE2);
+		w->size += DCTSIZE2;
+	}
+	putSegment(w, JPEG_SOF0, 6 + 3 * 3);
+	putByte(w, BITS_IN_JSAMPLE);
+	putWord(w, enc->det.height);
+	putWord(w, enc->det.width);
+	putByte(w, 3);
+	for(c = 0; c < 3; c++)
+	{
+		memcpy(*w->buf + w->size, components[c], 3);
+		w->size += 3;
+	}
+	for(t = 0; t < 2 && !enc->abbreviated; t++)
+	{
+		putHuffTable(w, t, &de->dcTables[t]);
+		putHuffTable(w, 0x10 | t, &de->acTables[t]);
+	}
+	if(enc->cinfo.restart_interval > 0)
+	{
+		putSegment(w, JPEG_DRI, 2);
+		putWord(w, enc->cinfo.restart_interval);
+	}
+	putSegment(w, JPEG_SOS, 1 + 3 * 2 + 3);
+	putByte(w, 3);
+	for(c = 0; c < 3; c++)
+	{
+		putByte(w, components[c][0]);
+		putByte(w, c == 0 ? 0x00 : 0x11);
+	}
+	putByte(w, 0);
+	putByte(w, DCTSIZE2 - 1);
+	putByte(w, 0);
+}
+
+// Encode a YUYV frame as a baseline 4:2:2 JPEG without libjpeg: each 16x8
+// MCU goes from the frame through the fused level shift and DCT kernel, is
+// quantised and Huffman coded straight into *buf, grown as needed. The
+// stream is laid out as libjpeg would write it for the same encoder, tags
+// and restart interval included, so stripes stitch and the ground station
+// decodes it the same way. Returns its length.
+size_t encodeDirect(struct jpegEncoder* enc, const byte* yuyv, byte** buf,
+		size_t* capacity)
+{
+	struct directEncoder*	de = enc->direct;
+	struct bitWriter		w = {buf, capacity, 0, 0, 0};
+	size_t					stride = enc->det.width * 2;
+	unsigned int			cols = (enc->det.width + RAW_MCU_WIDTH - 1) /
+			RAW_MCU_WIDTH;
+	unsigned int			rows = (enc->det.height + MCU_ROWS - 1) / MCU_ROWS;
+	unsigned int			interval = enc->cinfo.restart_interval;
+	unsigned int			x, y, lines, bytes, mcus = 0, restarts = 0;
+	int						lastDc[3] = {0, 0, 0};
+	const byte*				mcu;
+	putHeaders(&w, enc);
+	for(y = 0; y < rows; y++)
+	{
+		lines = enc->det.height - y * MCU_ROWS;
+		for(x = 0; x < cols; x++, mcus++)
+		{
+			reserveBits(&w, MCU_MAX_BYTES);
+			if(interval > 0 && mcus > 0 && mcus % interval == 0)
+			{
+				flushBits(&w);
+				putByte(&w, JPEG_MARKER);
+				putByte(&w, JPEG_RST0 + (restarts++ & 7));
+				lastDc[0] = lastDc[1] = lastDc[2] = 0;
+			}
+			mcu = yuyv + y * MCU_ROWS * stride + x * MCU_BYTES;
+			bytes = stride - x * MCU_BYTES;
+			if(bytes >= MCU_BYTES && lines >= MCU_ROWS)
+			{
+				dctKernel.fdct(mcu, stride, de->coefs);
+			}
+			else
+			{
+				padEdgeMcu(de->edge, mcu, stride,
+						bytes < MCU_BYTES ? bytes : MCU_BYTES,
+						lines < MCU_ROWS ? lines : MCU_ROWS);
+				dctKernel.fdct(de->edge, MCU_BYTES, de->coefs);
+			}
+			encodeBlock(&w, de->coefs, de->recip[0], &de->dc[0], &de->ac[0],
+					&lastDc[0]);
+			encodeBlock(&w, de->coefs + DCTSIZE2, de->recip[0], &de->dc[0],
+					&de->ac[0], &lastDc[0]);
+			encodeBlock(&w, de->coefs + 2 * DCTSIZE2, de->recip[1],
+					&de->dc[1], &de->ac[1], &lastDc[1]);
+			encodeBlock(&w, de->coefs + 3 * DCTSIZE2, de->recip[1],
+					&de->dc[1], &de->ac[1], &lastDc[2]);
+		}
+	}
+	reserveBits(&w, 16);
+	flushBits(&w);
+	putByte(&w, JPEG_MARKER);
+	putByte(&w, JPEG_EOI);
+	return w.size;
+}